@@ -0,0 +1,160 @@
+#include <algorithm>
+#include <iostream>
+#include <cstdlib>
+#include <limits>
+
+#include "fractal_drawing.h"
+#include "development_utils.h"
+#include "test_utils.h"
+
+// Precision::FAST is fine for a view if no more than this fraction of its
+// pixels come out differently from DOUBLE than SINGLE's do.
+constexpr double kMaxExtraDifferingFraction = 0.001; // TUNE.
+
+// Precision::MIXED redoes in double the pixels that float is in doubt about,
+// so it should come out almost exactly as DOUBLE does. What's left is where
+// float went wrong for a whole clump of pixels, without a boundary to show it.
+constexpr double kMaxMixedDifferingFraction = 0.0005; // TUNE.
+
+// Precision::MIXED is for being faster than DOUBLE, and where float does badly
+// it should fall back to about DOUBLE's speed (see kMaxMixedRedoShare), so it
+// may be no slower than this factor of DOUBLE's time, for timing noise.
+constexpr double kMaxMixedSlowdown = 1.2; // TUNE.
+
+// FractalParams::far_field moves where pixels land by a small fraction of a
+// pixel (see far_field.h), so only pixels right on a basin boundary should
+// come out differently.
+constexpr double kMaxFarFieldDifferingFraction = 0.001; // TUNE.
+
+// As kMaxFarFieldDifferingFraction, for high degree polynomials, whose basins
+// far out are wedges with boundaries of their own between every pair, so far
+// more of their pixels are right on one.
+constexpr double kMaxFarFieldManyZerosDifferingFraction = 0.004; // TUNE.
+
+// Past what double-double can resolve, PERTURBATION should come out as
+// Newton's method at reference precision does, bar pixels so close to a basin
+// boundary that the last few bits decide them.
+constexpr double kMaxPastDoubleDoubleDifferingFraction = 0.002; // TUNE.
+
+// Draws the scene with every pixel as a reference orbit of its own (i.e.
+// Newton's method at reference precision), and in PERTURBATION and
+// DOUBLE_DOUBLE, and reports how far the latter are from the former. Returns
+// whether PERTURBATION is within the threshold and is what ChoosePrecision()
+// picks.
+bool ComparePastDoubleDouble(const std::string& name, const FractalParams& params,
+			     ThreadPool& thread_pool) {
+  const AnalyzedPolynomialD p(params.zeros);
+  std::vector<Complex<ReferenceFloat>> reference_zeros;
+  for (const ComplexD& zero : params.zeros) {
+    reference_zeros.emplace_back(zero.r, zero.i);
+  }
+  const Polynomial<ReferenceFloat> reference_polynomial =
+    Polynomial<ReferenceFloat>::FromZeros(reference_zeros);
+  RGBImage reference(params.width, params.height);
+  const uint64_t start_time = Now();
+  for (size_t y = 0; y < params.height; ++y) {
+    for (size_t x = 0; x < params.width; ++x) {
+      const ReferenceOrbit orbit(params, reference_polynomial, p, x, y);
+      PaintZero(reference, x, y, params.colors, p.ClosestZero(orbit.z(orbit.size() - 1)));
+    }
+  }
+  const double reference_ms = Now() - start_time;
+
+  RGBImage perturbed(params.width, params.height);
+  RGBImage double_double(params.width, params.height);
+  const double perturbation_ms = Draw(params, Precision::PERTURBATION, perturbed, thread_pool);
+  const double double_double_ms = Draw(params, Precision::DOUBLE_DOUBLE, double_double, thread_pool);
+  const double perturbation_differing = DifferingFraction(reference, perturbed);
+  const double double_double_differing = DifferingFraction(reference, double_double);
+  const Precision chosen = ChoosePrecision(params);
+  const bool ok = perturbation_differing <= kMaxPastDoubleDoubleDifferingFraction &&
+    chosen == Precision::PERTURBATION;
+  std::cout << name << ": per pixel reference orbits (ms): " << reference_ms
+	    << ", PERTURBATION (ms): " << perturbation_ms
+	    << ", DOUBLE_DOUBLE (ms): " << double_double_ms
+	    << ", differing from reference orbits: PERTURBATION " << 100 * perturbation_differing
+	    << "%, DOUBLE_DOUBLE " << 100 * double_double_differing << "%, chosen: "
+	    << ToString(chosen) << (ok ? "" : " -- over the threshold or not chosen") << std::endl;
+  perturbed.write(TestOutputPath("accuracy_test_output_" + name + ".png"));
+  return ok;
+}
+
+// Draws the scene in DOUBLE, SINGLE, FAST and MIXED, and reports how far the
+// others are from DOUBLE, and how long each took. Returns whether FAST and
+// MIXED are within their thresholds, and MIXED within its time.
+bool Compare(const std::string& name, const FractalParams& params, ThreadPool& thread_pool) {
+  RGBImage reference(params.width, params.height);
+  RGBImage single(params.width, params.height);
+  RGBImage fast(params.width, params.height);
+  RGBImage mixed(params.width, params.height);
+  const double single_ms = Draw(params, Precision::SINGLE, single, thread_pool);
+  const double fast_ms = Draw(params, Precision::FAST, fast, thread_pool);
+  // DOUBLE and MIXED take turns, so that what else is running on the machine
+  // weighs on both alike when comparing their times, and keep going for a few
+  // more turns while MIXED looks too slow, as timings are noisy.
+  double double_ms = std::numeric_limits<double>::infinity();
+  double mixed_ms = std::numeric_limits<double>::infinity();
+  for (int i = 0; i < 15 && (i < 5 || mixed_ms > kMaxMixedSlowdown * double_ms); ++i) {
+    double_ms = std::min(double_ms, Draw(params, Precision::DOUBLE, reference, thread_pool,
+					 Strategy::DYNAMIC_BLOCK_THREADED, std::nullopt, 1));
+    mixed_ms = std::min(mixed_ms, Draw(params, Precision::MIXED, mixed, thread_pool,
+				       Strategy::DYNAMIC_BLOCK_THREADED, std::nullopt, 1));
+  }
+
+  const double single_differing = DifferingFraction(reference, single);
+  const double fast_differing = DifferingFraction(reference, fast);
+  const double mixed_differing = DifferingFraction(reference, mixed);
+  const bool fast_ok = fast_differing - single_differing <= kMaxExtraDifferingFraction;
+  const bool mixed_ok = mixed_differing <= kMaxMixedDifferingFraction;
+  const bool mixed_time_ok = mixed_ms <= kMaxMixedSlowdown * double_ms;
+  std::cout << name << ": SINGLE (ms): " << single_ms << ", FAST (ms): " << fast_ms
+	    << ", differing from DOUBLE: SINGLE " << 100 * single_differing << "%, FAST "
+	    << 100 * fast_differing << "%, FAST vs SINGLE "
+	    << 100 * DifferingFraction(single, fast) << "%"
+	    << (fast_ok ? "" : " -- over the threshold") << std::endl;
+  std::cout << name << ": MIXED (ms): " << mixed_ms << ", SINGLE (ms): " << single_ms
+	    << ", DOUBLE (ms): " << double_ms << (mixed_time_ok ? "" : " -- slower than DOUBLE")
+	    << ", MIXED differing from DOUBLE: " << 100 * mixed_differing << "%"
+	    << (mixed_ok ? "" : " -- over the threshold") << std::endl;
+  const bool ok = fast_ok && mixed_ok && mixed_time_ok;
+  fast.write(TestOutputPath("accuracy_test_output_" + name + ".png"));
+  return ok;
+}
+
+// Draws the scene with and without the far field jumps, in SINGLE and DOUBLE,
+// and reports how far apart they are, and how long each took. Returns whether
+// they're within `max_differing_fraction`.
+bool CompareFarField(const std::string& name, FractalParams params, double max_differing_fraction,
+		     ThreadPool& thread_pool) {
+  bool ok = true;
+  for (Precision precision : {Precision::SINGLE, Precision::DOUBLE}) {
+    RGBImage exact(params.width, params.height);
+    RGBImage jumped(params.width, params.height);
+    params.far_field = false;
+    const double exact_ms = Draw(params, precision, exact, thread_pool);
+    params.far_field = true;
+    const double jumped_ms = Draw(params, precision, jumped, thread_pool);
+    const double differing = DifferingFraction(exact, jumped);
+    const bool precision_ok = differing <= max_differing_fraction;
+    std::cout << name << ": " << ToString(precision) << " (ms): " << exact_ms
+	      << ", with far field (ms): " << jumped_ms << ", differing: " << 100 * differing << "%"
+	      << (precision_ok ? "" : " -- over the threshold") << std::endl;
+    ok &= precision_ok;
+  }
+  return ok;
+}
+
+int main() {
+  ThreadPool thread_pool(TestThreads());
+
+  bool ok = true;
+  ok &= Compare("overview", OverviewScene(), thread_pool);
+  ok &= Compare("boundary", BoundaryScene(), thread_pool);
+  ok &= Compare("many_zeros", ManyZerosScene(), thread_pool);
+  ok &= Compare("deep", DeepScene(), thread_pool);
+  ok &= CompareFarField("far_field", FarFieldScene(), kMaxFarFieldDifferingFraction, thread_pool);
+  ok &= CompareFarField("far_field_many_zeros", FarFieldManyZerosScene(),
+			kMaxFarFieldManyZerosDifferingFraction, thread_pool);
+  ok &= ComparePastDoubleDouble("past_double_double", PastDoubleDoubleScene(), thread_pool);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -6,10 +6,16 @@
 #include <iostream>
 #include <sstream>
 #include <limits>
+#include <memory>
+#include <optional>
+#include <array>
 
 #include "complex.h"
 #include "complex_array.h"
 #include "polynomial.h"
+#include "zero_tree.h"
+#include "zero_grid.h"
+#include "far_field.h"
 
 template <typename T>
 Polynomial<T> Differentiate(const Polynomial<T>& p) {
@@ -22,13 +28,14 @@ Polynomial<T> Differentiate(const Polynomial<T>& p) {
 
 template <typename T>
 T ConservativeConvergenceRadius(const std::vector<Complex<T>>& zeros) {
-  T min_distance = std::numeric_limits<T>::infinity();
+  T min_sqr_distance = std::numeric_limits<T>::infinity();
   for (size_t i = 0; i < zeros.size(); i++) {
     for (size_t j = i + 1; j < zeros.size(); j++) {
-      min_distance = std::min(min_distance, (zeros[i] - zeros[j]).magnitude());
+      min_sqr_distance = std::min(min_sqr_distance, (zeros[i] - zeros[j]).sqr_magnitude());
     }
   }
-  return min_distance / 20.0;
+  using std::sqrt;
+  return sqrt(min_sqr_distance) / 20.0;
 }
 
 template <typename T>
@@ -36,11 +43,22 @@ class AnalyzedPolynomial {
  public:
   AnalyzedPolynomial<T>(const std::vector<Complex<T>>& zeros)
     : zeros(zeros),
-      polynomial(Polynomial<T>::FromZeros(zeros)),
-      derivative(Differentiate(polynomial)),
-      convergence_radius(ConservativeConvergenceRadius(zeros)),
-      sqr_convergence_radius(convergence_radius * convergence_radius) {
+      zero_tree(zeros.size() >= kZeroTreeMinZeros
+		? GetZeroTree(zeros) : nullptr),
+      // Expanding p is O(degree^2), and overflows at high degree, so it's only
+      // done when it's going to be used.
+      polynomial(zero_tree == nullptr
+		 ? Polynomial<T>::FromZeros(zeros) : Polynomial<T>({Complex<T>(1, 0)})),
+      derivative(zero_tree == nullptr ? Differentiate(polynomial) : polynomial),
+      convergence_radius(zero_tree == nullptr
+			 ? ConservativeConvergenceRadius(zeros)
+			 : zero_tree->MinZeroSpacing() / 20.0),
+      sqr_convergence_radius(convergence_radius * convergence_radius),
+      far_field(zeros) {
     assert(!zeros.empty());
+    if (zero_tree == nullptr && zeros.size() >= kZeroGridMinZeros) {
+      zero_grid.emplace(zeros, convergence_radius);
+    }
   }
 
   template <typename ComplexValue>
@@ -55,6 +73,9 @@ class AnalyzedPolynomial {
 
   template <typename ComplexValue>
   bool ConvergedToZero(const ComplexValue& z) const {
+    if (zero_tree != nullptr || zero_grid.has_value()) {
+      return GetZeroIndexIfConverged(z).has_value();
+    }
     for (const Complex<T>& zero : zeros) {
       if (z.CloseTo(zero, convergence_radius, sqr_convergence_radius)) {
 	return true;
@@ -65,16 +86,34 @@ class AnalyzedPolynomial {
 
   template <typename ComplexValue>
   std::optional<size_t> GetZeroIndexIfConverged(const ComplexValue& z) const {
-    size_t i = 0;
-    for (const Complex<T>& zero : zeros) {
-      if (z.CloseTo(zero, convergence_radius, sqr_convergence_radius)) {
-	return i;
+    if (zero_tree != nullptr) {
+      return zero_tree->FindCloseZero(z, convergence_radius, sqr_convergence_radius);
+    }
+    if (zero_grid.has_value()) {
+      return CheckCandidate(z, zero_grid->Candidate(z));
+    }
+    return FindCloseZero(z);
+  }
+
+  // GetZeroIndexIfConverged() for each lane of a block.
+  template <size_t N>
+  void GetZeroIndicesIfConverged(const ComplexArray<T, N>& block,
+				 std::array<std::optional<size_t>, N>* indices) const {
+    if (zero_grid.has_value()) {
+      std::array<int32_t, N> candidates;
+      zero_grid->Candidates(block, &candidates);
+      for (size_t b = 0; b < N; ++b) {
+	(*indices)[b] = CheckCandidate(block.get(b), candidates[b]);
       }
-      ++i;
+      return;
+    }
+    for (size_t b = 0; b < N; ++b) {
+      (*indices)[b] = GetZeroIndexIfConverged(block.get(b));
     }
-    return std::nullopt;
   }
 
+  size_t ClosestZero(const Complex<T>& z) const;
+
   std::string ToString() const {
     std::ostringstream ss;
     ss << *this;
@@ -82,6 +121,12 @@ class AnalyzedPolynomial {
   }
 
   friend std::ostream& operator<<(std::ostream& os, const AnalyzedPolynomial<T>& a) {
+    if (a.zero_tree != nullptr) {
+      // Too many zeros to be worth printing.
+      os << "{ " << a.zeros.size() << " zeros, in a tree of "
+	 << a.zero_tree->node_count() << " clusters }";
+      return os;
+    }
     os << "{" << std::endl;
     os << "  polynomial = " << a.polynomial << std::endl;
     os << "  zeros = [";
@@ -98,21 +143,80 @@ class AnalyzedPolynomial {
   }
 
   std::vector<Complex<T>> zeros;
+  // Set for polynomials of middling degree, to find the zero an iterate has
+  // converged to without checking them all.
+  std::optional<ZeroGrid<T>> zero_grid;
+  // Set for polynomials of high degree, which are then iterated with it
+  // instead of with `polynomial` and `derivative` (which are left as p = 1).
+  // Shared, as it is costly to build.
+  std::shared_ptr<const ZeroTree<T>> zero_tree;
   Polynomial<T> polynomial;
   Polynomial<T> derivative;
   T convergence_radius;
   T sqr_convergence_radius;
+  // For skipping the slow crawl in from far away, see far_field.h.
+  FarField<T> far_field;
+  // Only set on float polynomials for drawing Precision::MIXED: p in double,
+  // for redoing the pixels that float may have got wrong. Built once a frame
+  // by whoever builds this, rather than by every region drawn.
+  std::shared_ptr<const AnalyzedPolynomial<double>> refinement;
+
+ private:
+  // The zero that z is CloseTo, if any, checking every zero.
+  std::optional<size_t> FindCloseZero(const Complex<T>& z) const {
+    size_t i = 0;
+    for (const Complex<T>& zero : zeros) {
+      if (z.CloseTo(zero, convergence_radius, sqr_convergence_radius)) {
+	return i;
+      }
+      ++i;
+    }
+    return std::nullopt;
+  }
+
+  std::optional<size_t> CheckCandidate(const Complex<T>& z, int32_t candidate) const {
+    if (candidate >= 0) {
+      if (z.CloseTo(zeros[candidate], convergence_radius, sqr_convergence_radius)) {
+	return candidate;
+      }
+      return std::nullopt;
+    }
+    if (candidate == ZeroGrid<T>::kAmbiguous) {
+      return FindCloseZero(z);
+    }
+    return std::nullopt;
+  }
 };
 
 using AnalyzedPolynomialD = AnalyzedPolynomial<double>;
 using AnalyzedPolynomialF = AnalyzedPolynomial<float>;
 
+template <typename T, typename ComplexValue>
+void NewtonIter(const AnalyzedPolynomial<T>& p, ComplexValue* guess) {
+  if (p.zero_tree != nullptr) {
+    p.zero_tree->NewtonIter(guess);
+    return;
+  }
+  *guess -= p(*guess) / p.derivative(*guess);
+}
+
+// NewtonIter with the division done by ApproximateQuotient, for
+// Precision::FAST. The zero tree has its own division, which is left exact.
+template <typename T, size_t N>
+void ApproximateNewtonIter(const AnalyzedPolynomial<T>& p, ComplexArray<T, N>* guess) {
+  if (p.zero_tree != nullptr) {
+    p.zero_tree->NewtonIter(guess);
+    return;
+  }
+  *guess -= ApproximateQuotient(p(*guess), p.derivative(*guess));
+}
+
 template <typename T, typename ComplexValue>
 ComplexValue Newton(const AnalyzedPolynomial<T>& p, ComplexValue guess, size_t iterations, size_t* actual_iters = nullptr) {
   size_t i;
   for (i = 0; i < iterations; ++i) {
     if (p.ConvergedToZero(guess)) break;
-    guess -= p(guess) / p.derivative(guess);
+    NewtonIter(p, &guess);
   }
   if (actual_iters != nullptr) {
     *actual_iters = i;
@@ -120,11 +224,6 @@ ComplexValue Newton(const AnalyzedPolynomial<T>& p, ComplexValue guess, size_t i
   return guess;
 }
 
-template <typename T, typename ComplexValue>
-void NewtonIter(const AnalyzedPolynomial<T>& p, ComplexValue* guess) {
-  *guess -= p(*guess) / p.derivative(*guess);
-}
-
 template <typename T>
 size_t ClosestZero(const Complex<T>& z, const std::vector<Complex<T>>& zeros) {
   size_t closest = 0;
@@ -140,4 +239,20 @@ size_t ClosestZero(const Complex<T>& z, const std::vector<Complex<T>>& zeros) {
   return closest;
 }
 
+template <typename T>
+size_t AnalyzedPolynomial<T>::ClosestZero(const Complex<T>& z) const {
+  if (zero_tree != nullptr) {
+    return zero_tree->ClosestZero(z);
+  }
+  // A zero that z is that close to is the closest, as zeros are much further
+  // apart.
+  if (zero_grid.has_value()) {
+    const std::optional<size_t> converged = CheckCandidate(z, zero_grid->Candidate(z));
+    if (converged.has_value()) {
+      return *converged;
+    }
+  }
+  return ::ClosestZero(z, zeros);
+}
+
 #endif // _CROW_FRACTAL_SERVER_ANALYZED_POLYNOMIAL_
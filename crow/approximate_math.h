@@ -0,0 +1,45 @@
+#ifndef _CROW_FRACTAL_SERVER_APPROXIMATE_MATH_
+#define _CROW_FRACTAL_SERVER_APPROXIMATE_MATH_
+
+#include <stddef.h>
+#include <type_traits>
+
+#ifdef __SSE__
+#include <immintrin.h>
+#endif // __SSE__
+
+// Sets out[i] to roughly 1 / in[i], for Precision::FAST.
+//
+// For float this is the hardware reciprocal estimate (rcpps, good to about 12
+// bits) plus one Newton-Raphson step, r' = r * (2 - x * r), which brings it to
+// within a couple of ulps: as good as a divide for telling which basin a pixel
+// is in, at a fraction of the latency and with much better throughput. Zero,
+// infinite and denormal inputs give NaN or zero where a divide would give
+// infinity or a huge number; either way the pixel is sent nowhere near a zero.
+//
+// Other types have no estimate instruction, so get exact reciprocals.
+template <typename T, size_t N>
+void ApproximateReciprocals(const T* in, T* out) {
+#ifdef __SSE__
+  if constexpr (std::is_same_v<T, float> && N % 4 == 0) {
+    for (size_t i = 0; i < N; i += 4) {
+      const __m128 x = _mm_loadu_ps(in + i);
+      const __m128 estimate = _mm_rcp_ps(x);
+#ifdef __FMA__
+      // r + r * (1 - x * r): the same step, with one rounding fewer.
+      const __m128 error = _mm_fnmadd_ps(x, estimate, _mm_set1_ps(1.0f));
+      _mm_storeu_ps(out + i, _mm_fmadd_ps(estimate, error, estimate));
+#else
+      const __m128 error = _mm_sub_ps(_mm_set1_ps(2.0f), _mm_mul_ps(x, estimate));
+      _mm_storeu_ps(out + i, _mm_mul_ps(estimate, error));
+#endif // __FMA__
+    }
+    return;
+  }
+#endif // __SSE__
+  for (size_t i = 0; i < N; ++i) {
+    out[i] = T(1) / in[i];
+  }
+}
+
+#endif // _CROW_FRACTAL_SERVER_APPROXIMATE_MATH_
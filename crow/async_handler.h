@@ -2,6 +2,7 @@
 #define _CROW_FRACTAL_SERVER_ASYNC_HANDLER_
 
 #include <chrono>
+#include <tuple>
 
 #include <crow.h>
 
@@ -12,6 +13,7 @@
 #include "response.h"
 #include "thread_pool.h"
 #include "synchronized_resource.h"
+#include "image_pool.h"
 #include "image_regions.h"
 #include "image_operations.h"
 #include "breadcrumb_trail.h"
@@ -19,27 +21,30 @@
 std::shared_ptr<RGBImage> LayoutImage(const RGBImage& input_image,
 				      const FractalParams& image_params,
 				      const FractalParams& viewport_params,
-				      BreadcrumbTrail& breadcrumbs) {
-  auto output_image = std::make_shared<RGBImage>(viewport_params.width, viewport_params.height);
-
-  // If we're zooming out, use the breadcrumbs.
+				      BreadcrumbTrail& breadcrumbs,
+				      ImagePool& image_pool,
+				      ThreadPool& thread_pool) {
+  // Not every pixel is necessarily covered, so start from a cleared image.
+  auto output_image = image_pool.Acquire(viewport_params.width, viewport_params.height,
+					 /*clear=*/true);
+
+  // If we're zooming out, fill in around the previous image using the
+  // breadcrumbs, coarsest first so that finer crumbs paint over them.
   if (viewport_params.r_range > image_params.r_range) {
-    const auto crumb = breadcrumbs.GetNextLargest(viewport_params);
-    if (crumb.has_value()) {
-      const auto& [crumb_params, crumb_image] = *crumb;
+    const auto crumbs = breadcrumbs.GetLargerCrumbs(image_params, viewport_params);
+    for (const auto& [crumb_params, crumb_image] : crumbs) {
       const std::optional<ImageOverlap> crumb_overlap =
 	FindGeneralImageOverlap(crumb_params, viewport_params);
       if (crumb_overlap.has_value()) {
-	ResizeBilinear(*crumb_image, *output_image, *crumb_overlap);
-	return output_image;
+	ResizeBilinearParallel(*crumb_image, *output_image, *crumb_overlap, thread_pool);
       }
     }
   }
 
-  // If we're not zooming out or breadcrumbs didn't work, use the previous image.
+  // The previous image is the most detailed data we have, so it goes on top.
   const std::optional<ImageOverlap> overlap = FindGeneralImageOverlap(image_params, viewport_params);
   if (overlap.has_value()) {
-    ResizeBilinear(input_image, *output_image, *overlap);
+    ResizeBilinearParallel(input_image, *output_image, *overlap, thread_pool);
   }
   return output_image;
 }
@@ -48,7 +53,8 @@ class AsyncHandler : public Handler {
  public:
   explicit AsyncHandler(ThreadPool* thread_pool)
     : thread_pool_(*thread_pool),
-      breadcrumbs_(/*max_elements=*/50, /*bucket_size=*/2.0) {
+      image_pool_(/*max_free_bytes=*/256 << 20),
+      breadcrumbs_(/*max_bytes=*/64 << 20, /*bucket_size=*/2.0, /*downsample=*/2) {
     Start();
   }
 
@@ -64,38 +70,40 @@ class AsyncHandler : public Handler {
     return crow::response(json);
   }
 
-  crow::response HandleFractalRequest(const FractalParams& params) {
+  std::optional<Frame> GetFrame(const FractalParams& params,
+				WaitCanceller* canceller = nullptr) override {
     SetSessionId(params.session_id);
-    std::cout << "HandleFractalRequest putting version: " << params.request_id << std::endl;
+    std::cout << "GetFrame putting version: " << params.request_id << std::endl;
     latest_params().Set(params, /*version=*/params.request_id);
-    std::cout << "HandleFractalRequest waiting for above version: ("
+    std::cout << "GetFrame waiting for above version: ("
 	      << params.last_data_id << ", "
 	      << params.last_viewport_id << ")" << std::endl;
     ImageVersion last_version(params.last_data_id, params.last_viewport_id);
-    auto png = latest_png_.GetAboveVersion(last_version);
-    if (!png.has_value()) {
-      std::cout << "PNG resource is dead :(" << std::endl;
-      return crow::response(500);
+    auto frame = latest_frame_.GetAboveVersion(last_version, canceller);
+    if (!frame.has_value()) {
+      return std::nullopt;
     }
-
-    return ImageWithMetadata(**png,
-			     {{"data_id", png.version().first},
-			      {"viewport_id", png.version().second}});
+    return *frame;
   }
 
  private:
   // first is data version, second is viewport version.
   using ImageVersion = std::pair<uint64_t, uint64_t>;
 
+  // Params, image, and the image's PNG if it was encoded while it was drawn.
+  using ComputedImage = std::tuple<FractalParams, std::shared_ptr<RGBImage>, EncodedPng>;
+
   struct EncodeInput {
     std::shared_ptr<RGBImage> image;
     FractalParams image_params;
     FractalParams viewport_params;
+    // Set if the image is to be sent as it is, and is already encoded.
+    EncodedPng png = nullptr;
   };
 
   void Start() {
     latest_params_and_image_.Reset();
-    latest_png_.Reset();
+    latest_frame_.Reset();
     computation_thread_ = std::make_unique<boost::thread>(&AsyncHandler::ComputeLoop, this);
     layout_thread_ = std::make_unique<boost::thread>(&AsyncHandler::LayoutLoop, this);
   }
@@ -103,7 +111,7 @@ class AsyncHandler : public Handler {
   void Stop() {
     breadcrumbs_.Clear();
     latest_params_and_image_.Kill();
-    latest_png_.Kill();
+    latest_frame_.Kill();
     computation_thread_->join();
     layout_thread_->join();
   }
@@ -124,7 +132,7 @@ class AsyncHandler : public Handler {
     return latest_params_and_image_.first();
   }
 
-  SynchronizedResourceBase<std::pair<FractalParams, std::shared_ptr<RGBImage>>>& latest_image() {
+  SynchronizedResourceBase<ComputedImage>& latest_image() {
     return latest_params_and_image_.second();
   }
 
@@ -132,6 +140,8 @@ class AsyncHandler : public Handler {
     uint64_t latest_version = 0;
     std::optional<FractalParams> previous_params = std::nullopt;
     std::shared_ptr<RGBImage> previous_image = nullptr;
+    ScrollingImage scrolling_image;
+    CostMap cost_map;
 
     while (true) {
       std::cout << "ComputeLoop start, waiting for above version: " << latest_version << std::endl;
@@ -145,8 +155,22 @@ class AsyncHandler : public Handler {
       std::cout << Now() << ": Start async computation" << std::endl;
       const uint64_t start_time = Now();
 
-      // Set up the image.
-      auto image = std::make_shared<RGBImage>(input->width, input->height);
+      // Set up the image. Every pixel gets drawn, so no need to clear it.
+      auto image = image_pool_.Acquire(input->width, input->height, /*clear=*/false);
+      std::cout << "Image acquire time (ms): " << (Now() - start_time) << std::endl;
+
+      // If we can, encode bands of rows as soon as they're drawn, rather than
+      // leaving all the encoding to LayoutLoop. That PNG is only any use if
+      // the image gets sent as it is, rather than laid out, but that's the
+      // usual case. Not if the PNG is likely to go unused though.
+      std::optional<StreamingPngEncoder> streaming_encoder;
+      std::function<void(const FrameRows&, size_t, size_t)> on_rows_ready = nullptr;
+      if (!input->png_optional && SupportsStreamingEncode(*input)) {
+	streaming_encoder.emplace(image->get_width(), image->get_height(), &thread_pool_);
+	on_rows_ready = [&streaming_encoder](const FrameRows& rows, size_t y_begin, size_t y_end) {
+	  streaming_encoder->AddRows(rows, y_begin, y_end);
+	};
+      }
 
       // Draw the fractal.
       DrawFractalArgs args = {
@@ -155,17 +179,25 @@ class AsyncHandler : public Handler {
 	.previous_params = previous_params,
 	.previous_image = previous_image.get(),
 	.thread_pool = thread_pool_,
+	.scrolling_image = &scrolling_image,
+	.on_rows_ready = on_rows_ready,
+	.cost_map = &cost_map,
       };
       const size_t total_iters = DrawFractal(args);
       const uint64_t end_time = Now();
       std::cout << "Total iterations: " << total_iters << std::endl;
       std::cout << "Computation time (ms): " << (end_time - start_time) << std::endl;
 
+      EncodedPng png = nullptr;
+      if (streaming_encoder.has_value()) {
+	png = std::make_shared<const std::string>(streaming_encoder->Finish());
+	std::cout << "Streaming PNG finish time (ms): " << (Now() - end_time) << std::endl;
+      }
+
       // Push out the results.
-      const auto params_and_image = std::make_pair(*input, image);
-      breadcrumbs_.Insert(params_and_image);
-      latest_image().Set(params_and_image,
+      latest_image().Set(std::make_tuple(*input, image, png),
 			 /*version=*/input.version());
+      breadcrumbs_.Insert(*input, *image);
       previous_image = image;
       previous_params = *input;
       latest_version = input.version();
@@ -188,18 +220,40 @@ class AsyncHandler : public Handler {
 	return;
       }
 
-      // Encode to PNG.
-      const uint64_t start_time = Now();
-      auto png = std::make_shared<std::string>();
-      *png = EncodePng(encode_input->viewport_params, *encode_input->image);
-      const uint64_t end_time = Now();
-      std::cout << "PNG encode time (ms): " << (end_time - start_time) << std::endl;
+      // Encode to PNG, unless ComputeLoop already did so while drawing. Images
+      // sent as they are may go out as pan deltas instead, so if that's likely,
+      // they're only encoded if asked for. Laid out images always need it.
+      const bool as_is = encode_input->image_params.request_id ==
+	encode_input->viewport_params.request_id;
+      std::shared_ptr<LazyPng> png;
+      if (encode_input->png != nullptr) {
+	png = std::make_shared<LazyPng>(encode_input->png);
+      } else if (as_is && encode_input->image_params.png_optional) {
+	png = EncodePngLazily(encode_input->viewport_params, encode_input->image, thread_pool_);
+      } else {
+	const uint64_t start_time = Now();
+	png = std::make_shared<LazyPng>(std::make_shared<const std::string>(
+	    EncodePng(encode_input->viewport_params, *encode_input->image, thread_pool_)));
+	const uint64_t end_time = Now();
+	std::cout << "PNG encode time (ms): " << (end_time - start_time) << std::endl;
+      }
 
       // Push out the results.
       latest_data_version = encode_input->image_params.request_id;
       latest_viewport_version = encode_input->viewport_params.request_id;
-      latest_png_.Set(png, /*version=*/std::make_pair(latest_data_version,
-						      latest_viewport_version));
+      Frame frame = {
+	.png = png,
+	.data_id = latest_data_version,
+	.viewport_id = latest_viewport_version,
+	.precision = ResolvePrecision(encode_input->image_params),
+      };
+      if (as_is) {
+	// Not laid out, so the image is exactly what its params describe.
+	frame.params = encode_input->image_params;
+	frame.image = encode_input->image;
+      }
+      latest_frame_.Set(frame, /*version=*/std::make_pair(latest_data_version,
+							  latest_viewport_version));
       std::cout << "LayoutLoop done" << std::endl;
     }
   }
@@ -225,10 +279,26 @@ class AsyncHandler : public Handler {
     FractalParams viewport_params = *viewport_input;
     std::cout << "LayoutLoop got viewport params at version: "
 	      << viewport_input.version() << std::endl;
-    auto [image_params, image] = *image_input;
+    auto [image_params, image, png] = *image_input;
     std::cout << "LayoutLoop got image at version: "
 	      << image_input.version() << std::endl;
 
+    // If the client does its own layout, there's nothing to send until there's
+    // an image newer than the one it has.
+    if (viewport_params.client_layout) {
+      if (image_params.request_id > latest_data_version) {
+	std::cout << "Client side layout, sending new image." << std::endl;
+	return EncodeInput{
+	  .image = image,
+	  .image_params = image_params,
+	  .viewport_params = image_params,
+	  .png = png,
+	};
+      }
+      std::cout << "Client side layout, waiting for a new image." << std::endl;
+      return WaitForNewImage(latest_data_version);
+    }
+
     // If the image and viewport versions are identical, no need to do any work.
     if (image_params.request_id == viewport_params.request_id) {
       std::cout << "Versions identical, no layout required." << std::endl;
@@ -236,6 +306,7 @@ class AsyncHandler : public Handler {
 	.image = image,
 	.image_params = image_params,
 	.viewport_params = viewport_params,
+	.png = png,
       };
     }
 
@@ -246,11 +317,12 @@ class AsyncHandler : public Handler {
       auto updated_image = latest_image().GetAtVersionWithTimeout(viewport_params.request_id, 50ms);
       if (updated_image.has_value()) {
 	std::cout << "Wait success!" << std::endl;
-	auto [new_params, new_image] = *updated_image;
+	auto [new_params, new_image, new_png] = *updated_image;
 	return EncodeInput{
 	  .image = new_image,
 	  .image_params = new_params,
 	  .viewport_params = new_params,
+	  .png = new_png,
 	};
       }
     }
@@ -259,7 +331,8 @@ class AsyncHandler : public Handler {
     if (ParamsDifferOnlyByViewport(viewport_params, image_params)) {
       std::cout << "Params differ only by viewport, performing layout." << std::endl;
       const uint64_t start_time = Now();
-      auto stitched_image = LayoutImage(*image, image_params, viewport_params, breadcrumbs_);
+      auto stitched_image = LayoutImage(*image, image_params, viewport_params, breadcrumbs_,
+					 image_pool_, thread_pool_);
       const uint64_t end_time = Now();
       std::cout << "Layout time (ms): " << (end_time - start_time) << std::endl;
       return EncodeInput{
@@ -271,33 +344,38 @@ class AsyncHandler : public Handler {
 
     // Fall back on pipelined behaviour... wait for a usable image to be available.
     std::cout << "Fundamental param change, reverting to pipelined behavior." << std::endl;
-    image_input = latest_image().GetAboveVersion(latest_data_version);
+    return WaitForNewImage(latest_data_version);
+  }
+
+  // Waits for an image newer than `latest_data_version`, to be sent as is.
+  std::optional<EncodeInput> WaitForNewImage(uint64_t latest_data_version) {
+    auto image_input = latest_image().GetAboveVersion(latest_data_version);
     if (!image_input.has_value()) {
       std::cout << "Killing AsyncHandler::LayoutLoop, image is dead" << std::endl;
       return std::nullopt;
     }
-    auto [new_params, new_image] = *image_input;
-    std::cout << "LayoutLoop got fallback image at version: "
+    auto [new_params, new_image, new_png] = *image_input;
+    std::cout << "LayoutLoop got new image at version: "
 	      << image_input.version() << std::endl;
     return EncodeInput{
       .image = new_image,
       .image_params = new_params,
       .viewport_params = new_params,
+      .png = new_png,
     };
   }
 
   // Unowned.
   ThreadPool& thread_pool_;
 
+  ImagePool image_pool_;
+
   std::string session_id_;
   std::unique_ptr<boost::thread> computation_thread_;
   std::unique_ptr<boost::thread> layout_thread_;
 
-  SynchronizedResourcePair<FractalParams,
-			   std::pair<FractalParams,
-				     std::shared_ptr<RGBImage>>>
-      latest_params_and_image_;
-  SynchronizedResource<std::shared_ptr<std::string>, ImageVersion> latest_png_;
+  SynchronizedResourcePair<FractalParams, ComputedImage> latest_params_and_image_;
+  SynchronizedResource<Frame, ImageVersion> latest_frame_;
 
   BreadcrumbTrail breadcrumbs_;
 };
@@ -0,0 +1,272 @@
+#ifndef _CROW_FRACTAL_SERVER_AUTOTUNER_
+#define _CROW_FRACTAL_SERVER_AUTOTUNER_
+
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <iostream>
+
+#include <boost/thread.hpp>
+
+#include "fractal_params.h"
+#include "fractal_drawing.h"
+#include "scrolling_image.h"
+#include "thread_pool.h"
+#include "tuning.h"
+
+// Finds the TuningParams that draw fastest on this machine, by timing a few
+// representative scenes under candidate values of each knob in turn (i.e.
+// coordinate descent, starting from the given tuning).
+
+// Scenes that cover the common cases: a cheap overview, and a zoom onto basin
+// boundaries where iteration counts are high and uneven, in both precisions.
+std::vector<FractalParams> AutotuneScenes() {
+  FractalParams overview;
+  overview.session_id = "autotune";
+  overview.request_id = 1;
+  overview.last_data_id = 0;
+  overview.last_viewport_id = 0;
+  overview.width = 1280;
+  overview.height = 720;
+  overview.r_min = -2.5;
+  overview.r_range = 5.0;
+  overview.i_min = -overview.i_range() / 2;
+  overview.max_iters = 200;
+  overview.zeros = {
+    ComplexD(-1.0, 0.0), ComplexD(1.0, 0.3), ComplexD(0.2, 1.0), ComplexD(0.4, -0.8),
+  };
+  overview.colors = {
+    png::rgb_pixel(230, 60, 60), png::rgb_pixel(60, 230, 60),
+    png::rgb_pixel(60, 60, 230), png::rgb_pixel(230, 230, 60),
+  };
+  overview.precision = Precision::SINGLE;
+
+  FractalParams boundary = overview;
+  boundary.zeros.push_back(ComplexD(-0.6, -0.7));
+  boundary.zeros.push_back(ComplexD(-0.3, 0.6));
+  boundary.colors.push_back(png::rgb_pixel(230, 60, 230));
+  boundary.colors.push_back(png::rgb_pixel(60, 230, 230));
+  boundary.r_min = -0.3;
+  boundary.r_range = 0.4;
+  boundary.i_min = -0.1;
+  boundary.precision = Precision::DOUBLE;
+
+  return {overview, boundary};
+}
+
+class Autotuner {
+ public:
+  // If `live_pool` is given, each timed draw waits until it's idle, and is
+  // redone if it didn't stay idle, so that live sessions go first and don't
+  // skew the results. Once `cancelled` is set, Run() returns as soon as it
+  // can, with the tuning it started from. Both must outlive the autotuner.
+  explicit Autotuner(size_t repetitions = 3, const ThreadPool* live_pool = nullptr,
+		     const std::atomic<bool>* cancelled = nullptr)
+    : scenes_(AutotuneScenes()), repetitions_(repetitions), live_pool_(live_pool),
+      cancelled_(cancelled) {}
+
+  // Runs the benchmarks with their own thread pools, so anything else running
+  // at the same time skews the results, other than the live pool's work.
+  TuningParams Run(TuningParams tuning) {
+    const uint64_t start_time = Now();
+    const TuningParams start_tuning = tuning;
+    std::cout << "Autotune starting from:" << std::endl << tuning.ToString();
+
+    const size_t cpus = std::max(1u, boost::thread::hardware_concurrency());
+    Tune(&tuning, "num_threads", &TuningParams::num_threads,
+	 {tuning.num_threads, cpus, cpus - 1, cpus / 2, cpus * 2});
+    Tune(&tuning, "block_width", &TuningParams::block_width,
+	 std::vector<size_t>(std::begin(TuningParams::kBlockWidths),
+			     std::end(TuningParams::kBlockWidths)));
+    Tune(&tuning, "pixels_per_task", &TuningParams::pixels_per_task,
+	 {tuning.pixels_per_task, tuning.pixels_per_task / 4, tuning.pixels_per_task / 2,
+	  tuning.pixels_per_task * 2, tuning.pixels_per_task * 4});
+    Tune(&tuning, "rows_per_task", &TuningParams::rows_per_task,
+	 {tuning.rows_per_task, tuning.rows_per_task / 4, tuning.rows_per_task / 2,
+	  tuning.rows_per_task * 2, tuning.rows_per_task * 4});
+
+    if (Cancelled()) {
+      std::cout << "Autotune cancelled" << std::endl;
+      return start_tuning;
+    }
+    std::cout << "Autotune time (ms): " << (Now() - start_time) << std::endl;
+    std::cout << "Autotune result:" << std::endl << tuning.ToString();
+    return tuning;
+  }
+
+ private:
+  // Sets `knob` to whichever candidate is fastest, with the other knobs as
+  // they are. Zero and repeated candidates are skipped.
+  void Tune(TuningParams* tuning, const char* name, size_t TuningParams::*knob,
+	    std::vector<size_t> candidates) {
+    candidates.erase(std::remove(candidates.begin(), candidates.end(), 0), candidates.end());
+    std::vector<size_t> seen;
+    uint64_t best_time = std::numeric_limits<uint64_t>::max();
+    size_t best_value = tuning->*knob;
+    for (const size_t value : candidates) {
+      if (std::find(seen.begin(), seen.end(), value) != seen.end()) {
+	continue;
+      }
+      seen.push_back(value);
+      TuningParams candidate = *tuning;
+      candidate.*knob = value;
+      const uint64_t time = Benchmark(candidate);
+      std::cout << "Autotune " << name << " = " << value << ": " << time << " us" << std::endl;
+      if (time < best_time) {
+	best_time = time;
+	best_value = value;
+      }
+    }
+    tuning->*knob = best_value;
+  }
+
+  // Total over scenes and strategies of the fastest of `repetitions_` draws, in
+  // microseconds.
+  uint64_t Benchmark(const TuningParams& tuning) {
+    if (Cancelled()) {
+      return std::numeric_limits<uint64_t>::max();
+    }
+    if (thread_pool_ == nullptr || thread_pool_->size() != tuning.num_threads) {
+      thread_pool_.reset();
+      thread_pool_ = std::make_unique<ThreadPool>(tuning.num_threads);
+    }
+
+    // Cover both ways of cutting up work: pixels_per_task for full scrolling
+    // draws, and rows_per_task for DYNAMIC_BLOCK_THREADED.
+    uint64_t total = 0;
+    for (FractalParams params : scenes_) {
+      for (const Strategy strategy : {Strategy::DYNAMIC_BLOCK_THREADED_SCROLLING,
+				      Strategy::DYNAMIC_BLOCK_THREADED}) {
+	params.strategy = strategy;
+	RGBImage image(params.width, params.height);
+	uint64_t best = std::numeric_limits<uint64_t>::max();
+	// One extra draw to warm up.
+	for (size_t i = 0; i <= repetitions_; ++i) {
+	  if (!WaitForLivePoolIdle()) {
+	    return std::numeric_limits<uint64_t>::max();
+	  }
+	  ScrollingImage scrolling_image;
+	  const auto start = std::chrono::steady_clock::now();
+	  DrawFractal({
+	      .params = params,
+	      .image = image,
+	      .previous_params = std::nullopt,
+	      .previous_image = nullptr,
+	      .thread_pool = *thread_pool_,
+	      .scrolling_image = &scrolling_image,
+	      .tuning = tuning,
+	    });
+	  const auto end = std::chrono::steady_clock::now();
+	  if (live_pool_ != nullptr && !live_pool_->Idle()) {
+	    // Shared the machine with live work, so try again.
+	    --i;
+	    continue;
+	  }
+	  if (i > 0) {
+	    best = std::min<uint64_t>(
+	        best, std::chrono::duration_cast<std::chrono::microseconds>(end - start).count());
+	  }
+	}
+	total += best;
+      }
+    }
+    return total;
+  }
+
+  bool Cancelled() const {
+    return cancelled_ != nullptr && *cancelled_;
+  }
+
+  // Returns false if cancelled while waiting.
+  bool WaitForLivePoolIdle() const {
+    while (!Cancelled()) {
+      if (live_pool_ == nullptr || live_pool_->Idle()) {
+	return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return false;
+  }
+
+  const std::vector<FractalParams> scenes_;
+  const size_t repetitions_;
+  const ThreadPool* live_pool_;
+  const std::atomic<bool>* cancelled_;
+  std::unique_ptr<ThreadPool> thread_pool_;
+};
+
+// Runs the autotuner on its own thread, so that serving never waits for it,
+// then switches drawing over to the result and saves it.
+class BackgroundAutotuner {
+ public:
+  // The live pool must outlive this.
+  BackgroundAutotuner(const ThreadPool* live_pool, std::string tuning_file)
+    : live_pool_(live_pool), tuning_file_(std::move(tuning_file)) {}
+
+  ~BackgroundAutotuner() {
+    cancelled_ = true;
+    if (thread_ != nullptr) {
+      thread_->join();
+    }
+  }
+
+  // Starts tuning from the current tuning, unless it's already running.
+  // Returns whether it started.
+  bool Start() {
+    std::scoped_lock lock(m_);
+    if (running_) {
+      return false;
+    }
+    if (thread_ != nullptr) {
+      thread_->join();
+    }
+    running_ = true;
+    thread_ = std::make_unique<boost::thread>(&BackgroundAutotuner::Run, this);
+    return true;
+  }
+
+  bool running() {
+    std::scoped_lock lock(m_);
+    return running_;
+  }
+
+  // The result of the last run to finish, if any.
+  std::optional<TuningParams> last_result() {
+    std::scoped_lock lock(m_);
+    return last_result_;
+  }
+
+ private:
+  void Run() {
+    const TuningParams tuning =
+      Autotuner(/*repetitions=*/3, live_pool_, &cancelled_).Run(GetTuning());
+    if (cancelled_) {
+      return;
+    }
+    SetTuning(tuning);
+    if (!tuning.Save(tuning_file_)) {
+      std::cout << "Failed to save tuning to " << tuning_file_ << std::endl;
+    }
+    std::scoped_lock lock(m_);
+    last_result_ = tuning;
+    running_ = false;
+  }
+
+  const ThreadPool* live_pool_;
+  const std::string tuning_file_;
+  std::atomic<bool> cancelled_ = false;
+
+  std::mutex m_;
+  bool running_ = false;
+  std::optional<TuningParams> last_result_;
+  std::unique_ptr<boost::thread> thread_;
+};
+
+#endif // _CROW_FRACTAL_SERVER_AUTOTUNER_
@@ -4,63 +4,104 @@
 #include <map>
 #include <memory>
 #include <optional>
+#include <vector>
+#include <algorithm>
 #include <cmath>
 #include <mutex>
 
 #include "fractal_params.h"
 #include "rgb_image.h"
+#include "indexed_image.h"
 
 class BreadcrumbTrail {
  public:
-  using Element = std::pair<FractalParams, std::shared_ptr<RGBImage>>;
+  // The params here describe the (possibly downsampled) stored image, not the
+  // original one.
+  using Element = std::pair<FractalParams, std::shared_ptr<const IndexedImage>>;
 
-  BreadcrumbTrail(size_t max_elements, double bucket_size)
-    : max_elements_(max_elements), bucket_size_(bucket_size) {}
+  // Crumbs are stored as root indices, downsampled by `downsample` in each
+  // direction, and the trail is trimmed to stay within `max_bytes`.
+  BreadcrumbTrail(size_t max_bytes, double bucket_size, size_t downsample)
+    : max_bytes_(max_bytes), bucket_size_(bucket_size), downsample_(downsample) {}
+
+  void Insert(const FractalParams& params, const RGBImage& image) {
+    // Compact the image before taking the lock.
+    std::optional<IndexedImage> indexed = IndexedImage::FromRGB(image, params.colors, downsample_);
+    if (!indexed.has_value() || indexed->Bytes() == 0) {
+      return;
+    }
+    const Element element(DownsampleParams(params, downsample_),
+			  std::make_shared<const IndexedImage>(std::move(*indexed)));
 
-  void Insert(const Element& element) {
     std::scoped_lock lock(m_);
 
     // Clear everything if the params have changed fundamentally.
     if (last_inserted_params_.has_value() &&
-	!ParamsDifferOnlyByViewport(element.first, *last_inserted_params_)) {
+	!ParamsDifferOnlyByViewport(params, *last_inserted_params_)) {
       elements_.clear();
+      total_bytes_ = 0;
     }
 
     // Actually do the insert.
     const int bucket = GetBucket(element.first);
+    auto existing = elements_.find(bucket);
+    if (existing != elements_.end()) {
+      total_bytes_ -= existing->second.second->Bytes();
+    }
     auto [it, inserted] = elements_.insert_or_assign(bucket, element);
-    last_inserted_params_ = element.first;
+    total_bytes_ += element.second->Bytes();
+    last_inserted_params_ = params;
 
     // Discard unneeded elements.
+    for (auto erase_it = elements_.begin(); erase_it != it; ++erase_it) {
+      total_bytes_ -= erase_it->second.second->Bytes();
+    }
     elements_.erase(elements_.begin(), it);
 
-    // Shrink to be within max size.
-    while (elements_.size() > max_elements_) {
+    // Shrink to be within the memory budget, always keeping the newest crumb.
+    while (total_bytes_ > max_bytes_ && elements_.size() > 1) {
       auto it = elements_.end();
       --it;
+      total_bytes_ -= it->second.second->Bytes();
       elements_.erase(it);
     }
   }
 
-  std::optional<Element> GetNextLargest(const FractalParams& query) {
+  // Returns the crumbs that are zoomed out further than `image`, ordered from
+  // most zoomed out to least, so that painting them into `viewport` in order
+  // leaves the most detailed data on top. Crumbs that would be completely hidden
+  // underneath a crumb covering the whole viewport are left out.
+  std::vector<Element> GetLargerCrumbs(const FractalParams& image,
+				       const FractalParams& viewport) {
     std::scoped_lock lock(m_);
-    const int query_bucket = GetBucket(query);
-    auto it = elements_.lower_bound(query_bucket);
-    while (it != elements_.end() && it->second.first.r_range < query.r_range) {
-      ++it;
-    }
-    if (it == elements_.end()) {
-      return std::nullopt;
+    std::vector<Element> result;
+
+    // Every crumb is compatible with the last inserted params (we clear
+    // otherwise), so that's all we need to check against.
+    if (!last_inserted_params_.has_value() ||
+	!ParamsDifferOnlyByViewport(viewport, *last_inserted_params_)) {
+      return result;
     }
-    if (!ParamsDifferOnlyByViewport(query, it->second.first)) {
-      return std::nullopt;
+
+    auto it = elements_.lower_bound(GetBucket(image));
+    for (; it != elements_.end(); ++it) {
+      const Element& element = it->second;
+      if (element.first.r_range <= image.r_range) {
+	continue;
+      }
+      result.push_back(element);
+      if (Covers(element.first, viewport)) {
+	break;
+      }
     }
-    return it->second;
+    std::reverse(result.begin(), result.end());
+    return result;
   }
 
   void Clear() {
     std::scoped_lock lock(m_);
     elements_.clear();
+    total_bytes_ = 0;
     last_inserted_params_.reset();
   }
 
@@ -70,11 +111,20 @@ class BreadcrumbTrail {
     return static_cast<int>(scale >= 0 ? scale + 0.5 : scale - 0.5);
   }
 
-  const size_t max_elements_;
+  static bool Covers(const FractalParams& outer, const FractalParams& inner) {
+    return (outer.r_min <= inner.r_min &&
+	    outer.r_min + outer.r_range >= inner.r_min + inner.r_range &&
+	    outer.i_min <= inner.i_min &&
+	    outer.i_min + outer.i_range() >= inner.i_min + inner.i_range());
+  }
+
+  const size_t max_bytes_;
   const double bucket_size_;
+  const size_t downsample_;
 
   std::mutex m_;
   std::map<int, Element> elements_;
+  size_t total_bytes_ = 0;
   std::optional<FractalParams> last_inserted_params_;
 };
 
@@ -35,8 +35,10 @@ class Complex {
   bool CloseTo(const Complex<T>& target,
 	       T convergence_radius,
 	       T sqr_convergence_radius) const {
-    if (std::abs(r - target.r) > convergence_radius) return false;
-    if (std::abs(i - target.i) > convergence_radius) return false;
+    // Unqualified, so that non-builtin T (e.g. DoubleDouble) can provide abs().
+    using std::abs;
+    if (abs(r - target.r) > convergence_radius) return false;
+    if (abs(i - target.i) > convergence_radius) return false;
     return (*this - target).sqr_magnitude() <= sqr_convergence_radius;
   }
 
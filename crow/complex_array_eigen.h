@@ -10,6 +10,7 @@
 #include <Eigen/Dense>
 
 #include "complex.h"
+#include "approximate_math.h"
 
 template <typename T, size_t N>
 class ComplexArray {
@@ -102,6 +103,17 @@ class ComplexArray {
     return result;
   }
 
+  // a / b, dividing by |b|^2 with ApproximateReciprocals, for Precision::FAST.
+  friend ComplexArray<T, N> ApproximateQuotient(const ComplexArray<T, N>& a, const ComplexArray<T, N>& b) {
+    ComplexArray<T, N> result;
+    Eigen::Array<T, N, 1> denoms = b.rs_ * b.rs_ + b.is_ * b.is_;
+    Eigen::Array<T, N, 1> inverse_denoms;
+    ApproximateReciprocals<T, N>(denoms.data(), inverse_denoms.data());
+    result.rs_ = (a.rs_ * b.rs_ + a.is_ * b.is_) * inverse_denoms;
+    result.is_ = (a.is_ * b.rs_ - a.rs_ * b.is_) * inverse_denoms;
+    return result;
+  }
+
  private:
   Eigen::Array<T, N, 1>  rs_;
   Eigen::Array<T, N, 1>  is_;
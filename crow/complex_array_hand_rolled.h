@@ -8,6 +8,7 @@
 #include <math.h>
 
 #include "complex.h"
+#include "approximate_math.h"
 
 template <typename T, size_t N>
 class ComplexArray {
@@ -24,9 +25,10 @@ class ComplexArray {
   bool CloseTo(const Complex<T>& target,
 	       T convergence_radius,
 	       T sqr_convergence_radius) const {
+    using std::abs;
     for (size_t i = 0; i < N; i++) {
-      if (std::abs(rs_[i] - target.r) > convergence_radius) return false;
-      if (std::abs(is_[i] - target.i) > convergence_radius) return false;
+      if (abs(rs_[i] - target.r) > convergence_radius) return false;
+      if (abs(is_[i] - target.i) > convergence_radius) return false;
     }
     for (size_t i = 0; i < N; i++) {
       if ((get(i) - target).sqr_magnitude() > sqr_convergence_radius) {
@@ -114,6 +116,22 @@ class ComplexArray {
     return result;
   }
 
+  // a / b, dividing by |b|^2 with ApproximateReciprocals, for Precision::FAST.
+  friend ComplexArray<T, N> ApproximateQuotient(const ComplexArray<T, N>& a, const ComplexArray<T, N>& b) {
+    std::array<T, N> denoms;
+    for (size_t i = 0; i < N; ++i) {
+      denoms[i] = b.rs_[i] * b.rs_[i] + b.is_[i] * b.is_[i];
+    }
+    std::array<T, N> inverse_denoms;
+    ApproximateReciprocals<T, N>(denoms.data(), inverse_denoms.data());
+    ComplexArray<T, N> result;
+    for (size_t i = 0; i < N; ++i) {
+      result.rs_[i] = (a.rs_[i] * b.rs_[i] + a.is_[i] * b.is_[i]) * inverse_denoms[i];
+      result.is_[i] = (a.is_[i] * b.rs_[i] - a.rs_[i] * b.is_[i]) * inverse_denoms[i];
+    }
+    return result;
+  }
+
  private:
   std::array<T, N> rs_;
   std::array<T, N> is_;
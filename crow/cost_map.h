@@ -0,0 +1,255 @@
+#ifndef _CROW_FRACTAL_SERVER_COST_MAP_
+#define _CROW_FRACTAL_SERVER_COST_MAP_
+
+#include <vector>
+#include <optional>
+#include <mutex>
+#include <algorithm>
+#include <iostream>
+
+#include "fractal_params.h"
+#include "image_regions.h"
+
+// How many Newton iterations each part of the image took, summed over square
+// tiles. Iteration counts vary by orders of magnitude between the middle of a
+// basin and its boundary, so splitting work by pixel count leaves some tasks
+// far more expensive than others. The counts from one frame, reprojected onto
+// the next frame's viewport, predict where the expensive pixels will be, so
+// tasks can be cut to roughly equal predicted cost instead.
+//
+// Usage per frame: StartFrame(), then any number of concurrent Record() calls
+// from drawing tasks, then FinishFrame().
+class CostMap {
+ public:
+  static constexpr size_t kTileSize = 16; // TUNE.
+
+  // Per-task iteration totals for the tiles under one rect. Not thread safe,
+  // each task has its own.
+  class TileCounter {
+   public:
+    explicit TileCounter(const ImageRect& rect)
+      : rect_(rect),
+	tile_x_min_(rect.x_min / kTileSize),
+	tile_y_min_(rect.y_min / kTileSize),
+	tiles_x_((rect.x_max + kTileSize - 1) / kTileSize - tile_x_min_),
+	iters_(tiles_x_ * ((rect.y_max + kTileSize - 1) / kTileSize - tile_y_min_)) {}
+
+    void Add(size_t x, size_t y, size_t iters) {
+      iters_[(y / kTileSize - tile_y_min_) * tiles_x_ + (x / kTileSize - tile_x_min_)] += iters;
+    }
+
+   private:
+    friend class CostMap;
+
+    const ImageRect rect_;
+    const size_t tile_x_min_;
+    const size_t tile_y_min_;
+    const size_t tiles_x_;
+    std::vector<size_t> iters_;
+  };
+
+  // Sets up a prediction for a frame drawn with `params` from the previous
+  // frame's costs, if the two differ only by viewport.
+  void StartFrame(const FractalParams& params) {
+    std::scoped_lock lock(m_);
+    width_ = params.width;
+    height_ = params.height;
+    tiles_x_ = (width_ + kTileSize - 1) / kTileSize;
+    tiles_y_ = (height_ + kTileSize - 1) / kTileSize;
+    const size_t num_tiles = tiles_x_ * tiles_y_;
+
+    has_prediction_ = (previous_params_.has_value() &&
+		       ParamsDifferOnlyByViewport(params, *previous_params_));
+    if (has_prediction_) {
+      predicted_density_ = Reproject(params);
+    } else {
+      // Nothing to go on, so all pixels cost the same.
+      predicted_density_.assign(num_tiles, 1.0);
+    }
+    drawn_iters_.assign(num_tiles, 0);
+    drawn_pixels_.assign(num_tiles, 0);
+    task_costs_.clear();
+    params_ = params;
+  }
+
+  // Whether the costs of the current frame are predicted from an earlier frame,
+  // rather than just assumed to be uniform.
+  bool HasPrediction() const {
+    return has_prediction_;
+  }
+
+  // The predicted cost of row y of the current frame, between x_min and x_max.
+  double PredictRowCost(size_t y, size_t x_min, size_t x_max) const {
+    double cost = 0.0;
+    const double* tile_row = &predicted_density_[(y / kTileSize) * tiles_x_];
+    for (size_t x = x_min; x < x_max; ) {
+      const size_t tile_x = x / kTileSize;
+      const size_t x_end = std::min(x_max, (tile_x + 1) * kTileSize);
+      cost += tile_row[tile_x] * (x_end - x);
+      x = x_end;
+    }
+    return cost;
+  }
+
+  double PredictCost(const ImageRect& rect) const {
+    double cost = 0.0;
+    for (size_t y = rect.y_min; y < rect.y_max; ++y) {
+      cost += PredictRowCost(y, rect.x_min, rect.x_max);
+    }
+    return cost;
+  }
+
+  // Adds the costs counted by a task that has finished drawing its rect.
+  void Record(const TileCounter& counter) {
+    const ImageRect& rect = counter.rect_;
+    const double predicted = PredictCost(rect);
+    size_t actual = 0;
+    std::scoped_lock lock(m_);
+    for (size_t i = 0; i < counter.iters_.size(); ++i) {
+      const size_t tile_x = counter.tile_x_min_ + i % counter.tiles_x_;
+      const size_t tile_y = counter.tile_y_min_ + i / counter.tiles_x_;
+      const ImageRect tile = TileRect(tile_x, tile_y);
+      const size_t overlap_width =
+	std::min(tile.x_max, rect.x_max) - std::max(tile.x_min, rect.x_min);
+      const size_t overlap_height =
+	std::min(tile.y_max, rect.y_max) - std::max(tile.y_min, rect.y_min);
+      const size_t tile_index = tile_y * tiles_x_ + tile_x;
+      drawn_iters_[tile_index] += counter.iters_[i];
+      drawn_pixels_[tile_index] += overlap_width * overlap_height;
+      actual += counter.iters_[i];
+    }
+    task_costs_.emplace_back(predicted, actual);
+  }
+
+  // Reports how well the prediction balanced the tasks, and keeps this frame's
+  // costs to predict the next one. Tiles (or parts of tiles) that weren't drawn,
+  // e.g. because they were copied from a previous frame, keep their predicted
+  // cost.
+  void FinishFrame() {
+    std::scoped_lock lock(m_);
+    if (!params_.has_value()) {
+      return;
+    }
+    ReportImbalance();
+
+    density_.resize(tiles_x_ * tiles_y_);
+    for (size_t tile_y = 0; tile_y < tiles_y_; ++tile_y) {
+      for (size_t tile_x = 0; tile_x < tiles_x_; ++tile_x) {
+	const size_t i = tile_y * tiles_x_ + tile_x;
+	const size_t tile_pixels = TileRect(tile_x, tile_y).CountPixels();
+	const size_t undrawn_pixels = tile_pixels - std::min(tile_pixels, drawn_pixels_[i]);
+	density_[i] = (drawn_iters_[i] + predicted_density_[i] * undrawn_pixels) / tile_pixels;
+      }
+    }
+    previous_params_ = params_;
+    params_.reset();
+  }
+
+  void Clear() {
+    std::scoped_lock lock(m_);
+    params_.reset();
+    previous_params_.reset();
+    has_prediction_ = false;
+  }
+
+ private:
+  ImageRect TileRect(size_t tile_x, size_t tile_y) const {
+    return {
+      .x_min = tile_x * kTileSize,
+      .x_max = std::min(width_, (tile_x + 1) * kTileSize),
+      .y_min = tile_y * kTileSize,
+      .y_max = std::min(height_, (tile_y + 1) * kTileSize),
+    };
+  }
+
+  // Samples the previous frame's per pixel costs at a few points in each tile of
+  // the new viewport. Points that the previous frame didn't cover get its
+  // average cost.
+  std::vector<double> Reproject(const FractalParams& params) const {
+    const FractalParams& previous = *previous_params_;
+    const size_t previous_tiles_x = (previous.width + kTileSize - 1) / kTileSize;
+    double mean_density = 0.0;
+    for (const double density : density_) {
+      mean_density += density;
+    }
+    mean_density /= density_.size();
+
+    const double scale = params.r_range / params.width;
+    const double i_max = params.i_min + params.i_range();
+    const double previous_scale = previous.r_range / previous.width;
+    const double previous_i_max = previous.i_min + previous.i_range();
+
+    constexpr size_t samples_per_side = 2; // TUNE.
+    std::vector<double> output(tiles_x_ * tiles_y_);
+    for (size_t tile_y = 0; tile_y < tiles_y_; ++tile_y) {
+      for (size_t tile_x = 0; tile_x < tiles_x_; ++tile_x) {
+	const ImageRect tile = TileRect(tile_x, tile_y);
+	double total = 0.0;
+	for (size_t sy = 0; sy < samples_per_side; ++sy) {
+	  for (size_t sx = 0; sx < samples_per_side; ++sx) {
+	    const double x = tile.x_min + tile.width() * (sx + 0.5) / samples_per_side;
+	    const double y = tile.y_min + tile.height() * (sy + 0.5) / samples_per_side;
+	    const double r = params.r_min + x * scale;
+	    const double i = i_max - y * scale;
+	    const double previous_x = (r - previous.r_min) / previous_scale;
+	    const double previous_y = (previous_i_max - i) / previous_scale;
+	    if (previous_x < 0 || previous_x >= previous.width ||
+		previous_y < 0 || previous_y >= previous.height) {
+	      total += mean_density;
+	    } else {
+	      const size_t previous_tile_x = static_cast<size_t>(previous_x) / kTileSize;
+	      const size_t previous_tile_y = static_cast<size_t>(previous_y) / kTileSize;
+	      total += density_[previous_tile_y * previous_tiles_x + previous_tile_x];
+	    }
+	  }
+	}
+	output[tile_y * tiles_x_ + tile_x] = total / (samples_per_side * samples_per_side);
+      }
+    }
+    return output;
+  }
+
+  // Imbalance is the most expensive task's cost over the mean, i.e. 1 is perfect.
+  void ReportImbalance() const {
+    if (task_costs_.empty()) {
+      return;
+    }
+    double predicted_total = 0.0, predicted_max = 0.0;
+    double actual_total = 0.0, actual_max = 0.0;
+    for (const auto& [predicted, actual] : task_costs_) {
+      predicted_total += predicted;
+      predicted_max = std::max(predicted_max, predicted);
+      actual_total += actual;
+      actual_max = std::max(actual_max, static_cast<double>(actual));
+    }
+    const double num_tasks = task_costs_.size();
+    std::cout << "Task cost imbalance (max / mean) over " << task_costs_.size()
+	      << (has_prediction_ ? " cost balanced" : " pixel balanced") << " tasks, predicted: "
+	      << (predicted_total > 0 ? predicted_max * num_tasks / predicted_total : 0.0)
+	      << ", actual: "
+	      << (actual_total > 0 ? actual_max * num_tasks / actual_total : 0.0) << std::endl;
+  }
+
+  std::mutex m_;
+
+  // The frame being drawn.
+  std::optional<FractalParams> params_;
+  size_t width_ = 0;
+  size_t height_ = 0;
+  size_t tiles_x_ = 0;
+  size_t tiles_y_ = 0;
+  bool has_prediction_ = false;
+  // Predicted iterations per pixel, per tile.
+  std::vector<double> predicted_density_;
+  // What's actually been drawn so far, per tile.
+  std::vector<size_t> drawn_iters_;
+  std::vector<size_t> drawn_pixels_;
+  // Predicted and actual cost of each recorded task.
+  std::vector<std::pair<double, size_t>> task_costs_;
+
+  // Iterations per pixel, per tile, of the last finished frame.
+  std::optional<FractalParams> previous_params_;
+  std::vector<double> density_;
+};
+
+#endif // _CROW_FRACTAL_SERVER_COST_MAP_
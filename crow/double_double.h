@@ -0,0 +1,197 @@
+#ifndef _CROW_FRACTAL_SERVER_DOUBLE_DOUBLE_
+#define _CROW_FRACTAL_SERVER_DOUBLE_DOUBLE_
+
+#include <iostream>
+#include <limits>
+#include <cmath>
+
+// A number stored as the unevaluated sum of two doubles, hi + lo, with |lo| no
+// more than half an ulp of hi. That gives about 106 bits of mantissa (~32
+// decimal digits) versus 53 for a double, which is what deep zooms need once
+// the pixel spacing gets close to double epsilon times the view coordinates.
+//
+// Everything is built from error-free transforms (TwoSum and TwoProduct), which
+// are straight line code with no branches or lookups, so loops over arrays of
+// these (e.g. ComplexArray) vectorize like loops over doubles. Expect roughly
+// 5-10x the cost of double, rather than the ~100x of software multiprecision.
+//
+// The algorithms are the "sloppy" variants from the QD library (Hida, Li &
+// Bailey), which are accurate to a few ulps of the low part.
+struct DoubleDouble {
+  DoubleDouble() : hi(0.0), lo(0.0) {}
+  DoubleDouble(double value) : hi(value), lo(0.0) {}
+  DoubleDouble(double hi, double lo) : hi(hi), lo(lo) {}
+
+  explicit operator double() const {
+    return hi;
+  }
+
+  explicit operator float() const {
+    return static_cast<float>(hi);
+  }
+
+  // hi + lo exactly, as a normalized DoubleDouble. Requires |a| >= |b|.
+  static DoubleDouble QuickTwoSum(double a, double b) {
+    const double s = a + b;
+    return DoubleDouble(s, b - (s - a));
+  }
+
+  // a + b exactly, as a normalized DoubleDouble.
+  static DoubleDouble TwoSum(double a, double b) {
+    const double s = a + b;
+    const double v = s - a;
+    return DoubleDouble(s, (a - (s - v)) + (b - v));
+  }
+
+  // a * b exactly, as a normalized DoubleDouble. Both ways give the same
+  // result, being exact, so builds with and without FMA draw the same pixels.
+  static DoubleDouble TwoProduct(double a, double b) {
+    const double p = a * b;
+#ifdef __FMA__
+    return DoubleDouble(p, std::fma(a, b, -p));
+#else
+    // Dekker's algorithm, for builds without FMA (the default, see makefile).
+    constexpr double split = 134217729.0; // 2^27 + 1
+    const double a_big = split * a;
+    const double a_hi = a_big - (a_big - a);
+    const double a_lo = a - a_hi;
+    const double b_big = split * b;
+    const double b_hi = b_big - (b_big - b);
+    const double b_lo = b - b_hi;
+    return DoubleDouble(p, ((a_hi * b_hi - p) + a_hi * b_lo + a_lo * b_hi) + a_lo * b_lo);
+#endif // __FMA__
+  }
+
+  DoubleDouble& operator+=(const DoubleDouble& other);
+  DoubleDouble& operator-=(const DoubleDouble& other);
+  DoubleDouble& operator*=(const DoubleDouble& other);
+  DoubleDouble& operator/=(const DoubleDouble& other);
+
+  double hi;
+  double lo;
+};
+
+DoubleDouble operator+(const DoubleDouble& a, const DoubleDouble& b) {
+  const DoubleDouble s = DoubleDouble::TwoSum(a.hi, b.hi);
+  return DoubleDouble::QuickTwoSum(s.hi, s.lo + a.lo + b.lo);
+}
+
+DoubleDouble operator-(const DoubleDouble& a) {
+  return DoubleDouble(-a.hi, -a.lo);
+}
+
+DoubleDouble operator-(const DoubleDouble& a, const DoubleDouble& b) {
+  return a + (-b);
+}
+
+DoubleDouble operator*(const DoubleDouble& a, const DoubleDouble& b) {
+  const DoubleDouble p = DoubleDouble::TwoProduct(a.hi, b.hi);
+  return DoubleDouble::QuickTwoSum(p.hi, p.lo + (a.hi * b.lo + a.lo * b.hi));
+}
+
+DoubleDouble operator/(const DoubleDouble& a, const DoubleDouble& b) {
+  // One step of long division: q1 = a / b to double precision, then correct by
+  // the remainder.
+  const double q1 = a.hi / b.hi;
+  const DoubleDouble r = a - b * DoubleDouble(q1);
+  const double q2 = r.hi / b.hi;
+  return DoubleDouble::QuickTwoSum(q1, q2);
+}
+
+DoubleDouble& DoubleDouble::operator+=(const DoubleDouble& other) {
+  *this = *this + other;
+  return *this;
+}
+
+DoubleDouble& DoubleDouble::operator-=(const DoubleDouble& other) {
+  *this = *this - other;
+  return *this;
+}
+
+DoubleDouble& DoubleDouble::operator*=(const DoubleDouble& other) {
+  *this = *this * other;
+  return *this;
+}
+
+DoubleDouble& DoubleDouble::operator/=(const DoubleDouble& other) {
+  *this = *this / other;
+  return *this;
+}
+
+bool operator==(const DoubleDouble& a, const DoubleDouble& b) {
+  return a.hi == b.hi && a.lo == b.lo;
+}
+
+bool operator!=(const DoubleDouble& a, const DoubleDouble& b) {
+  return !(a == b);
+}
+
+bool operator<(const DoubleDouble& a, const DoubleDouble& b) {
+  return a.hi < b.hi || (a.hi == b.hi && a.lo < b.lo);
+}
+
+bool operator>(const DoubleDouble& a, const DoubleDouble& b) {
+  return b < a;
+}
+
+bool operator<=(const DoubleDouble& a, const DoubleDouble& b) {
+  return !(b < a);
+}
+
+bool operator>=(const DoubleDouble& a, const DoubleDouble& b) {
+  return !(a < b);
+}
+
+// Found by argument dependent lookup, see the `using std::abs` in complex.h.
+DoubleDouble abs(const DoubleDouble& a) {
+  return a.hi < 0.0 ? -a : a;
+}
+
+DoubleDouble sqrt(const DoubleDouble& a) {
+  if (a.hi <= 0.0) {
+    return DoubleDouble(std::sqrt(a.hi));
+  }
+  // One Newton step from the double precision root.
+  const double x = std::sqrt(a.hi);
+  const DoubleDouble x_sqr = DoubleDouble::TwoProduct(x, x);
+  return DoubleDouble::QuickTwoSum(x, (a - x_sqr).hi * (0.5 / x));
+}
+
+std::ostream& operator<<(std::ostream& os, const DoubleDouble& a) {
+  const std::streamsize precision = os.precision(17);
+  os << a.hi;
+  if (a.lo != 0.0) {
+    os << (a.lo < 0.0 ? "" : "+") << a.lo;
+  }
+  os.precision(precision);
+  return os;
+}
+
+namespace std {
+template <>
+class numeric_limits<DoubleDouble> {
+ public:
+  static constexpr bool is_specialized = true;
+  static DoubleDouble infinity() {
+    return DoubleDouble(numeric_limits<double>::infinity());
+  }
+  static DoubleDouble epsilon() {
+    // 2^-104.
+    return DoubleDouble(4.93038065763132e-32);
+  }
+};
+} // namespace std
+
+// Converts a number given as the sum high + low (e.g. a view coordinate carried
+// at double-double precision) to T, keeping as much of it as T can hold.
+template <typename T>
+T FromHighAndLow(double high, double /*low*/) {
+  return static_cast<T>(high);
+}
+
+template <>
+DoubleDouble FromHighAndLow<DoubleDouble>(double high, double low) {
+  return DoubleDouble::TwoSum(high, low);
+}
+
+#endif // _CROW_FRACTAL_SERVER_DOUBLE_DOUBLE_
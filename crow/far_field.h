@@ -0,0 +1,136 @@
+#ifndef _CROW_FRACTAL_SERVER_FAR_FIELD_
+#define _CROW_FRACTAL_SERVER_FAR_FIELD_
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <complex>
+#include <array>
+
+#include "complex.h"
+#include "complex_array.h"
+
+// Jumps land at least this many times further from the zeros' centroid than
+// the furthest zero is. Larger is more accurate but skips less.
+constexpr double kFarFieldRadiusFactor = 16.0; // TUNE.
+
+// Jumps shorter than this many steps cost more than the steps they save.
+constexpr size_t kFarFieldMinSteps = 4; // TUNE.
+
+// Newton steps only take points further out where p' is small, which is rare,
+// so blocks of points are only checked for any back in the far field every
+// this many steps. New points are checked as they come in.
+constexpr size_t kFarFieldRecheckSteps = 16; // TUNE.
+
+// Jumps points that are far from every zero across many Newton steps at once.
+//
+// Seen from far away, a degree d polynomial looks like (z - c)^d, where c is
+// the centroid of its zeros, and Newton's method for that just shrinks the
+// offset from c by a factor of q = 1 - 1/d per step. So a point starting well
+// outside the zeros crawls in towards them, taking about log(distance) /
+// log(1 / q) steps, i.e. ~d steps per factor of e, before anything
+// interesting happens. Those steps can be done in one go.
+//
+// More precisely, with w = z - c and M = sum((zero - c)^2), a Newton step is
+// w -> q w + M / (d^2 w) + O(1 / w^2), as the 1 / w^2 terms of p'/p cancel by
+// the choice of c. So u = w^2 steps as u -> q^2 u + 2 q M / d^2 + O(1 / w),
+// which is linear, and k steps of it sum in closed form. The O(1 / w) term,
+// relative to u, is about (R / |w|)^3 with R the distance from c to the
+// furthest zero, and summed over a jump that lands at rho R (rho being
+// kFarFieldRadiusFactor) it comes to a relative error of about 1 / rho^3 in
+// where the point lands. That's a small fraction of a pixel, but as with any
+// change in rounding, a pixel right on a basin boundary can come out on the
+// other side. So it's only used if FractalParams::far_field asks for it.
+template <typename T>
+class FarField {
+ public:
+  FarField(const std::vector<Complex<T>>& zeros) {
+    const size_t degree = zeros.size();
+    std::complex<double> sum = 0.0;
+    for (const Complex<T>& zero : zeros) {
+      sum += ToDouble(zero);
+    }
+    const std::complex<double> centroid = sum / static_cast<double>(degree);
+    centroid_ = Complex<T>(T(centroid.real()), T(centroid.imag()));
+    double max_sqr_radius = 0.0;
+    std::complex<double> second_moment = 0.0;
+    for (const Complex<T>& zero : zeros) {
+      const std::complex<double> offset = ToDouble(zero) - centroid;
+      max_sqr_radius = std::max(max_sqr_radius, std::norm(offset));
+      second_moment += offset * offset;
+    }
+    // Degree 1 converges in one step anyway, and repeated zeros have no
+    // convergence radius to land outside of.
+    if (degree < 2 || !(max_sqr_radius > 0.0)) {
+      sqr_landing_radius_ = std::numeric_limits<T>::infinity();
+      sqr_far_radius_ = std::numeric_limits<T>::infinity();
+      return;
+    }
+    contraction_ = 1.0 - 1.0 / degree;
+    log_inverse_contraction_ = -std::log(contraction_);
+    sqr_landing_radius_ = T(max_sqr_radius * kFarFieldRadiusFactor * kFarFieldRadiusFactor);
+    sqr_far_radius_ = T(static_cast<double>(sqr_landing_radius_) /
+			std::pow(contraction_, 2.0 * kFarFieldMinSteps));
+    drift_ = 2.0 * contraction_ * second_moment / (1.0 * degree * degree) /
+      (1.0 - contraction_ * contraction_);
+  }
+
+  // Flags the lanes of the block that are in the far field, returning
+  // whether there are any, i.e. whether to bother with Jump().
+  template <size_t N>
+  bool FindFar(const ComplexArray<T, N>& block, std::array<bool, N>* far) const {
+    bool any_far = false;
+    for (size_t b = 0; b < N; ++b) {
+      const T dr = block.rs(b) - centroid_.r;
+      const T di = block.is(b) - centroid_.i;
+      (*far)[b] = (dr * dr + di * di > sqr_far_radius_);
+      any_far |= (*far)[b];
+    }
+    return any_far;
+  }
+
+  // If z is in the far field, moves it to where k Newton steps would take it,
+  // for the largest k (up to max_steps) that keeps it outside the landing
+  // radius, and returns k. Otherwise returns 0.
+  size_t Jump(Complex<T>* z, size_t max_steps) const {
+    const Complex<T> offset = *z - centroid_;
+    if (!(offset.sqr_magnitude() > sqr_far_radius_)) {
+      return 0;
+    }
+    const double sqr_ratio = static_cast<double>(offset.sqr_magnitude() / sqr_landing_radius_);
+    const double steps = std::min(std::floor(0.5 * std::log(sqr_ratio) / log_inverse_contraction_),
+				  static_cast<double>(max_steps));
+    if (!(steps >= 1.0)) {
+      return 0;
+    }
+    // u_k = q^2k u_0 + drift (1 - q^2k), then back to the root of u_k that's
+    // nearest the first order answer, q^k w_0.
+    const std::complex<double> w = ToDouble(offset);
+    const double scale = std::pow(contraction_, steps);
+    const double sqr_scale = scale * scale;
+    std::complex<double> jumped = std::sqrt(sqr_scale * w * w + (1.0 - sqr_scale) * drift_);
+    if (std::real(jumped * std::conj(w)) < 0.0) {
+      jumped = -jumped;
+    }
+    *z = centroid_ + Complex<T>(T(jumped.real()), T(jumped.imag()));
+    return static_cast<size_t>(steps);
+  }
+
+ private:
+  static std::complex<double> ToDouble(const Complex<T>& z) {
+    return std::complex<double>(static_cast<double>(z.r), static_cast<double>(z.i));
+  }
+
+  Complex<T> centroid_;
+  // Jumps land outside the landing radius, and are only taken from outside
+  // the far radius, kFarFieldMinSteps further out.
+  T sqr_landing_radius_;
+  T sqr_far_radius_;
+  double contraction_ = 0.0;
+  double log_inverse_contraction_ = 0.0;
+  // 2 q M / (d^2 (1 - q^2)), the fixed point u tends to.
+  std::complex<double> drift_ = 0.0;
+};
+
+#endif // _CROW_FRACTAL_SERVER_FAR_FIELD_
@@ -0,0 +1,216 @@
+#ifndef _CROW_FRACTAL_SERVER_FIXED_POINT_
+#define _CROW_FRACTAL_SERVER_FIXED_POINT_
+
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <cmath>
+#include <stdint.h>
+
+#include "complex.h"
+
+// Fixed point numbers for Precision::FIXED: int64_t values with
+// kFixedPointFractionBits bits after the binary point, i.e. Q32.32.
+//
+// Floating point results depend on the build (e.g. whether a * b + c is
+// contracted to an FMA) and on the ISA, so the same tile drawn on two hosts
+// can differ in a few pixels. Integer arithmetic is exact everywhere, so
+// drawing in fixed point gives the same zero for every pixel on every host and
+// build, e.g. for sharing a cache of drawn tiles.
+//
+// Resolution is 2^-32 (~2.3e-10), so it's for views no deeper than DOUBLE
+// handles. Coordinates are clamped to +-2^20, which keeps every intermediate
+// of the Newton step well inside an __int128.
+constexpr int kFixedPointFractionBits = 32;
+constexpr int64_t kFixedPointMaxRaw = int64_t(1) << 52;
+
+using Int128 = __int128;
+
+Int128 ClampInt128(Int128 value, Int128 limit) {
+  return value > limit ? limit : (value < -limit ? -limit : value);
+}
+
+// Rounds to the nearest fixed point number, clamped to the representable
+// range. This is the only place that floating point is involved, and scaling
+// by a power of two and rounding are exact, so it's deterministic too.
+int64_t ToFixedPoint(double value) {
+  const double limit = std::ldexp(1.0, 52 - kFixedPointFractionBits);
+  if (!(value > -limit)) {
+    return value != value ? 0 : -kFixedPointMaxRaw;
+  }
+  if (!(value < limit)) {
+    return kFixedPointMaxRaw;
+  }
+  return std::llround(std::ldexp(value, kFixedPointFractionBits));
+}
+
+// x * 2^64 / divisor, for a positive divisor, as (x * reciprocal) >> shift.
+// Finding the reciprocal takes one divide of a 128 bit number by a 64 bit one,
+// which takes libgcc's fast path rather than a full 128 bit divide, and it's
+// shared by both parts of a complex number. It's exact to within a couple of
+// units in the last place, and being all integer, it's the same couple
+// everywhere.
+class FixedPointReciprocal {
+ public:
+  explicit FixedPointReciprocal(Int128 divisor) {
+    const uint64_t high = static_cast<unsigned __int128>(divisor) >> 64;
+    const uint64_t low = static_cast<uint64_t>(divisor);
+    const int bits = high != 0 ? 128 - __builtin_clzll(high) : 64 - __builtin_clzll(low);
+    // Bring the divisor to at most 63 bits, and at least 63 bits unless that
+    // would need shift_ below zero, then 2^125 / divisor fits in 65 bits.
+    const int scale = std::max(bits - 63, -61);
+    const uint64_t normalized = scale >= 0 ? divisor >> scale : divisor << -scale;
+    reciprocal_ = (static_cast<unsigned __int128>(1) << 125) / normalized;
+    shift_ = 61 + scale;
+  }
+
+  // |x| must be at most 2^62.
+  Int128 Times(int64_t x) const {
+    return (Int128(x) * reciprocal_) >> shift_;
+  }
+
+ private:
+  Int128 reciprocal_;
+  int shift_;
+};
+
+// The pixel grid of a view in fixed point. Pixel coordinates are computed
+// from x and y directly, rather than stepped to, so they don't depend on what
+// order pixels are drawn in.
+class FixedPointGrid {
+ public:
+  FixedPointGrid(double r_min, double r_min_lo, double i_min, double i_min_lo,
+		 double delta, size_t height)
+    : r_min_(ToFixedPoint(r_min) + ToFixedPoint(r_min_lo)),
+      i_min_(ToFixedPoint(i_min) + ToFixedPoint(i_min_lo)),
+      delta_(ToFixedPoint(delta)),
+      height_(height) {}
+
+  int64_t r(size_t x) const {
+    return ClampInt128(Int128(r_min_) + Int128(delta_) * x, kFixedPointMaxRaw);
+  }
+
+  // Row 0 is the top of the image, i.e. the largest i.
+  int64_t i(size_t y) const {
+    return ClampInt128(Int128(i_min_) + Int128(delta_) * (height_ - 1 - y), kFixedPointMaxRaw);
+  }
+
+ private:
+  int64_t r_min_;
+  int64_t i_min_;
+  int64_t delta_;
+  size_t height_;
+};
+
+// Newton's method in fixed point, as z -= 1 / sum_i 1 / (z - zero_i), the
+// same step as z -= p(z) / p'(z) but with every intermediate bounded: a term
+// is only summed for z outside the convergence radius of its zero, so it's at
+// most 1 / radius. Each 1 / w is conj(w) / |w|^2, with |w|^2 held as a Q64.64
+// __int128 and divided by with FixedPointReciprocal.
+//
+// x86 has no SIMD 64x64 -> 128 bit multiply or 128 bit divide, so those are
+// done a lane at a time, while the loads, subtractions and comparisons around
+// them are laid out over the lanes of a block like ComplexArray.
+class FixedPointPolynomial {
+ public:
+  explicit FixedPointPolynomial(const std::vector<ComplexD>& zeros) {
+    for (const ComplexD& zero : zeros) {
+      zero_rs_.push_back(ToFixedPoint(zero.r));
+      zero_is_.push_back(ToFixedPoint(zero.i));
+    }
+    // As ConservativeConvergenceRadius: a 20th of the smallest distance
+    // between zeros, i.e. a 400th of its square.
+    Int128 min_sqr_distance = -1;
+    for (size_t i = 0; i < zeros.size(); ++i) {
+      for (size_t j = i + 1; j < zeros.size(); ++j) {
+	const Int128 dr = zero_rs_[i] - zero_rs_[j];
+	const Int128 di = zero_is_[i] - zero_is_[j];
+	const Int128 sqr_distance = dr * dr + di * di;
+	if (min_sqr_distance < 0 || sqr_distance < min_sqr_distance) {
+	  min_sqr_distance = sqr_distance;
+	}
+      }
+    }
+    sqr_convergence_radius_ = min_sqr_distance < 0 ? 0 : min_sqr_distance / 400;
+  }
+
+  // For each lane of the block (rs, is): sets (*converged)[b] to the index of
+  // the zero it's within the convergence radius of, or -1, and (*closest)[b]
+  // to the index of the closest zero (the lowest, on ties). Then takes a
+  // Newton step on the lanes that haven't converged.
+  template <size_t N>
+  void Iterate(std::array<int64_t, N>* rs, std::array<int64_t, N>* is,
+	       std::array<int32_t, N>* converged, std::array<uint32_t, N>* closest) const {
+    std::array<Int128, N> sum_rs;
+    std::array<Int128, N> sum_is;
+    std::array<Int128, N> closest_sqr_distances;
+    sum_rs.fill(0);
+    sum_is.fill(0);
+    converged->fill(-1);
+    closest->fill(0);
+    closest_sqr_distances.fill(-1);
+    for (size_t z = 0; z < zero_rs_.size(); ++z) {
+      for (size_t b = 0; b < N; ++b) {
+	const int64_t wr = (*rs)[b] - zero_rs_[z];
+	const int64_t wi = (*is)[b] - zero_is_[z];
+	const Int128 sqr_distance = Int128(wr) * wr + Int128(wi) * wi;
+	if (closest_sqr_distances[b] < 0 || sqr_distance < closest_sqr_distances[b]) {
+	  closest_sqr_distances[b] = sqr_distance;
+	  (*closest)[b] = z;
+	}
+	if (sqr_distance <= sqr_convergence_radius_) {
+	  if ((*converged)[b] < 0) {
+	    (*converged)[b] = z;
+	  }
+	  continue;
+	}
+	// 1 / w, in Q32.32.
+	const FixedPointReciprocal reciprocal(sqr_distance);
+	sum_rs[b] += reciprocal.Times(wr);
+	sum_is[b] -= reciprocal.Times(wi);
+      }
+    }
+    for (size_t b = 0; b < N; ++b) {
+      if ((*converged)[b] >= 0) {
+	continue;
+      }
+      // z -= 1 / sum. A zero sum (e.g. z exactly between two zeros) has no
+      // step, which leaves the lane to run out of iterations.
+      const int64_t sr = ClampInt128(sum_rs[b], int64_t(1) << 62);
+      const int64_t si = ClampInt128(sum_is[b], int64_t(1) << 62);
+      const Int128 sqr_magnitude = Int128(sr) * sr + Int128(si) * si;
+      if (sqr_magnitude == 0) {
+	continue;
+      }
+      const FixedPointReciprocal reciprocal(sqr_magnitude);
+      const Int128 step_r = ClampInt128(reciprocal.Times(sr), int64_t(1) << 62);
+      const Int128 step_i = ClampInt128(-reciprocal.Times(si), int64_t(1) << 62);
+      (*rs)[b] = ClampInt128((*rs)[b] - step_r, kFixedPointMaxRaw);
+      (*is)[b] = ClampInt128((*is)[b] - step_i, kFixedPointMaxRaw);
+    }
+  }
+
+ private:
+  std::vector<int64_t> zero_rs_;
+  std::vector<int64_t> zero_is_;
+  // In Q64.64, like the squared distances it's compared with.
+  Int128 sqr_convergence_radius_;
+};
+
+// The last one built is kept for reuse, as every task of a frame needs it and
+// finding the convergence radius is O(degree^2).
+std::shared_ptr<const FixedPointPolynomial> GetFixedPointPolynomial(const std::vector<ComplexD>& zeros) {
+  static std::mutex mutex;
+  static std::vector<ComplexD> last_zeros;
+  static std::shared_ptr<const FixedPointPolynomial> last_polynomial;
+  std::lock_guard<std::mutex> lock(mutex);
+  if (last_polynomial == nullptr || last_zeros != zeros) {
+    last_polynomial = std::make_shared<const FixedPointPolynomial>(zeros);
+    last_zeros = zeros;
+  }
+  return last_polynomial;
+}
+
+#endif // _CROW_FRACTAL_SERVER_FIXED_POINT_
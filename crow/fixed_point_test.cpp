@@ -0,0 +1,124 @@
+#include <iostream>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <utility>
+
+#include "fractal_drawing.h"
+#include "development_utils.h"
+#include "test_utils.h"
+
+// What Precision::FIXED draws each scene as, see Checksum(). Drawing in fixed
+// point is exact, so these are the same for every host and build: if they
+// change, either the kernel or the scenes have changed, and they should be
+// updated together.
+const std::map<std::string, uint64_t> kExpectedChecksums = {
+  {"overview", 826195214853136487ull},
+  {"boundary", 10563367992338453791ull},
+  {"many_zeros", 4389401922582261683ull},
+};
+
+// FNV-1a over the pixels, for comparing images across runs and hosts.
+uint64_t Checksum(const RGBImage& image) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t y = 0; y < image.get_height(); ++y) {
+    for (size_t x = 0; x < image.get_width(); ++x) {
+      for (uint8_t channel : {image[y][x].red, image[y][x].green, image[y][x].blue}) {
+	hash = (hash ^ channel) * 1099511628211ull;
+      }
+    }
+  }
+  return hash;
+}
+
+// Compares FIXED's throughput with SINGLE's and DOUBLE's, and checks that it
+// draws the same image whatever the block width and threading, and as on
+// every other host. Returns whether it did.
+bool Compare(const std::string& name, const FractalParams& params, ThreadPool& thread_pool) {
+  RGBImage single(params.width, params.height);
+  RGBImage reference(params.width, params.height);
+  RGBImage fixed(params.width, params.height);
+  const double single_ms = Draw(params, Precision::SINGLE, single, thread_pool);
+  const double double_ms = Draw(params, Precision::DOUBLE, reference, thread_pool);
+  const double fixed_ms = Draw(params, Precision::FIXED, fixed, thread_pool);
+  const uint64_t checksum = Checksum(fixed);
+
+  bool ok = true;
+  for (size_t other_width : TuningParams::kBlockWidths) {
+    RGBImage other(params.width, params.height);
+    Draw(params, Precision::FIXED, other, thread_pool, Strategy::DYNAMIC_BLOCK, other_width,
+	 /*iterations=*/1);
+    if (Checksum(other) != checksum) {
+      std::cout << name << ": single threaded with block width " << other_width
+		<< " differs" << std::endl;
+      ok = false;
+    }
+  }
+  const uint64_t expected = kExpectedChecksums.at(name);
+  if (checksum != expected) {
+    std::cout << name << ": checksum " << checksum << ", expected " << expected << std::endl;
+    ok = false;
+  }
+
+  std::cout << name << ": SINGLE (ms): " << single_ms << ", DOUBLE (ms): " << double_ms
+	    << ", FIXED (ms): " << fixed_ms << ", FIXED differing from DOUBLE: "
+	    << 100 * DifferingFraction(reference, fixed) << "%"
+	    << (ok ? "" : " -- not reproducible") << std::endl;
+  fixed.write(TestOutputPath("fixed_point_test_output_" + name + ".png"));
+  return ok;
+}
+
+// Pans the scene a few times with each of the strategies that reuse the
+// previous frame when panning, and checks that each frame comes out the same
+// as drawing it from scratch. Returns whether they all did.
+bool CheckPans(const std::string& name, FractalParams params, ThreadPool& thread_pool) {
+  params.precision = Precision::FIXED;
+  const double pixel = params.r_range / params.width;
+  bool ok = true;
+  const std::pair<Strategy, std::string> strategies[] = {
+    {Strategy::DYNAMIC_BLOCK_THREADED_INCREMENTAL, "incremental"},
+    {Strategy::DYNAMIC_BLOCK_THREADED_SCROLLING, "scrolling"},
+  };
+  for (const auto& [strategy, strategy_name] : strategies) {
+    params.strategy = strategy;
+    ScrollingImage scrolling_image;
+    std::optional<FractalParams> previous_params = std::nullopt;
+    std::unique_ptr<RGBImage> previous_image = nullptr;
+    FractalParams panned = params;
+    for (int pan = 0; pan < 4; ++pan) {
+      panned.r_min += 97 * pixel;
+      panned.i_min -= 61 * pixel;
+      auto image = std::make_unique<RGBImage>(params.width, params.height);
+      DrawFractal({
+	  .params = panned,
+	  .image = *image,
+	  .previous_params = previous_params,
+	  .previous_image = previous_image.get(),
+	  .thread_pool = thread_pool,
+	  .scrolling_image = &scrolling_image,
+	});
+      RGBImage from_scratch(params.width, params.height);
+      Draw(panned, Precision::FIXED, from_scratch, thread_pool, strategy,
+	   /*block_width=*/std::nullopt, /*iterations=*/1);
+      if (Checksum(*image) != Checksum(from_scratch)) {
+	std::cout << name << ": pan " << pan << " with " << strategy_name
+		  << " differs from drawing it from scratch" << std::endl;
+	ok = false;
+      }
+      previous_params = panned;
+      previous_image = std::move(image);
+    }
+  }
+  return ok;
+}
+
+int main() {
+  ThreadPool thread_pool(TestThreads());
+
+  bool ok = true;
+  ok &= Compare("overview", OverviewScene(), thread_pool);
+  ok &= Compare("boundary", BoundaryScene(), thread_pool);
+  ok &= Compare("many_zeros", ManyZerosScene(), thread_pool);
+  ok &= CheckPans("boundary", BoundaryScene(), thread_pool);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1160,16 +1160,26 @@ do { \
 		return dst_ofs;
 	}
 
+	// When zlib_stream is false, only the raw deflate data is written (no zlib header or adler32).
+	// When final_block is false, BFINAL is left clear and the block is followed by a sync flush
+	// (an empty stored block), so the output can be concatenated with further deflate data.
 	static uint32_t pixel_deflate_dyn_3_rle_one_pass(
 		const uint8_t* pImg, uint32_t w, uint32_t h,
-		uint8_t* pDst, uint32_t dst_buf_size)
+		uint8_t* pDst, uint32_t dst_buf_size,
+		bool zlib_stream = true, bool final_block = true)
 	{
 		const uint32_t bpl = 1 + w * 3;
 
-		if (dst_buf_size < sizeof(g_dyn_huff_3))
+		const uint32_t prefix_ofs = zlib_stream ? 0 : 2;
+		const uint32_t prefix_size = sizeof(g_dyn_huff_3) - prefix_ofs;
+		if (dst_buf_size < prefix_size)
 			return false;
-		memcpy(pDst, g_dyn_huff_3, sizeof(g_dyn_huff_3));
-		uint32_t dst_ofs = sizeof(g_dyn_huff_3);
+		memcpy(pDst, g_dyn_huff_3 + prefix_ofs, prefix_size);
+		uint32_t dst_ofs = prefix_size;
+
+		// Clear BFINAL, the first bit after the zlib header.
+		if (!final_block)
+			pDst[2 - prefix_ofs] &= ~1;
 
 		uint64_t bit_buf = DYN_HUFF_3_BITBUF;
 		int bit_buf_size = DYN_HUFF_3_BITBUF_SIZE;
@@ -1177,7 +1187,7 @@ do { \
 		const uint8_t* pSrc = pImg;
 		uint32_t src_ofs = 0;
 
-		uint32_t src_adler32 = fpng_adler32(pImg, bpl * h, FPNG_ADLER32_INIT);
+		uint32_t src_adler32 = zlib_stream ? fpng_adler32(pImg, bpl * h, FPNG_ADLER32_INIT) : 0;
 
 		for (uint32_t y = 0; y < h; y++)
 		{
@@ -1248,8 +1258,24 @@ do { \
 
 		PUT_BITS_CZ(g_dyn_huff_3_codes[256].m_code, g_dyn_huff_3_codes[256].m_code_size);
 
+		// Sync flush: an empty, non-final stored block.
+		if (!final_block)
+			PUT_BITS(0, 3);
+
 		PUT_BITS_FORCE_FLUSH;
 
+		if (!final_block)
+		{
+			static const uint8_t s_empty_stored_len[4] = { 0x00, 0x00, 0xFF, 0xFF };
+			if ((dst_ofs + 4) > dst_buf_size)
+				return 0;
+			memcpy(pDst + dst_ofs, s_empty_stored_len, 4);
+			dst_ofs += 4;
+		}
+
+		if (!zlib_stream)
+			return dst_ofs;
+
 		// Write zlib adler32
 		for (uint32_t i = 0; i < 4; i++)
 		{
@@ -1579,13 +1605,14 @@ do_literals:
 		return dst_ofs;
 	}
 
-	static void vector_append(std::vector<uint8_t>& buf, const void* pData, size_t len)
+	template <typename Buffer>
+	static void vector_append(Buffer& buf, const void* pData, size_t len)
 	{
 		if (len)
 		{
 			size_t l = buf.size();
 			buf.resize(l + len);
-			memcpy(buf.data() + l, pData, len);
+			memcpy(&buf[0] + l, pData, len);
 		}
 	}
 		
@@ -1659,7 +1686,9 @@ do_literals:
 		}
 	}
 
-	bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<uint8_t>& out_buf, uint32_t flags)
+	// Buffer is std::vector<uint8_t> or std::string.
+	template <typename Buffer>
+	static bool encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, Buffer& out_buf, uint32_t flags)
 	{
 		if (!endian_check())
 		{
@@ -1710,16 +1739,16 @@ do_literals:
 			if (num_chans == 3)
 			{
 				if (flags & FPNG_ENCODE_SLOWER)
-					defl_size = pixel_deflate_dyn_3_rle(temp_buf.data(), w, h, &out_buf[out_ofs], (uint32_t)out_buf.size() - out_ofs);
+					defl_size = pixel_deflate_dyn_3_rle(temp_buf.data(), w, h, (uint8_t*)&out_buf[out_ofs], (uint32_t)out_buf.size() - out_ofs);
 				else
-					defl_size = pixel_deflate_dyn_3_rle_one_pass(temp_buf.data(), w, h, &out_buf[out_ofs], (uint32_t)out_buf.size() - out_ofs);
+					defl_size = pixel_deflate_dyn_3_rle_one_pass(temp_buf.data(), w, h, (uint8_t*)&out_buf[out_ofs], (uint32_t)out_buf.size() - out_ofs);
 			}
 			else
 			{
 				if (flags & FPNG_ENCODE_SLOWER)
-					defl_size = pixel_deflate_dyn_4_rle(temp_buf.data(), w, h, &out_buf[out_ofs], (uint32_t)out_buf.size() - out_ofs);
+					defl_size = pixel_deflate_dyn_4_rle(temp_buf.data(), w, h, (uint8_t*)&out_buf[out_ofs], (uint32_t)out_buf.size() - out_ofs);
 				else
-					defl_size = pixel_deflate_dyn_4_rle_one_pass(temp_buf.data(), w, h, &out_buf[out_ofs], (uint32_t)out_buf.size() - out_ofs);
+					defl_size = pixel_deflate_dyn_4_rle_one_pass(temp_buf.data(), w, h, (uint8_t*)&out_buf[out_ofs], (uint32_t)out_buf.size() - out_ofs);
 			}
 		}
 
@@ -1746,7 +1775,7 @@ do_literals:
 						
 			out_buf.resize(out_ofs + 6 + temp_buf_ofs + ((temp_buf_ofs + 65534) / 65535) * 5);
 
-			uint32_t raw_size = write_raw_block(temp_buf.data(), (uint32_t)temp_buf_ofs, out_buf.data() + out_ofs, (uint32_t)out_buf.size() - out_ofs);
+			uint32_t raw_size = write_raw_block(temp_buf.data(), (uint32_t)temp_buf_ofs, (uint8_t*)&out_buf[0] + out_ofs, (uint32_t)out_buf.size() - out_ofs);
 			if (!raw_size)
 			{
 				// Somehow we miscomputed the size of the output buffer.
@@ -1787,21 +1816,82 @@ do_literals:
 			for (i = 0; i < 4; ++i, c <<= 8)
 				((uint8_t*)(pnghdr + 29))[i] = (uint8_t)(c >> 24);
 
-			memcpy(out_buf.data(), pnghdr, PNG_HEADER_SIZE);
+			memcpy((uint8_t*)&out_buf[0], pnghdr, PNG_HEADER_SIZE);
 		}
 
 		// Write IDAT chunk's CRC32 and a 0 length IEND chunk
 		vector_append(out_buf, "\0\0\0\0\0\0\0\0\x49\x45\x4e\x44\xae\x42\x60\x82", 16); // IDAT CRC32, followed by the IEND chunk
 
 		// Compute IDAT crc32
-		uint32_t c = (uint32_t)fpng_crc32(out_buf.data() + PNG_HEADER_SIZE - 4, idat_len + 4, FPNG_CRC32_INIT);
+		uint32_t c = (uint32_t)fpng_crc32((uint8_t*)&out_buf[0] + PNG_HEADER_SIZE - 4, idat_len + 4, FPNG_CRC32_INIT);
 		
 		for (i = 0; i < 4; ++i, c <<= 8)
-			(out_buf.data() + out_buf.size() - 16)[i] = (uint8_t)(c >> 24);
+			((uint8_t*)&out_buf[0] + out_buf.size() - 16)[i] = (uint8_t)(c >> 24);
 				
 		return true;
 	}
 
+	bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<uint8_t>& out_buf, uint32_t flags)
+	{
+		return encode_image_to_memory(pImage, w, h, num_chans, out_buf, flags);
+	}
+
+	bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::string& out_buf, uint32_t flags)
+	{
+		return encode_image_to_memory(pImage, w, h, num_chans, out_buf, flags);
+	}
+
+	bool fpng_deflate_filtered_rows_rgb(const void* pFiltered, uint32_t w, uint32_t h, bool final_block, std::string& out_buf)
+	{
+		if (!endian_check())
+		{
+			assert(0);
+			return false;
+		}
+
+		if ((w < 1) || (h < 1) || (w * (uint64_t)h > UINT32_MAX) || (w > FPNG_MAX_SUPPORTED_DIM) || (h > FPNG_MAX_SUPPORTED_DIM))
+		{
+			assert(0);
+			return false;
+		}
+
+		const uint32_t bpl = 1 + w * 3;
+		const uint32_t start_ofs = (uint32_t)out_buf.size();
+
+		// Same slack as fpng_encode_image_to_memory(), the bit writer flushes 8 bytes at a time.
+		out_buf.resize(start_ofs + ((bpl * h + 64) & ~7));
+
+		uint32_t defl_size = pixel_deflate_dyn_3_rle_one_pass((const uint8_t*)pFiltered, w, h, (uint8_t*)&out_buf[start_ofs], (uint32_t)out_buf.size() - start_ofs, false, final_block);
+
+		if (!defl_size)
+		{
+			// Dynamic block failed to compress - fall back to stored blocks of up to 64K each.
+			out_buf.resize(start_ofs);
+
+			const uint8_t* pSrc = (const uint8_t*)pFiltered;
+			uint32_t remaining = bpl * h;
+			do
+			{
+				const uint32_t n = minimum<uint32_t>(remaining, 65535);
+				remaining -= n;
+
+				out_buf.push_back((char)((final_block && !remaining) ? 1 : 0));
+				out_buf.push_back((char)n);
+				out_buf.push_back((char)(n >> 8));
+				out_buf.push_back((char)~n);
+				out_buf.push_back((char)(~n >> 8));
+				out_buf.append((const char*)pSrc, n);
+				pSrc += n;
+			} while (remaining);
+
+			// A non-final stored block is already byte aligned, so no sync flush is needed.
+			return true;
+		}
+
+		out_buf.resize(start_ofs + defl_size);
+		return true;
+	}
+
 #ifndef FPNG_NO_STDIO
 	bool fpng_encode_image_to_file(const char* pFilename, const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, uint32_t flags)
 	{
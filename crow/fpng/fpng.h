@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <vector>
+#include <string>
 
 #ifndef FPNG_TRAIN_HUFFMAN_TABLES
 	// Set to 1 when using the -t (training) option in fpng_test to generate new opaque/alpha Huffman tables for the single pass encoder.
@@ -47,6 +48,14 @@ namespace fpng
 	// num_chans must be 3 or 4. 
 	bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::vector<uint8_t>& out_buf, uint32_t flags = 0);
 
+	// As above, but encoding straight into a string, e.g. to be used as a response body without a copy.
+	bool fpng_encode_image_to_memory(const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, std::string& out_buf, uint32_t flags = 0);
+
+	// Compresses already filtered 3 channel rows (a filter byte followed by w*3 bytes, per row) into raw Deflate data,
+	// without a zlib header or adler32, appending it to out_buf. Non-final output ends with a sync flush, so the output
+	// of several calls can be concatenated into a single Deflate stream. Used to compress image stripes in parallel.
+	bool fpng_deflate_filtered_rows_rgb(const void* pFiltered, uint32_t w, uint32_t h, bool final_block, std::string& out_buf);
+
 #ifndef FPNG_NO_STDIO
 	// Fast PNG encoding to the specified file.
 	bool fpng_encode_image_to_file(const char* pFilename, const void* pImage, uint32_t w, uint32_t h, uint32_t num_chans, uint32_t flags = 0);
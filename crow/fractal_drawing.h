@@ -3,9 +3,14 @@
 
 #include <vector>
 #include <optional>
+#include <functional>
+#include <algorithm>
+#include <tuple>
+#include <type_traits>
 
 #include "rgb_image.h"
 #include "complex.h"
+#include "double_double.h"
 #include "complex_array.h"
 #include "polynomial.h"
 #include "analyzed_polynomial.h"
@@ -15,6 +20,11 @@
 #include "image_regions.h"
 #include "image_operations.h"
 #include "pixel_iterator.h"
+#include "scrolling_image.h"
+#include "cost_map.h"
+#include "perturbation.h"
+#include "fixed_point.h"
+#include "tuning.h"
 #include "development_utils.h"
 
 template <typename T>
@@ -27,8 +37,11 @@ std::vector<Complex<T>> DoubleTo(const std::vector<ComplexD>& input) {
   return output;
 }
 
+// `converged_zero` is p.GetZeroIndexIfConverged(z), worked out for the whole
+// block at once.
 template<typename T>
 std::optional<size_t> GetNewtonResult(const Complex<T>& z,
+				      std::optional<size_t> converged_zero,
 				      std::optional<PixelMetadata>& metadata,
 				      const AnalyzedPolynomial<T>& p,
 				      size_t max_iterations) {
@@ -37,9 +50,9 @@ std::optional<size_t> GetNewtonResult(const Complex<T>& z,
   }
   ++metadata->iteration_count;
   if (metadata->iteration_count >= max_iterations) {
-    return ClosestZero(z, p.zeros);
+    return converged_zero.has_value() ? converged_zero : p.ClosestZero(z);
   }
-  return p.GetZeroIndexIfConverged(z);
+  return converged_zero;
 }
 
 template <size_t N>
@@ -52,19 +65,75 @@ bool HasActivePixels(const std::array<std::optional<PixelMetadata>, N>& metadata
   return false;
 }
 
-std::vector<ImageRect> SplitIntoTasks(const std::vector<ImageRect>& input, int num_threads) {
+// Cuts each region into runs of rows with roughly equal predicted cost, making
+// `tasks` tasks in total (give or take rounding).
+std::vector<ImageRect> SplitIntoTasksByCost(const std::vector<ImageRect>& input,
+					    size_t tasks,
+					    const CostMap& cost_map) {
+  std::vector<std::vector<double>> row_costs;
+  double total_cost = 0.0;
+  for (const ImageRect& region : input) {
+    std::vector<double>& costs = row_costs.emplace_back();
+    for (size_t y = region.y_min; y < region.y_max; ++y) {
+      costs.push_back(cost_map.PredictRowCost(y, region.x_min, region.x_max));
+      total_cost += costs.back();
+    }
+  }
+  const double cost_per_task = total_cost / tasks;
+
+  std::vector<ImageRect> output;
+  for (size_t i = 0; i < input.size(); ++i) {
+    const ImageRect& region = input[i];
+    size_t start_row = region.y_min;
+    double cost = 0.0;
+    for (size_t y = region.y_min; y < region.y_max; ++y) {
+      const double row_cost = row_costs[i][y - region.y_min];
+      // Cut before this row if it gets us closer to the target than after it.
+      if (y > start_row && cost + row_cost / 2 > cost_per_task) {
+	output.push_back({
+	    .x_min = region.x_min,
+	    .x_max = region.x_max,
+	    .y_min = start_row,
+	    .y_max = y,
+	  });
+	start_row = y;
+	cost = 0.0;
+      }
+      cost += row_cost;
+    }
+    if (start_row < region.y_max) {
+      output.push_back({
+	  .x_min = region.x_min,
+	  .x_max = region.x_max,
+	  .y_min = start_row,
+	  .y_max = region.y_max,
+	});
+    }
+  }
+  return output;
+}
+
+// Splits the regions into tasks of around `desired_pixels_per_task` pixels, in
+// multiples of the given number of threads. If the cost map has a prediction
+// for the frame, tasks are balanced by predicted cost, otherwise by pixel count.
+std::vector<ImageRect> SplitIntoTasks(const std::vector<ImageRect>& input, int num_threads,
+				      size_t desired_pixels_per_task,
+				      const CostMap* cost_map = nullptr) {
   size_t total_pixels = 0;
   for (const ImageRect& region : input) {
     total_pixels += region.CountPixels();
   }
 
-  constexpr size_t desired_pixels_per_task = 25 * 2000; // TUNE.
   const size_t desired_pixels_per_split = desired_pixels_per_task * num_threads;
   size_t splits = std::ceil(1.0 * total_pixels / desired_pixels_per_split);
   if (splits == 0) splits = 1;
   const size_t tasks = splits * num_threads;
   const double pixels_per_task = 1.0 * total_pixels / tasks;
 
+  if (cost_map != nullptr && cost_map->HasPrediction()) {
+    return SplitIntoTasksByCost(input, tasks, *cost_map);
+  }
+
   std::vector<ImageRect> output;
   for (const ImageRect& region : input) {
     size_t region_tasks = region.CountPixels() / pixels_per_task;
@@ -85,20 +154,43 @@ std::vector<ImageRect> SplitIntoTasks(const std::vector<ImageRect>& input, int n
   return output;
 }
 
+// Splits tasks further so that none of them crosses a band boundary, returning
+// each with its band, ordered from the top of the image down so that bands tend
+// to finish in order.
+std::vector<std::pair<ImageRect, size_t>> SplitAtBands(const std::vector<ImageRect>& tasks,
+						       size_t rows_per_band) {
+  std::vector<std::pair<ImageRect, size_t>> output;
+  for (const ImageRect& task : tasks) {
+    for (size_t y = task.y_min; y < task.y_max; ) {
+      const size_t band = y / rows_per_band;
+      const size_t y_end = std::min(task.y_max, (band + 1) * rows_per_band);
+      ImageRect rect = task;
+      rect.y_min = y;
+      rect.y_max = y_end;
+      output.emplace_back(rect, band);
+      y = y_end;
+    }
+  }
+  std::stable_sort(output.begin(), output.end(), [](const auto& a, const auto& b) {
+    return a.first.y_min < b.first.y_min;
+  });
+  return output;
+}
+
 template <typename T>
 size_t NaiveDraw(const FractalParams& params, const AnalyzedPolynomial<T>& p, RGBImage& image) {
   size_t total_iters = 0;
   const T i_delta = params.r_range / params.width;
   const T r_delta = params.r_range / params.width;
-  T i = params.i_min;
+  T i = params.i_min_as<T>();
   for (int y = params.height - 1; y >= 0; --y) {
-    T r = params.r_min;
+    T r = params.r_min_as<T>();
     for (size_t x = 0; x < params.width; ++x) {
       size_t iters;
       const Complex<T> result = Newton(p, Complex<T>(r, i), params.max_iters, &iters);
       total_iters += iters;
-      const size_t zero_index = ClosestZero(result, p.zeros);
-      image[y][x] = params.colors[zero_index];
+      const size_t zero_index = p.ClosestZero(result);
+      PaintZero(image, x, y, params.colors, zero_index);
       r += r_delta;
     }
     i += i_delta;
@@ -107,53 +199,475 @@ size_t NaiveDraw(const FractalParams& params, const AnalyzedPolynomial<T>& p, RG
 }
 
 
+// Jumps lane b of the block across as many Newton steps as it safely can, if
+// it's in the far field, counting the steps as iterations. Leaves at least one
+// step before max_iters, so lanes still end the usual way.
 template <typename T, size_t N>
-size_t FillRegionUsingDynamicBlocks(const FractalParams& params,
-				    const AnalyzedPolynomial<T>& p,
-				    const ImageRect rect,
-				    RGBImage& image) {
+void JumpFarLane(const FarField<T>& far_field,
+		 size_t b,
+		 size_t max_iterations,
+		 ComplexArray<T, N>* block,
+		 std::array<std::optional<PixelMetadata>, N>* metadata) {
+  std::optional<PixelMetadata>& pixel = (*metadata)[b];
+  if (!pixel.has_value() || pixel->iteration_count + 1 >= max_iterations) {
+    return;
+  }
+  Complex<T> z = block->get(b);
+  const size_t steps = far_field.Jump(&z, max_iterations - pixel->iteration_count - 1);
+  if (steps > 0) {
+    block->rs(b) = z.r;
+    block->is(b) = z.i;
+    pixel->iteration_count += steps;
+  }
+}
+
+// Jumps the `far` lanes of the block (see FarField::FindFar), as JumpFarLane.
+template <typename T, size_t N>
+void JumpFarField(const FarField<T>& far_field,
+		  const std::array<bool, N>& far,
+		  size_t max_iterations,
+		  ComplexArray<T, N>* block,
+		  std::array<std::optional<PixelMetadata>, N>* metadata) {
+  for (size_t b = 0; b < N; ++b) {
+    if (far[b]) {
+      JumpFarLane(far_field, b, max_iterations, block, metadata);
+    }
+  }
+}
+
+// Iterates Newton's method on the pixels handed out by `next_pixel` (which
+// returns the same as PixelIterator::Next), N at a time, pulling in new pixels
+// as old ones finish. Calls on_done(metadata, zero_index) for each pixel once
+// it's known which zero it goes to.
+//
+// One block at a time: stepping several through Newton's method together, to
+// overlap their multiply and divide latencies, measured the same as one block
+// within noise, as the N lanes of a block are already independent.
+template <typename T, size_t N, typename NextPixel, typename OnDone>
+size_t IterateUsingDynamicBlocks(const FractalParams& params,
+				 const AnalyzedPolynomial<T>& p,
+				 NextPixel next_pixel,
+				 OnDone on_done) {
   size_t total_iters = 0;
 
-  // Make an iterator that will walk across the requested rows of our image.
-  PixelIterator<T> iter({
-      .r_min = static_cast<T>(params.r_min),
-      .i_min = static_cast<T>(params.i_min),
-      .r_delta = static_cast<T>(params.r_range / params.width),
-      .i_delta = static_cast<T>(params.r_range / params.width),
-      .width = params.width,
-      .height = params.height,
-      .x_min = rect.x_min,
-      .x_max = rect.x_max,
-      .y_min = static_cast<int>(rect.y_min),
-      .y_max = static_cast<int>(rect.y_max),
-    });
+  const bool approximate = std::is_same_v<T, float> && params.precision == Precision::FAST;
+  // Jumps go through std::complex<double>, which would drop the low part of a
+  // DoubleDouble.
+  const bool jump_far_field = params.far_field && !std::is_same_v<T, DoubleDouble>;
 
-  // Fill a block with some complex numbers.
+  // Fill a block with some complex numbers. New pixels are jumped in from the
+  // far field straight away, and the whole block only rechecked now and then,
+  // see kFarFieldRecheckSteps.
   ComplexArray<T, N> block;
   std::array<std::optional<PixelMetadata>, N> metadata;
   for (size_t b = 0; b < N; ++b) {
-    std::tie(block.rs(b), block.is(b), metadata[b]) = iter.Next();
+    std::tie(block.rs(b), block.is(b), metadata[b]) = next_pixel();
+    if (jump_far_field) {
+      JumpFarLane(p.far_field, b, params.max_iters, &block, &metadata);
+    }
   }
+  size_t steps_until_far_check = kFarFieldRecheckSteps;
 
   // Keep iterating Newton's algorithm on the block, pulling in new pixels as
-  // old ones finish, until there are no pixels left.
-  while (!iter.Done() || HasActivePixels(metadata)) {
+  // old ones finish, until there are no pixels left. The block only goes idle
+  // once the pixels run out, so the check is only needed then.
+  bool active = HasActivePixels(metadata);
+  while (active) {
     // Uncomment to see what CPU we're on.
     // if (total_iters % (N * 16384) == 0) {
     //   std::cout << "[" << y_min << ", " << y_max << "): " << sched_getcpu() << std::endl;
     // }
-    NewtonIter(p, &block);
+    if (jump_far_field && --steps_until_far_check == 0) {
+      steps_until_far_check = kFarFieldRecheckSteps;
+      std::array<bool, N> far;
+      if (p.far_field.FindFar(block, &far)) {
+	JumpFarField(p.far_field, far, params.max_iters, &block, &metadata);
+      }
+    }
+    if (approximate) {
+      ApproximateNewtonIter(p, &block);
+    } else {
+      NewtonIter(p, &block);
+    }
     total_iters += N;
+    std::array<std::optional<size_t>, N> converged_zeros;
+    p.GetZeroIndicesIfConverged(block, &converged_zeros);
+    bool refill_ran_dry = false;
     for (size_t b = 0; b < N; ++b) {
       std::optional<size_t> zero_index =
-	GetNewtonResult(block.get(b), metadata[b], p, params.max_iters);
+	GetNewtonResult(block.get(b), converged_zeros[b], metadata[b], p, params.max_iters);
       if (zero_index.has_value()) {
-	image[metadata[b]->y][metadata[b]->x] = params.colors[*zero_index];
-        std::tie(block.rs(b), block.is(b), metadata[b]) = iter.Next();
+	on_done(*metadata[b], *zero_index);
+	std::tie(block.rs(b), block.is(b), metadata[b]) = next_pixel();
+	refill_ran_dry |= !metadata[b].has_value();
+	if (jump_far_field) {
+	  JumpFarLane(p.far_field, b, params.max_iters, &block, &metadata);
+	}
+      }
+    }
+    if (refill_ran_dry) {
+      active = HasActivePixels(metadata);
+    }
+  }
+  return total_iters;
+}
+
+// Rows filled between chances for more urgent work to run, when filling
+// regions for work less urgent than interactive.
+constexpr size_t kYieldingRowsPerTile = 8; // TUNE.
+
+// Precision::MIXED only pays while the pixels it redoes in double are a small
+// share of the work, since they're iterated twice. Once more than this share of
+// a rect's float iterations so far went to pixels that need redoing (e.g. where
+// the view is mostly basin boundary), the rest of the rect is drawn in double
+// outright.
+constexpr double kMaxMixedRedoShare = 0.25; // TUNE.
+
+// Polynomials with this many zeros or more have so much basin boundary that
+// Precision::MIXED would redo most of every rect, so they're drawn in double
+// from the start, rather than each rect finding that out in float first.
+constexpr size_t kMixedMaxZeros = 16; // TUNE.
+
+// Precision::MIXED: iterates the rect in float, then redoes in double (with
+// p.refinement) just the pixels whose float result is in doubt. Float only
+// goes wrong near basin boundaries, i.e. where a pixel's neighbours go to
+// other zeros, or where it doesn't converge at all (e.g. near-ties between
+// zeros, or orbits thrown about by tiny p'), so those are the pixels redone.
+// The float pass goes kYieldingRowsPerTile rows at a time, checking rows as
+// it goes, so that it can stop early, see kMaxMixedRedoShare.
+//
+// If `yield` is set, it's called every kYieldingRowsPerTile rows of the float
+// pass, and before the double pass.
+template <size_t N, typename Image>
+size_t FillRegionMixed(const FractalParams& params,
+		       const AnalyzedPolynomial<float>& p,
+		       const ImageRect rect,
+		       Image& image,
+		       CostMap::TileCounter* tile_iters,
+		       const std::function<void()>& yield) {
+  assert(p.refinement != nullptr);
+  // The float pass also covers a one pixel apron around the rect (where there
+  // is image), so that every pixel in the rect can be checked against all its
+  // neighbours. That's why yielding is done here, rather than by filling
+  // smaller rects that would each need their own apron.
+  const ImageRect apron = {
+    .x_min = rect.x_min > 0 ? rect.x_min - 1 : 0,
+    .x_max = std::min(rect.x_max + 1, params.width),
+    .y_min = rect.y_min > 0 ? rect.y_min - 1 : 0,
+    .y_max = std::min(rect.y_max + 1, params.height),
+  };
+  const size_t apron_width = apron.width();
+  auto index = [&](size_t x, size_t y) {
+    return (y - apron.y_min) * apron_width + (x - apron.x_min);
+  };
+  auto in_rect = [&](size_t x, size_t y) {
+    return x >= rect.x_min && x < rect.x_max && y >= rect.y_min && y < rect.y_max;
+  };
+
+  std::vector<uint32_t> zero_indices(apron.CountPixels());
+  std::vector<uint32_t> iterations(apron.CountPixels());
+  std::vector<uint8_t> uncertain(apron.CountPixels());
+
+  // Draws what's certain in row y of the rect, and flags pixels that disagree
+  // with a neighbour, adding up the float iterations of both.
+  std::vector<std::vector<size_t>> redo_rows(rect.height());
+  size_t redo_count = 0;
+  size_t checked_iters = 0;
+  size_t redo_iters = 0;
+  auto check_row = [&](size_t y) {
+    for (size_t x = rect.x_min; x < rect.x_max; ++x) {
+      const size_t i = index(x, y);
+      const uint32_t zero_index = zero_indices[i];
+      checked_iters += iterations[i];
+      if (uncertain[i] ||
+	  (x > apron.x_min && zero_indices[i - 1] != zero_index) ||
+	  (x + 1 < apron.x_max && zero_indices[i + 1] != zero_index) ||
+	  (y > apron.y_min && zero_indices[i - apron_width] != zero_index) ||
+	  (y + 1 < apron.y_max && zero_indices[i + apron_width] != zero_index)) {
+	redo_rows[y - rect.y_min].push_back(x);
+	++redo_count;
+	redo_iters += iterations[i];
+      } else {
+	PaintZero(image, x, y, params.colors, zero_index);
       }
     }
+  };
+
+  size_t total_iters = 0;
+  size_t checked_y = rect.y_min;
+  for (size_t y = apron.y_min; y < apron.y_max; y += kYieldingRowsPerTile) {
+    const size_t band_end = std::min(y + kYieldingRowsPerTile, apron.y_max);
+    PixelIterator<float> iter({
+	.r_min = params.r_min_as<float>(),
+	.i_min = params.i_min_as<float>(),
+	.r_delta = static_cast<float>(params.r_range / params.width),
+	.i_delta = static_cast<float>(params.r_range / params.width),
+	.width = params.width,
+	.height = params.height,
+	.x_min = apron.x_min,
+	.x_max = apron.x_max,
+	.y_min = static_cast<int>(y),
+	.y_max = static_cast<int>(band_end),
+      });
+    total_iters += IterateUsingDynamicBlocks<float, 2 * N>(
+	params, p, [&]() { return iter.Next(); },
+	[&](const PixelMetadata& pixel, size_t zero_index) {
+	  const size_t i = index(pixel.x, pixel.y);
+	  zero_indices[i] = zero_index;
+	  iterations[i] = static_cast<uint32_t>(std::min(pixel.iteration_count, params.max_iters));
+	  uncertain[i] = (pixel.iteration_count >= params.max_iters);
+	  if (tile_iters != nullptr && in_rect(pixel.x, pixel.y)) {
+	    tile_iters->Add(pixel.x, pixel.y, pixel.iteration_count);
+	  }
+	});
+    if (yield != nullptr) {
+      yield();
+    }
+
+    // A row can be checked once the row after it is in.
+    const size_t check_end = (band_end == apron.y_max) ? rect.y_max : band_end - 1;
+    for (; checked_y < check_end; ++checked_y) {
+      check_row(checked_y);
+    }
+    if (redo_iters > kMaxMixedRedoShare * checked_iters) {
+      break;
+    }
+  }
+  // Rows left unchecked are redone whole, i.e. drawn in double.
+  for (size_t y = checked_y; y < rect.y_max; ++y) {
+    for (size_t x = rect.x_min; x < rect.x_max; ++x) {
+      redo_rows[y - rect.y_min].push_back(x);
+    }
+    redo_count += rect.width();
+  }
+  if (redo_count == 0) {
+    return total_iters;
   }
 
+  // Redo the flagged pixels in double, at the same coordinates that drawing in
+  // double would give them (i.e. stepped to by PixelIterator<double>), with
+  // half as many lanes so the blocks are the same number of bytes.
+  std::vector<std::tuple<double, double, std::optional<PixelMetadata>>> redo;
+  redo.reserve(redo_count);
+  for (size_t y = rect.y_min; y < rect.y_max; ++y) {
+    const std::vector<size_t>& xs = redo_rows[y - rect.y_min];
+    if (xs.empty()) {
+      continue;
+    }
+    PixelIterator<double> row_iter({
+	.r_min = params.r_min_as<double>(),
+	.i_min = params.i_min_as<double>(),
+	.r_delta = params.r_range / params.width,
+	.i_delta = params.r_range / params.width,
+	.width = params.width,
+	.height = params.height,
+	.x_min = rect.x_min,
+	.x_max = xs.back() + 1,
+	.y_min = static_cast<int>(y),
+	.y_max = static_cast<int>(y + 1),
+      });
+    size_t next_x = 0;
+    while (!row_iter.Done() && next_x < xs.size()) {
+      const auto pixel = row_iter.Next();
+      if (std::get<2>(pixel)->x == xs[next_x]) {
+	redo.push_back(pixel);
+	++next_x;
+      }
+    }
+  }
+  size_t next = 0;
+  total_iters += IterateUsingDynamicBlocks<double, N>(
+      params, *p.refinement,
+      [&]() -> std::tuple<double, double, std::optional<PixelMetadata>> {
+	if (next >= redo.size()) {
+	  return std::make_tuple(0.0, 0.0, std::nullopt);
+	}
+	return redo[next++];
+      },
+      [&](const PixelMetadata& pixel, size_t zero_index) {
+	PaintZero(image, pixel.x, pixel.y, params.colors, zero_index);
+	if (tile_iters != nullptr) {
+	  tile_iters->Add(pixel.x, pixel.y, pixel.iteration_count);
+	}
+      });
+  return total_iters;
+}
+
+// Precision::FIXED: iterates the rect with FixedPointPolynomial, which gives
+// the same zero for each pixel whatever the host and build. Pixels are handed
+// out by a PixelIterator as usual, but only for their (x, y): their
+// coordinates come from FixedPointGrid.
+template <size_t N, typename Image>
+size_t FillRegionFixedPoint(const FractalParams& params,
+			    const ImageRect rect,
+			    Image& image,
+			    CostMap::TileCounter* tile_iters) {
+  const std::shared_ptr<const FixedPointPolynomial> p = GetFixedPointPolynomial(params.zeros);
+  const FixedPointGrid grid(params.r_min, params.r_min_lo, params.i_min, params.i_min_lo,
+			    params.r_range / params.width, params.height);
+  PixelIterator<double> iter({
+      .r_min = 0.0,
+      .i_min = 0.0,
+      .r_delta = 0.0,
+      .i_delta = 0.0,
+      .width = params.width,
+      .height = params.height,
+      .x_min = rect.x_min,
+      .x_max = rect.x_max,
+      .y_min = static_cast<int>(rect.y_min),
+      .y_max = static_cast<int>(rect.y_max),
+    });
+  std::array<int64_t, N> rs;
+  std::array<int64_t, N> is;
+  std::array<std::optional<PixelMetadata>, N> metadata;
+  auto refill = [&](size_t b) {
+    metadata[b] = std::get<2>(iter.Next());
+    if (metadata[b].has_value()) {
+      rs[b] = grid.r(metadata[b]->x);
+      is[b] = grid.i(metadata[b]->y);
+    } else {
+      rs[b] = 0;
+      is[b] = 0;
+    }
+  };
+  for (size_t b = 0; b < N; ++b) {
+    refill(b);
+  }
+
+  size_t total_iters = 0;
+  std::array<int32_t, N> converged;
+  std::array<uint32_t, N> closest;
+  bool active = HasActivePixels(metadata);
+  while (active) {
+    // Iterate() checks for convergence before stepping, so a lane's result is
+    // for the point it had after iteration_count steps, as in
+    // IterateUsingDynamicBlocks.
+    p->Iterate(&rs, &is, &converged, &closest);
+    total_iters += N;
+    bool refill_ran_dry = false;
+    for (size_t b = 0; b < N; ++b) {
+      std::optional<PixelMetadata>& pixel = metadata[b];
+      if (!pixel.has_value()) {
+	continue;
+      }
+      size_t zero_index;
+      if (converged[b] >= 0) {
+	zero_index = converged[b];
+      } else if (pixel->iteration_count >= params.max_iters) {
+	zero_index = closest[b];
+      } else {
+	++pixel->iteration_count;
+	continue;
+      }
+      PaintZero(image, pixel->x, pixel->y, params.colors, zero_index);
+      if (tile_iters != nullptr) {
+	tile_iters->Add(pixel->x, pixel->y, pixel->iteration_count);
+      }
+      refill(b);
+      refill_ran_dry |= !metadata[b].has_value();
+    }
+    if (refill_ran_dry) {
+      active = HasActivePixels(metadata);
+    }
+  }
+  return total_iters;
+}
+
+// Image can be anything indexable as image[y][x], e.g. RGBImage or ScrollingImage.
+// If `cost_map` is set, the iterations each pixel took are recorded in it.
+//
+// `yield` is only used by Precision::MIXED, see FillRegionMixed.
+template <typename T, size_t N, typename Image>
+size_t FillRegionUsingDynamicBlocks(const FractalParams& params,
+				    const AnalyzedPolynomial<T>& p,
+				    const ImageRect rect,
+				    Image& image,
+				    CostMap* cost_map = nullptr,
+				    const std::function<void()>& yield = nullptr) {
+  size_t total_iters = 0;
+  std::optional<CostMap::TileCounter> tile_iters;
+  if (cost_map != nullptr) {
+    tile_iters.emplace(rect);
+  }
+
+  if constexpr (std::is_same_v<T, float>) {
+    if (params.precision == Precision::MIXED) {
+      total_iters = FillRegionMixed<N>(params, p, rect, image,
+				       tile_iters.has_value() ? &*tile_iters : nullptr, yield);
+      if (cost_map != nullptr) {
+	cost_map->Record(*tile_iters);
+      }
+      return total_iters;
+    }
+  }
+  if constexpr (std::is_same_v<T, double>) {
+    if (params.precision == Precision::FIXED) {
+      total_iters = FillRegionFixedPoint<N>(params, rect, image,
+					    tile_iters.has_value() ? &*tile_iters : nullptr);
+      if (cost_map != nullptr) {
+	cost_map->Record(*tile_iters);
+      }
+      return total_iters;
+    }
+  }
+
+  // Make an iterator that will walk across the requested rows of our image.
+  PixelIterator<T> iter({
+      .r_min = params.r_min_as<T>(),
+      .i_min = params.i_min_as<T>(),
+      .r_delta = static_cast<T>(params.r_range / params.width),
+      .i_delta = static_cast<T>(params.r_range / params.width),
+      .width = params.width,
+      .height = params.height,
+      .x_min = rect.x_min,
+      .x_max = rect.x_max,
+      .y_min = static_cast<int>(rect.y_min),
+      .y_max = static_cast<int>(rect.y_max),
+    });
+  total_iters = IterateUsingDynamicBlocks<T, N>(
+      params, p, [&]() { return iter.Next(); },
+      [&](const PixelMetadata& pixel, size_t zero_index) {
+	PaintZero(image, pixel.x, pixel.y, params.colors, zero_index);
+	if (tile_iters.has_value()) {
+	  tile_iters->Add(pixel.x, pixel.y, pixel.iteration_count);
+	}
+      });
+
+  if (cost_map != nullptr) {
+    cost_map->Record(*tile_iters);
+  }
+  return total_iters;
+}
+
+// Like FillRegionUsingDynamicBlocks, but for work less urgent than interactive,
+// fills a few rows at a time and lets any more urgent tasks that were queued
+// meanwhile run in between, so that a big job doesn't hold up live frames.
+template <typename T, size_t N, typename Image>
+size_t FillRegionYielding(const FractalParams& params,
+			  const AnalyzedPolynomial<T>& p,
+			  const ImageRect rect,
+			  Image& image,
+			  CostMap* cost_map,
+			  ThreadPool& thread_pool,
+			  TaskPriority priority) {
+  if (priority == TaskPriority::INTERACTIVE) {
+    return FillRegionUsingDynamicBlocks<T, N>(params, p, rect, image, cost_map);
+  }
+  if constexpr (std::is_same_v<T, float>) {
+    if (params.precision == Precision::MIXED) {
+      // Yields between bands itself, see FillRegionMixed.
+      return FillRegionUsingDynamicBlocks<T, N>(params, p, rect, image, cost_map,
+						[&]() { thread_pool.Yield(priority); });
+    }
+  }
+  size_t total_iters = 0;
+  for (size_t y = rect.y_min; y < rect.y_max; y += kYieldingRowsPerTile) {
+    ImageRect tile = rect;
+    tile.y_min = y;
+    tile.y_max = std::min(y + kYieldingRowsPerTile, rect.y_max);
+    total_iters += FillRegionUsingDynamicBlocks<T, N>(params, p, tile, image, cost_map);
+    thread_pool.Yield(priority);
+  }
   return total_iters;
 }
 
@@ -169,22 +683,34 @@ size_t DynamicBlockDraw(const FractalParams& params, const AnalyzedPolynomial<T>
 }
 
 template <typename T, size_t N>
-size_t DynamicBlockThreadedDraw(const FractalParams& params, const AnalyzedPolynomial<T>& p, RGBImage& image, ThreadPool& thread_pool) {
-  TaskGroup task_group(&thread_pool);
-  constexpr size_t rows_per_task = 50; // TUNE.
+size_t DynamicBlockThreadedDraw(const FractalParams& params, const AnalyzedPolynomial<T>& p, RGBImage& image, ThreadPool& thread_pool,
+				const TuningParams& tuning, CostMap* cost_map, TaskPriority priority) {
+  TaskGroup task_group(&thread_pool, priority);
+  std::vector<ImageRect> tasks;
+  if (cost_map != nullptr && cost_map->HasPrediction()) {
+    tasks = SplitIntoTasks({{
+	  .x_min = 0,
+	  .x_max = params.width,
+	  .y_min = 0,
+	  .y_max = params.height,
+	}}, thread_pool.size(), tuning.pixels_per_task, cost_map);
+  } else {
+    for (size_t start_row = 0; start_row < params.height; start_row += tuning.rows_per_task) {
+      tasks.push_back({
+	  .x_min = 0,
+	  .x_max = params.width,
+	  .y_min = start_row,
+	  .y_max = std::min(start_row + tuning.rows_per_task, params.height),
+	});
+    }
+  }
   std::mutex m;
   size_t total_iters = 0;
-  for (size_t start_row = 0; start_row < params.height; start_row += rows_per_task) {
-    const size_t end_row = std::min(start_row + rows_per_task, params.height);
-    const ImageRect rect = {
-      .x_min = 0,
-      .x_max = params.width,
-      .y_min = start_row,
-      .y_max = end_row,
-    };
-    task_group.Add([rect, params, p,
-		    &image, &total_iters, &m]() {
-      size_t iters = FillRegionUsingDynamicBlocks<T, N>(params, p, rect, image);
+  for (const ImageRect& rect : tasks) {
+    task_group.Add([rect, params, p, cost_map, priority,
+		    &image, &thread_pool, &total_iters, &m]() {
+      size_t iters = FillRegionYielding<T, N>(params, p, rect, image, cost_map,
+					      thread_pool, priority);
       std::scoped_lock lock(m);
       total_iters += iters;
     });
@@ -199,14 +725,18 @@ size_t DynamicBlockThreadedIncrementalDraw(const FractalParams& params,
 					   RGBImage& image,
 					   ThreadPool& thread_pool,
 					   const std::optional<FractalParams>& previous_params,
-					   const RGBImage* previous_image) {
+					   const RGBImage* previous_image,
+					   const TuningParams& tuning,
+					   CostMap* cost_map,
+					   TaskPriority priority) {
   if (!previous_params.has_value() || previous_image == nullptr ||
-      !ParamsDifferOnlyByPanning(params, *previous_params)) {
-    return DynamicBlockThreadedDraw<T, N>(params, p, image, thread_pool);
+      !CanReuseAfterPan(params, *previous_params) ||
+      !CopiesPaletteIndices(*previous_image, image)) {
+    return DynamicBlockThreadedDraw<T, N>(params, p, image, thread_pool, tuning, cost_map, priority);
   }
 
   const ImageDelta delta = ComputePanOnlyImageDelta<T>(*previous_params, params);
-  TaskGroup task_group(&thread_pool);
+  TaskGroup task_group(&thread_pool, priority);
   if (delta.overlap.has_value()) {
     task_group.Add([previous_image, &image, delta]() {
       const uint64_t start_time = Now();
@@ -218,11 +748,13 @@ size_t DynamicBlockThreadedIncrementalDraw(const FractalParams& params,
 
   std::mutex m;
   size_t total_iters = 0;
-  const std::vector<ImageRect> tasks = SplitIntoTasks(delta.b_only, thread_pool.size());
+  const std::vector<ImageRect> tasks = SplitIntoTasks(delta.b_only, thread_pool.size(),
+						      tuning.pixels_per_task, cost_map);
   for (const ImageRect& rect : tasks) {
-    task_group.Add([rect, params, p,
-		    &image, &total_iters, &m]() {
-      size_t iters = FillRegionUsingDynamicBlocks<T, N>(params, p, rect, image);
+    task_group.Add([rect, params, p, cost_map, priority,
+		    &image, &thread_pool, &total_iters, &m]() {
+      size_t iters = FillRegionYielding<T, N>(params, p, rect, image, cost_map,
+					      thread_pool, priority);
       std::scoped_lock lock(m);
       total_iters += iters;
     });
@@ -232,6 +764,96 @@ size_t DynamicBlockThreadedIncrementalDraw(const FractalParams& params,
   return total_iters;
 }
 
+template <typename T, size_t N>
+size_t DynamicBlockThreadedScrollingDraw(const FractalParams& params,
+					 const AnalyzedPolynomial<T>& p,
+					 ScrollingImage& scrolling_image,
+					 RGBImage& image,
+					 ThreadPool& thread_pool,
+					 const std::function<void(const FrameRows&, size_t, size_t)>& on_rows_ready,
+					 const TuningParams& tuning,
+					 CostMap* cost_map,
+					 TaskPriority priority) {
+  // If we're only panning relative to what's already in the scrolling image,
+  // move its origin and just draw the newly exposed strips. Otherwise start over,
+  // as also if `image` keeps palette indices and the scrolling image hasn't been.
+  std::vector<ImageRect> regions;
+  const std::optional<FractalParams>& previous_params = scrolling_image.params();
+  const bool keep_indices = image.get_pixbuf().palette_indices() != nullptr;
+  if (previous_params.has_value() && CanReuseAfterPan(params, *previous_params) &&
+      (!keep_indices || scrolling_image.keeps_palette_indices())) {
+    const ImageDelta delta = ComputePanOnlyImageDelta<T>(*previous_params, params);
+    if (delta.overlap.has_value()) {
+      scrolling_image.Scroll(*delta.overlap);
+    }
+    regions = delta.b_only;
+  } else {
+    scrolling_image.Reset(params.width, params.height);
+    regions.push_back({
+	.x_min = 0,
+	.x_max = params.width,
+	.y_min = 0,
+	.y_max = params.height,
+      });
+  }
+  scrolling_image.set_params(params);
+  scrolling_image.KeepPaletteIndices(keep_indices);
+
+  TaskGroup task_group(&thread_pool, priority);
+  std::mutex m;
+  size_t total_iters = 0;
+  const std::vector<ImageRect> tasks = SplitIntoTasks(regions, thread_pool.size(),
+						      tuning.pixels_per_task, cost_map);
+  if (on_rows_ready) {
+    // Hand rows over in bands as soon as they're done, so that whoever is
+    // listening (e.g. a streaming encoder) can get going on them while later
+    // bands are still being drawn.
+    constexpr size_t rows_per_band = 64; // TUNE.
+    const std::vector<std::pair<ImageRect, size_t>> banded_tasks = SplitAtBands(tasks, rows_per_band);
+    for (const auto& [rect, band] : banded_tasks) {
+      task_group.Add([rect, params, p, cost_map, priority,
+		      &scrolling_image, &thread_pool, &total_iters, &m]() {
+	size_t iters = FillRegionYielding<T, N>(params, p, rect, scrolling_image, cost_map,
+						thread_pool, priority);
+	std::scoped_lock lock(m);
+	total_iters += iters;
+      }, band);
+    }
+    // The rows are read straight out of the ring, and copied out to `image` by
+    // whoever reads them, rather than in a pass of their own.
+    const FrameRows rows(scrolling_image, &image);
+    for (size_t y_begin = 0, band = 0; y_begin < params.height; y_begin += rows_per_band, ++band) {
+      const size_t y_end = std::min(y_begin + rows_per_band, params.height);
+      task_group.WaitForBand(band);
+      on_rows_ready(rows, y_begin, y_end);
+    }
+    task_group.WaitUntilDone();
+    std::cout << "Scrolling draw used " << banded_tasks.size() << " banded tasks" << std::endl;
+    return total_iters;
+  }
+
+  for (const ImageRect& rect : tasks) {
+    task_group.Add([rect, params, p, cost_map, priority,
+		    &scrolling_image, &thread_pool, &total_iters, &m]() {
+      size_t iters = FillRegionYielding<T, N>(params, p, rect, scrolling_image, cost_map,
+					      thread_pool, priority);
+      std::scoped_lock lock(m);
+      total_iters += iters;
+    });
+  }
+  task_group.WaitUntilDone();
+  std::cout << "Scrolling draw used " << tasks.size() << " tasks" << std::endl;
+
+  // Nobody is reading rows as they're done (see DrawFractalArgs::on_rows_ready),
+  // so the frame is wanted in `image`: e.g. for encoders that need it
+  // contiguous, like fpng.
+  const uint64_t start_time = Now();
+  scrolling_image.Linearize(image);
+  const uint64_t end_time = Now();
+  std::cout << "Linearize time (ms): " << (end_time - start_time) << std::endl;
+  return total_iters;
+}
+
 struct DrawFractalArgs {
   const FractalParams& params;
   RGBImage& image;
@@ -240,45 +862,223 @@ struct DrawFractalArgs {
   const RGBImage* previous_image;
 
   ThreadPool& thread_pool;
-};
 
-template <typename T>
-size_t DrawFractalImpl(const DrawFractalArgs& args) {
-  // Figure out what polynomial we're drawing.
-  const AnalyzedPolynomial<T> p = AnalyzedPolynomial<T>(DoubleTo<T>(args.params.zeros));
-  std::cout << "Drawing: " << p << std::endl;
+  // Persistent framebuffer for the scrolling strategy. May be null, in which
+  // case we fall back to the incremental strategy.
+  ScrollingImage* scrolling_image = nullptr;
+
+  // If set, called on the drawing thread with consecutive ranges of rows,
+  // top to bottom, once those rows of the frame are final. Strategies that
+  // can't hand over rows early call it once with the whole frame at the end.
+  //
+  // The rows are to be read from `rows`, which may be the scrolling image's
+  // ring rather than `image`. In that case each row is only copied to `image`
+  // once it's read with FrameRows::Row(), so the callee must read every row
+  // it's handed (e.g. encode it) before `image` is complete.
+  std::function<void(const FrameRows& rows, size_t y_begin, size_t y_end)> on_rows_ready = nullptr;
+
+  // Persistent per-tile iteration counts, used by the threaded strategies to
+  // balance tasks by predicted cost. May be null.
+  CostMap* cost_map = nullptr;
 
-  // Dispatch image generation.
+  // Machine specific knobs, e.g. the block width.
+  TuningParams tuning = GetTuning();
+
+  // How urgent the drawing is relative to other work on the thread pool.
+  TaskPriority priority = TaskPriority::INTERACTIVE;
+};
+
+template <typename T, size_t N>
+size_t DrawFractalWithBlockWidth(const DrawFractalArgs& args, const AnalyzedPolynomial<T>& p) {
   size_t total_iters = 0;
-  switch (args.params.strategy.value_or(Strategy::DYNAMIC_BLOCK_THREADED_INCREMENTAL)) {
+  switch (args.params.strategy.value_or(Strategy::DYNAMIC_BLOCK_THREADED_SCROLLING)) {
     case Strategy::NAIVE:
       total_iters = NaiveDraw<T>(args.params, p, args.image);
       break;
     case Strategy::DYNAMIC_BLOCK:
-      total_iters = DynamicBlockDraw<T, 32>(args.params, p, args.image);
+      total_iters = DynamicBlockDraw<T, N>(args.params, p, args.image);
       break;
     case Strategy::DYNAMIC_BLOCK_THREADED:
-      total_iters = DynamicBlockThreadedDraw<T, 32>(
-          args.params, p, args.image, args.thread_pool);
+      total_iters = DynamicBlockThreadedDraw<T, N>(
+          args.params, p, args.image, args.thread_pool, args.tuning, args.cost_map, args.priority);
       break;
     case Strategy::DYNAMIC_BLOCK_THREADED_INCREMENTAL:
-      total_iters = DynamicBlockThreadedIncrementalDraw<T, 32>(
-          args.params, p, args.image, args.thread_pool, args.previous_params, args.previous_image);
+      total_iters = DynamicBlockThreadedIncrementalDraw<T, N>(
+          args.params, p, args.image, args.thread_pool, args.previous_params, args.previous_image,
+          args.tuning, args.cost_map, args.priority);
+      break;
+    case Strategy::DYNAMIC_BLOCK_THREADED_SCROLLING:
+      if (args.scrolling_image == nullptr) {
+	total_iters = DynamicBlockThreadedIncrementalDraw<T, N>(
+	    args.params, p, args.image, args.thread_pool, args.previous_params, args.previous_image,
+	    args.tuning, args.cost_map, args.priority);
+	break;
+      }
+      total_iters = DynamicBlockThreadedScrollingDraw<T, N>(
+          args.params, p, *args.scrolling_image, args.image, args.thread_pool, args.on_rows_ready,
+          args.tuning, args.cost_map, args.priority);
+      // The rows have all been handed over already.
+      return total_iters;
+  }
+
+  if (args.on_rows_ready) {
+    args.on_rows_ready(FrameRows(args.image), 0, args.params.height);
+  }
+  return total_iters;
+}
+
+template <typename T>
+size_t DrawFractalImpl(const DrawFractalArgs& args) {
+  // Figure out what polynomial we're drawing. Precision::FIXED draws with a
+  // FixedPointPolynomial instead (see FillRegionFixedPoint), so it only gets a
+  // stand-in, rather than analysing the zeros (and for many of them, building
+  // a ZeroTree) for nothing.
+  const bool fixed_point = args.params.precision == Precision::FIXED;
+  AnalyzedPolynomial<T> p = AnalyzedPolynomial<T>(
+      fixed_point ? std::vector<Complex<T>>{Complex<T>(0, 0)} : DoubleTo<T>(args.params.zeros));
+  if constexpr (std::is_same_v<T, float>) {
+    if (args.params.precision == Precision::MIXED) {
+      p.refinement = std::make_shared<const AnalyzedPolynomial<double>>(
+          DoubleTo<double>(args.params.zeros));
+    }
+  }
+  if (!fixed_point) {
+    std::cout << "Drawing: " << p << std::endl;
+  }
+
+  if (args.cost_map != nullptr) {
+    args.cost_map->StartFrame(args.params);
+  }
+
+  // Dispatch on block width, to one of TuningParams::kBlockWidths.
+  size_t total_iters = 0;
+  switch (args.tuning.block_width) {
+    case 8:
+      total_iters = DrawFractalWithBlockWidth<T, 8>(args, p);
+      break;
+    case 16:
+      total_iters = DrawFractalWithBlockWidth<T, 16>(args, p);
+      break;
+    case 64:
+      total_iters = DrawFractalWithBlockWidth<T, 64>(args, p);
+      break;
+    default:
+      total_iters = DrawFractalWithBlockWidth<T, 32>(args, p);
+      break;
+  }
+
+  if (args.cost_map != nullptr) {
+    args.cost_map->FinishFrame();
+  }
+  return total_iters;
+}
+
+// Perturbation isn't a per pixel precision that the usual strategies can be
+// run at, so it has its own take on them: it draws everything at once, but
+// reuses the overlap with the previous image when only panning, like the
+// incremental strategy.
+template <size_t N>
+size_t DrawFractalPerturbedWithBlockWidth(const DrawFractalArgs& args) {
+  const FractalParams& params = args.params;
+  std::vector<ImageRect> regions = {{
+      .x_min = 0,
+      .x_max = params.width,
+      .y_min = 0,
+      .y_max = params.height,
+    }};
+  const Strategy strategy = params.strategy.value_or(Strategy::DYNAMIC_BLOCK_THREADED_SCROLLING);
+  if ((strategy == Strategy::DYNAMIC_BLOCK_THREADED_INCREMENTAL ||
+       strategy == Strategy::DYNAMIC_BLOCK_THREADED_SCROLLING) &&
+      args.previous_params.has_value() && args.previous_image != nullptr &&
+      ParamsDifferOnlyByPanning(params, *args.previous_params) &&
+      CopiesPaletteIndices(*args.previous_image, args.image)) {
+    // At reference precision, since that's what the origin may be held at.
+    const ImageDelta delta = ComputePanOnlyImageDelta<ReferenceFloat>(*args.previous_params, params);
+    if (delta.overlap.has_value()) {
+      const uint64_t start_time = Now();
+      CopyImage(*args.previous_image, args.image, *delta.overlap);
+      const uint64_t end_time = Now();
+      std::cout << "Copy time (ms): " << (end_time - start_time) << std::endl;
+    }
+    regions = delta.b_only;
+  }
+
+  const std::vector<ImageRect> tasks = SplitIntoTasks(
+      regions, args.thread_pool.size(), args.tuning.pixels_per_task, args.cost_map);
+  const size_t total_iters = PerturbationDraw<N>(
+      params, tasks, args.image, args.thread_pool, args.cost_map, args.priority);
+  if (args.on_rows_ready) {
+    args.on_rows_ready(FrameRows(args.image), 0, params.height);
+  }
+  return total_iters;
+}
+
+size_t DrawFractalPerturbed(const DrawFractalArgs& args) {
+  if (args.cost_map != nullptr) {
+    args.cost_map->StartFrame(args.params);
+  }
+
+  size_t total_iters = 0;
+  switch (args.tuning.block_width) {
+    case 8:
+      total_iters = DrawFractalPerturbedWithBlockWidth<8>(args);
+      break;
+    case 16:
+      total_iters = DrawFractalPerturbedWithBlockWidth<16>(args);
+      break;
+    case 64:
+      total_iters = DrawFractalPerturbedWithBlockWidth<64>(args);
+      break;
+    default:
+      total_iters = DrawFractalPerturbedWithBlockWidth<32>(args);
       break;
   }
 
+  if (args.cost_map != nullptr) {
+    args.cost_map->FinishFrame();
+  }
   return total_iters;
 }
 
+// Whether frames with these params should be drawn keeping each pixel's
+// palette index, i.e. the index of the zero it goes to, for encoding indexed.
+bool KeepsPaletteIndices(const FractalParams& params) {
+  return params.png_encoder == PngEncoder::INDEXED && params.colors.size() <= 256;
+}
+
 size_t DrawFractal(const DrawFractalArgs& args) {
+  args.image.get_pixbuf().KeepPaletteIndices(KeepsPaletteIndices(args.params));
+
   size_t total_iters = 0;
-  switch (args.params.precision.value_or(Precision::SINGLE)) {
+  const Precision precision = ResolvePrecision(args.params);
+  std::cout << "Precision: " << ToString(precision)
+	    << (args.params.precision.has_value() ? "" : " (auto)") << std::endl;
+  switch (precision) {
     case Precision::SINGLE:
+    case Precision::FAST:
       total_iters = DrawFractalImpl<float>(args);
       break;
+    case Precision::MIXED:
+      // Float only shows where it's in doubt if it can tell neighbouring pixels
+      // apart, so views too deep for that are drawn in double throughout, as
+      // are polynomials too high degree for it to pay, see kMixedMaxZeros.
+      if (ChoosePrecision(args.params) == Precision::SINGLE &&
+	  args.params.zeros.size() < kMixedMaxZeros) {
+	total_iters = DrawFractalImpl<float>(args);
+      } else {
+	total_iters = DrawFractalImpl<double>(args);
+      }
+      break;
     case Precision::DOUBLE:
+    case Precision::FIXED:
       total_iters = DrawFractalImpl<double>(args);
       break;
+    case Precision::DOUBLE_DOUBLE:
+      total_iters = DrawFractalImpl<DoubleDouble>(args);
+      break;
+    case Precision::PERTURBATION:
+      total_iters = DrawFractalPerturbed(args);
+      break;
   }
   return total_iters;
 }
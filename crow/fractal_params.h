@@ -3,27 +3,74 @@
 
 #include <string>
 #include <optional>
+#include <limits>
+#include <algorithm>
+#include <cmath>
 
 #include <png++/png.hpp>
 #include <crow.h>
 
 #include "complex.h"
+#include "double_double.h"
+#include "reference_float.h"
+#include "analyzed_polynomial.h"
 
 enum class Precision {
   SINGLE,
   DOUBLE,
+  // Two doubles per number, see double_double.h. For zooms deeper than double
+  // can resolve.
+  DOUBLE_DOUBLE,
+  // Per pixel offsets in double from a few high precision reference orbits,
+  // see perturbation.h. Faster than DOUBLE_DOUBLE, and for zooms deeper still
+  // if the client sends the view origin at full precision (see
+  // FractalParams::r_min_exact).
+  PERTURBATION,
+  // Float, with the pixels float may have got wrong redone in double. For
+  // views float can resolve, at close to float speed.
+  MIXED,
+  // Float, with the divides in the Newton step done with reciprocal
+  // estimates, see approximate_math.h. A few pixels on basin boundaries can
+  // come out differently, so it's opt in: see accuracy_test.cpp.
+  FAST,
+  // Q32.32 fixed point, see fixed_point.h. Slower than DOUBLE and no deeper,
+  // but gives the same image on every host and build: see fixed_point_test.cpp.
+  FIXED,
 };
 
+const char* ToString(Precision precision) {
+  switch (precision) {
+    case Precision::SINGLE:
+      return "SINGLE";
+    case Precision::DOUBLE:
+      return "DOUBLE";
+    case Precision::DOUBLE_DOUBLE:
+      return "DOUBLE_DOUBLE";
+    case Precision::PERTURBATION:
+      return "PERTURBATION";
+    case Precision::MIXED:
+      return "MIXED";
+    case Precision::FAST:
+      return "FAST";
+    case Precision::FIXED:
+      return "FIXED";
+  }
+  return "UNKNOWN";
+}
+
 enum class Strategy {
   NAIVE,
   DYNAMIC_BLOCK,
   DYNAMIC_BLOCK_THREADED,
   DYNAMIC_BLOCK_THREADED_INCREMENTAL,
+  DYNAMIC_BLOCK_THREADED_SCROLLING,
 };
 
 enum class PngEncoder {
   PNGPP,
   FPNG,
+  PARALLEL,
+  INDEXED,
 };
 
 enum class HandlerType {
@@ -143,6 +190,16 @@ bool ParseFiniteDouble(const crow::query_string& url_params,
   return ToFiniteDouble(value, output);
 }
 
+bool ParseFiniteReferenceFloat(const crow::query_string& url_params,
+			       const std::string& key,
+			       ReferenceFloat* output) {
+  const char* value = url_params.get(key);
+  if (value == nullptr) {
+    return false;
+  }
+  return ToFiniteReferenceFloat(value, output);
+}
+
 bool ParseComplexList(const crow::query_string& url_params,
 		      const std::string& real_key,
 		      const std::string& img_key,
@@ -210,6 +267,25 @@ bool ParsePrecision(const crow::query_string& url_params,
   } else if (s == "DOUBLE") {
     *output = Precision::DOUBLE;
     return true;
+  } else if (s == "DOUBLE_DOUBLE") {
+    *output = Precision::DOUBLE_DOUBLE;
+    return true;
+  } else if (s == "PERTURBATION") {
+    *output = Precision::PERTURBATION;
+    return true;
+  } else if (s == "MIXED") {
+    *output = Precision::MIXED;
+    return true;
+  } else if (s == "FAST") {
+    *output = Precision::FAST;
+    return true;
+  } else if (s == "FIXED") {
+    *output = Precision::FIXED;
+    return true;
+  } else if (s == "AUTO") {
+    // Left unset, see ResolvePrecision().
+    *output = std::nullopt;
+    return true;
   }
   return false;
 }
@@ -234,6 +310,9 @@ bool ParseStrategy(const crow::query_string& url_params,
   } else if (s == "DYNAMIC_BLOCK_THREADED_INCREMENTAL") {
     *output = Strategy::DYNAMIC_BLOCK_THREADED_INCREMENTAL;
     return true;
+  } else if (s == "DYNAMIC_BLOCK_THREADED_SCROLLING") {
+    *output = Strategy::DYNAMIC_BLOCK_THREADED_SCROLLING;
+    return true;
   }
   return false;
 }
@@ -252,6 +331,12 @@ bool ParsePngEncoder(const crow::query_string& url_params,
   } else if (s == "FPNG") {
     *output = PngEncoder::FPNG;
     return true;
+  } else if (s == "PARALLEL") {
+    *output = PngEncoder::PARALLEL;
+    return true;
+  } else if (s == "INDEXED") {
+    *output = PngEncoder::INDEXED;
+    return true;
   }
   return false;
 }
@@ -277,6 +362,24 @@ bool ParseHandlerType(const crow::query_string& url_params,
   return false;
 }
 
+bool ParseBool(const crow::query_string& url_params,
+	       const std::string& key,
+	       bool* output) {
+  const char* c_str = url_params.get(key);
+  if (c_str == nullptr) {
+    return false;
+  }
+  const std::string s(c_str);
+  if (s == "true") {
+    *output = true;
+    return true;
+  } else if (s == "false") {
+    *output = false;
+    return true;
+  }
+  return false;
+}
+
 struct FractalParams {
   static std::optional<FractalParams> Parse(const crow::query_string& url_params) {
     FractalParams fractal_params;
@@ -299,10 +402,21 @@ struct FractalParams {
     }
 
     // Optional params.
+    ParseFiniteDouble(url_params, "i_min_lo", &fractal_params.i_min_lo);
+    ParseFiniteDouble(url_params, "r_min_lo", &fractal_params.r_min_lo);
     ParsePrecision(url_params, "precision", &fractal_params.precision);
     ParseStrategy(url_params, "strategy", &fractal_params.strategy);
     ParsePngEncoder(url_params, "png_encoder", &fractal_params.png_encoder);
     ParseHandlerType(url_params, "handler", &fractal_params.handler_type);
+    ParseBool(url_params, "client_layout", &fractal_params.client_layout);
+    ParseBool(url_params, "far_field", &fractal_params.far_field);
+
+    // The origin at full precision, if given, supersedes the double-double one.
+    ReferenceFloat r_min_exact, i_min_exact;
+    if (ParseFiniteReferenceFloat(url_params, "r_min_exact", &r_min_exact) &&
+	ParseFiniteReferenceFloat(url_params, "i_min_exact", &i_min_exact)) {
+      fractal_params.SetExactOrigin(r_min_exact, i_min_exact);
+    }
 
     return fractal_params;
   }
@@ -311,6 +425,51 @@ struct FractalParams {
     return r_range / width * height;
   }
 
+  // The view origin at precision T, including the low order parts if T can
+  // hold them.
+  template <typename T>
+  T i_min_as() const {
+    if constexpr (std::is_same_v<T, ReferenceFloat>) {
+      if (i_min_exact.has_value()) {
+	return *i_min_exact;
+      }
+    }
+    return FromHighAndLow<T>(i_min, i_min_lo);
+  }
+
+  template <typename T>
+  T r_min_as() const {
+    if constexpr (std::is_same_v<T, ReferenceFloat>) {
+      if (r_min_exact.has_value()) {
+	return *r_min_exact;
+      }
+    }
+    return FromHighAndLow<T>(r_min, r_min_lo);
+  }
+
+  // Sets the view origin at full precision, and its double-double rounding
+  // to go with it.
+  void SetExactOrigin(const ReferenceFloat& r, const ReferenceFloat& i) {
+    r_min_exact = r;
+    i_min_exact = i;
+    r_min = static_cast<double>(r);
+    r_min_lo = static_cast<double>(r - r_min);
+    i_min = static_cast<double>(i);
+    i_min_lo = static_cast<double>(i - i_min);
+  }
+
+  // Moves the bottom of the view up by `offset`, keeping the origin as
+  // precise as it is.
+  void ShiftIMin(double offset) {
+    if (i_min_exact.has_value()) {
+      SetExactOrigin(*r_min_exact, *i_min_exact + offset);
+      return;
+    }
+    const DoubleDouble shifted = i_min_as<DoubleDouble>() + DoubleDouble(offset);
+    i_min = shifted.hi;
+    i_min_lo = shifted.lo;
+  }
+
   // Request metadata.
   std::string session_id;
   size_t request_id;
@@ -328,10 +487,39 @@ struct FractalParams {
   std::vector<png::rgb_pixel> colors;
 
   // Optional args.
+  // If unset, picked per frame by ResolvePrecision().
   std::optional<Precision> precision;
   std::optional<Strategy> strategy;
   std::optional<PngEncoder> png_encoder;
   std::optional<HandlerType> handler_type;
+
+  // Low order parts of the view origin, i.e. it's really at
+  // (r_min + r_min_lo, i_min + i_min_lo). Only precisions past double use
+  // them, since short of that depth double can't tell pixels apart. The range
+  // doesn't need them: it's only ever used relative to the origin.
+  double i_min_lo = 0.0;
+  double r_min_lo = 0.0;
+
+  // The view origin at full precision, from decimal strings, for zooms past
+  // what double-double can resolve. Only PERTURBATION uses it, for its
+  // reference orbits. If set, the origin above is its double-double rounding,
+  // see SetExactOrigin().
+  std::optional<ReferenceFloat> r_min_exact;
+  std::optional<ReferenceFloat> i_min_exact;
+
+  // If set, the client lays out (i.e. pans and zooms) the last frame it got to
+  // fit the viewport itself, so the server only needs to send new images.
+  bool client_layout = false;
+
+  // If set, pixels far outside the zeros skip ahead across many Newton steps
+  // at once (see far_field.h), which is faster when zoomed out but can move a
+  // pixel right on a basin boundary to the other side.
+  bool far_field = false;
+
+  // Set by FrameStream rather than the client, when the frame is likely to go
+  // out as a pan delta. Handlers then leave the PNG to be encoded only if it's
+  // asked for, rather than encoding it while drawing.
+  bool png_optional = false;
 };
 
 struct SaveParams {
@@ -367,6 +555,22 @@ struct SaveParams {
   std::string metadata;
 };
 
+// Identifies a save job, see save_jobs.h.
+struct SaveJobParams {
+  static std::optional<SaveJobParams> Parse(const crow::query_string& url_params) {
+    SaveJobParams save_job_params;
+
+    // Required params.
+    if (!ParsePositiveInt(url_params, "job_id", &save_job_params.job_id)) {
+      return std::nullopt;
+    }
+
+    return save_job_params;
+  }
+
+  size_t job_id;
+};
+
 struct LoadParams {
   static std::optional<LoadParams> Parse(const crow::query_string& url_params) {
     LoadParams load_params;
@@ -406,6 +610,89 @@ bool AllEqual(const std::vector<T>& a, const std::vector<T>& b) {
   return true;
 }
 
+// Bits to spare, as a factor, for error that builds up while iterating.
+constexpr double kPrecisionMargin = 256.0; // TUNE.
+
+double ZeroMagnitude(const FractalParams& params) {
+  double zero_magnitude = 0.0;
+  for (const ComplexD& zero : params.zeros) {
+    zero_magnitude = std::max({zero_magnitude, std::abs(zero.r), std::abs(zero.i)});
+  }
+  return zero_magnitude;
+}
+
+// Whether view coordinates held to the given relative precision can still
+// tell neighbouring pixels apart, with kPrecisionMargin to spare.
+bool CanResolvePixels(const FractalParams& params, double coordinate_epsilon) {
+  // Iterates start in the view and end up at the zeros, so both set the scale
+  // that pixel spacing is relative to.
+  const double magnitude = std::max({
+      ZeroMagnitude(params),
+      std::abs(params.r_min), std::abs(params.r_min + params.r_range),
+      std::abs(params.i_min), std::abs(params.i_min + params.i_range())});
+  return params.r_range / params.width >= magnitude * coordinate_epsilon * kPrecisionMargin;
+}
+
+// The cheapest precision that can still tell neighbouring pixels apart, and
+// tell when iterates have reached a zero, with some bits to spare for error
+// that builds up while iterating.
+Precision ChoosePrecision(const FractalParams& params) {
+  const double zero_magnitude = ZeroMagnitude(params);
+  // Comparing every pair of zeros is O(degree^2) and this runs several times a
+  // frame, so high degree polynomials take the spacing from their ZeroTree,
+  // which is kept between frames and works it out once.
+  const double convergence_radius = (params.zeros.size() >= kZeroTreeMinZeros)
+    ? GetZeroTree(params.zeros)->MinZeroSpacing() / 20.0
+    : ConservativeConvergenceRadius(params.zeros);
+
+  // Cheapest first. Perturbation tests convergence in double, but has view
+  // coordinates at reference precision if the origin was given that exactly,
+  // else at double-double precision.
+  struct Candidate {
+    Precision precision;
+    double coordinate_epsilon;
+    double convergence_epsilon;
+  };
+  constexpr double float_epsilon = std::numeric_limits<float>::epsilon();
+  constexpr double double_epsilon = std::numeric_limits<double>::epsilon();
+  const double double_double_epsilon = std::numeric_limits<DoubleDouble>::epsilon().hi;
+  const double origin_epsilon = params.r_min_exact.has_value()
+    ? static_cast<double>(std::numeric_limits<ReferenceFloat>::epsilon())
+    : double_double_epsilon;
+  const Candidate candidates[] = {
+    {Precision::SINGLE, float_epsilon, float_epsilon},
+    {Precision::DOUBLE, double_epsilon, double_epsilon},
+    {Precision::PERTURBATION, origin_epsilon, double_epsilon},
+    {Precision::DOUBLE_DOUBLE, double_double_epsilon, double_double_epsilon},
+  };
+  for (const Candidate& candidate : candidates) {
+    // Reference orbits expand p, which is O(degree^2) per step, so high degree
+    // polynomials do better at double-double with a ZeroTree.
+    if (candidate.precision == Precision::PERTURBATION &&
+	params.zeros.size() >= kZeroTreeMinZeros) {
+      continue;
+    }
+    if (CanResolvePixels(params, candidate.coordinate_epsilon) &&
+	convergence_radius >= zero_magnitude * candidate.convergence_epsilon * kPrecisionMargin) {
+      return candidate.precision;
+    }
+  }
+  // Past what anything can resolve, so just do the best we can. That's
+  // perturbation if it has the origin at full precision and the zeros are far
+  // enough apart for it, since it goes deeper than double-double.
+  if (params.r_min_exact.has_value() && params.zeros.size() < kZeroTreeMinZeros &&
+      convergence_radius >= zero_magnitude * double_epsilon * kPrecisionMargin) {
+    return Precision::PERTURBATION;
+  }
+  return Precision::DOUBLE_DOUBLE;
+}
+
+// The precision to draw with: as requested, or else automatically chosen.
+// Only depends on the params, so the same params always resolve the same way.
+Precision ResolvePrecision(const FractalParams& params) {
+  return params.precision.has_value() ? *params.precision : ChoosePrecision(params);
+}
+
 bool ParamsDifferOnlyByPanning(const FractalParams& a, const FractalParams& b) {
   return (a.r_range == b.r_range &&
 	  a.width == b.width &&
@@ -413,7 +700,18 @@ bool ParamsDifferOnlyByPanning(const FractalParams& a, const FractalParams& b) {
 	  a.max_iters == b.max_iters &&
 	  AllEqual(a.zeros, b.zeros) &&
 	  AllEqual(a.colors, b.colors) &&
-	  a.precision == b.precision);
+	  a.far_field == b.far_field &&
+	  ResolvePrecision(a) == ResolvePrecision(b));
+}
+
+// Whether a frame can be made from the previous one by moving its pixels
+// across and drawing only the newly exposed strips, whether by the drawing
+// code or by a client sent a pan delta. Not for Precision::FIXED: its grid is
+// anchored at ToFixedPoint(r_min), so moved pixels would be off from the new
+// grid by the rounding of both origins, and the frame would depend on how it
+// was panned to.
+bool CanReuseAfterPan(const FractalParams& a, const FractalParams& b) {
+  return ParamsDifferOnlyByPanning(a, b) && ResolvePrecision(b) != Precision::FIXED;
 }
 
 bool ParamsDifferOnlyByViewport(const FractalParams& a, const FractalParams& b) {
@@ -422,7 +720,8 @@ bool ParamsDifferOnlyByViewport(const FractalParams& a, const FractalParams& b)
 	  a.max_iters == b.max_iters &&
 	  AllEqual(a.zeros, b.zeros) &&
 	  AllEqual(a.colors, b.colors) &&
-	  a.precision == b.precision);
+	  a.far_field == b.far_field &&
+	  ResolvePrecision(a) == ResolvePrecision(b));
 }
 
 #endif // _CROW_FRACTAL_SERVER_FRACTAL_PARAMS_
@@ -7,6 +7,8 @@
 #include <set>
 #include <mutex>
 #include <chrono>
+#include <map>
+#include <memory>
 
 #include <png++/png.hpp>
 #include <crow.h>
@@ -27,6 +29,12 @@
 #include "fractal_drawing.h"
 #include "png_encoding.h"
 #include "handler_group.h"
+#include "frame_stream.h"
+#include "tuning.h"
+#include "autotuner.h"
+
+// Where this machine's tuning is kept between runs.
+const char kTuningFile[] = "tuning.txt";
 
 crow::query_string GetBodyParams(const crow::request& req) {
   std::string fake_url = "?" + req.body;
@@ -62,16 +70,35 @@ int main() {
 
   fpng::fpng_init();
 
-  // Using 8-1 threads (since we have 8 logical CPUs) even though there are only
-  // 4 physical cores. Experiments seem to show that 8 is slightly faster
-  // (although not 2x faster) than 4. We subtract 1 because this leaves us on
-  // average one core to handle non-thread-pool tasks. This seems to be
-  // especially important when running in bash-on-windows - in that setting,
-  // having 8 threads in the pool can cause noticeable hiccups in other tasks,
-  // which can make everything jerky.
-  ThreadPool thread_pool(/*num_threads=*/7);
+  // Use the tuning found for this machine before, or else start with the
+  // defaults and find it in the background. Delete the tuning file (or use
+  // /autotune) to retune, e.g. after a hardware change.
+  //
+  // The default of 8-1 threads came from a machine with 8 logical CPUs but only
+  // 4 physical cores, where 8 was slightly faster (although not 2x faster)
+  // than 4. Leaving one out gives non-thread-pool tasks a core on average,
+  // which matters especially when running in bash-on-windows - there, having 8
+  // threads in the pool can cause noticeable hiccups in other tasks, which can
+  // make everything jerky.
+  std::optional<TuningParams> tuning = TuningParams::Load(kTuningFile);
+  const bool autotune_now = !tuning.has_value();
+  if (autotune_now) {
+    tuning = TuningParams();
+  } else {
+    std::cout << "Loaded tuning from " << kTuningFile << ":" << std::endl << tuning->ToString();
+  }
+  SetTuning(*tuning);
+
+  ThreadPool thread_pool(tuning->num_threads);
   HandlerGroup handlers(&thread_pool);
 
+  // Benchmarks only run while the thread pool is idle, so they don't slow down
+  // live sessions.
+  BackgroundAutotuner autotuner(&thread_pool, kTuningFile);
+  if (autotune_now) {
+    autotuner.Start();
+  }
+
   crow::SimpleApp app; //define your crow application
 
   // Main page.
@@ -107,6 +134,32 @@ int main() {
       return handlers.HandleFractalRequest(*fractal_params);
     });
 
+  // Frame push over a WebSocket: params go up, frames come down as soon as
+  // they're ready.
+  std::mutex frame_streams_mutex;
+  std::map<crow::websocket::connection*, std::unique_ptr<FrameStream>> frame_streams;
+  CROW_WEBSOCKET_ROUTE(app, "/frames")
+    .onopen([&](crow::websocket::connection& conn) {
+      std::scoped_lock lock(frame_streams_mutex);
+      frame_streams[&conn] = std::make_unique<FrameStream>(&conn, &handlers);
+    })
+    .onclose([&](crow::websocket::connection& conn, const std::string& /*reason*/) {
+      std::scoped_lock lock(frame_streams_mutex);
+      frame_streams.erase(&conn);
+    })
+    .onmessage([&](crow::websocket::connection& conn, const std::string& data, bool /*is_binary*/) {
+      std::optional<FractalParams> fractal_params = FractalParams::Parse(crow::query_string("?" + data));
+      if (!fractal_params.has_value()) {
+	std::cout << "Malformed params :(" << std::endl;
+	return;
+      }
+      std::scoped_lock lock(frame_streams_mutex);
+      auto it = frame_streams.find(&conn);
+      if (it != frame_streams.end()) {
+	it->second->SetParams(*fractal_params);
+      }
+    });
+
   // Save image with metadata.
   CROW_ROUTE(app, "/save").methods(crow::HTTPMethod::POST)
     ([&](const crow::request& req){
@@ -123,6 +176,34 @@ int main() {
       return handlers.HandleSaveRequest(*save_params);
     });
 
+  // Progress of a save job.
+  CROW_ROUTE(app, "/save_status").methods(crow::HTTPMethod::POST)
+    ([&](const crow::request& req){
+      const auto params = GetBodyParams(req);
+      std::optional<SaveJobParams> save_job_params = SaveJobParams::Parse(params);
+      if (!save_job_params.has_value()) {
+	std::cout << "Malformed params :(" << std::endl;
+	crow::json::wvalue json({{"success", false},
+				 {"error_message", "Malformed params"}});
+	return crow::response(json);
+      }
+      return handlers.HandleSaveStatusRequest(*save_job_params);
+    });
+
+  // Cancel a save job.
+  CROW_ROUTE(app, "/save_cancel").methods(crow::HTTPMethod::POST)
+    ([&](const crow::request& req){
+      const auto params = GetBodyParams(req);
+      std::optional<SaveJobParams> save_job_params = SaveJobParams::Parse(params);
+      if (!save_job_params.has_value()) {
+	std::cout << "Malformed params :(" << std::endl;
+	crow::json::wvalue json({{"success", false},
+				 {"error_message", "Malformed params"}});
+	return crow::response(json);
+      }
+      return handlers.HandleSaveCancelRequest(*save_job_params);
+    });
+
   // Load image metadata.
   CROW_ROUTE(app, "/load").methods(crow::HTTPMethod::POST)
     ([&](const crow::request& req){
@@ -145,6 +226,45 @@ int main() {
       return handlers.HandleListImagesRequest();
     });
 
+  // Rerun the autotuner in the background, and switch to its result (and
+  // save it) when it's done. The thread count only takes effect on restart,
+  // since the thread pool is already running. Responds straight away with
+  // whether it started, and the result of the last run, if any.
+  CROW_ROUTE(app, "/autotune").methods(crow::HTTPMethod::POST)
+    ([&](){
+      const bool started = autotuner.Start();
+      crow::json::wvalue json({
+	  {"started", started},
+	  {"running", autotuner.running()},
+	  {"num_threads_in_use", thread_pool.size()},
+	});
+      if (const std::optional<TuningParams> result = autotuner.last_result()) {
+	json["block_width"] = result->block_width;
+	json["pixels_per_task"] = result->pixels_per_task;
+	json["rows_per_task"] = result->rows_per_task;
+	json["num_threads"] = result->num_threads;
+      }
+      return crow::response(json);
+    });
+
+  // Queue depth and wait time for each class of work on the thread pool.
+  CROW_ROUTE(app, "/thread_pool_stats")
+    ([&](){
+      const auto stats = thread_pool.GetStats();
+      crow::json::wvalue json;
+      for (size_t i = 0; i < stats.size(); ++i) {
+	const ThreadPool::QueueStats& queue = stats[i];
+	json[ToString(static_cast<TaskPriority>(i))] = crow::json::wvalue({
+	    {"queued", queue.queued},
+	    {"max_queued", queue.max_queued},
+	    {"started", queue.started},
+	    {"mean_wait_ms", queue.started > 0 ? queue.total_wait_ms / queue.started : 0.0},
+	    {"max_wait_ms", queue.max_wait_ms},
+	  });
+      }
+      return crow::response(json);
+    });
+
   // Test page - image cycler.
   CROW_ROUTE(app, "/image_cycler.html")([](){
     return crow::mustache::load_text("image_cycler.html");
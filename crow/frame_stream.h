@@ -0,0 +1,186 @@
+#ifndef _CROW_FRACTAL_SERVER_FRAME_STREAM_
+#define _CROW_FRACTAL_SERVER_FRAME_STREAM_
+
+#include <algorithm>
+#include <condition_variable>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+
+#include <boost/thread.hpp>
+#include <crow.h>
+
+#include "fractal_params.h"
+#include "handler.h"
+#include "synchronized_resource.h"
+#include "pan_delta.h"
+#include "development_utils.h"
+
+// Pushes frames down a WebSocket as soon as the handler has them, rather than
+// the client sending a /params request and long-polling /fractal per frame.
+// The client sends params up as text messages (in the same url encoded form as
+// the POST bodies), and gets binary messages back: the data id and viewport id
+// as little-endian 64 bit ints, then the precision the frame was drawn with
+// (the value of the Precision enum) and the message type as little-endian 32
+// bit ints, followed by either a PNG (kKeyframe) or a pan delta relative to the
+// previous message (kPanDelta, see pan_delta.h).
+class FrameStream {
+ public:
+  static constexpr size_t kHeaderBytes = 24;
+  static constexpr uint32_t kKeyframe = 0;
+  static constexpr uint32_t kPanDelta = 1;
+
+  // Send a full frame at least this often, so that any small differences
+  // between deltas and what a full redraw would give don't linger.
+  static constexpr size_t kMaxDeltasBetweenKeyframes = 60; // TUNE.
+
+  // The connection must stay valid until Close() is called. The handler must
+  // outlive the stream.
+  FrameStream(crow::websocket::connection* connection, Handler* handler)
+    : state_(std::make_shared<State>(connection, handler)) {
+    // Close() wakes the push thread if it's waiting on the handler for a frame,
+    // but it may be busy drawing one (e.g. for the synchronous handler), so
+    // it shares ownership of the state rather than being joined.
+    boost::thread(&FrameStream::PushLoop, state_).detach();
+  }
+
+  ~FrameStream() {
+    Close();
+  }
+
+  void SetParams(FractalParams params) {
+    // A pan away from the previous params will most likely go out as a pan
+    // delta, so tell the handler not to bother encoding its PNG up front.
+    {
+      std::scoped_lock lock(state_->m);
+      params.png_optional = state_->params.has_value() &&
+	CanReuseAfterPan(*state_->params, params);
+    }
+    // Let handlers with background loops start on the params straight away,
+    // even if the push thread is still waiting for an older frame.
+    state_->handler.HandleParamsRequest(params);
+    {
+      std::scoped_lock lock(state_->m);
+      state_->params = params;
+    }
+    state_->cv.notify_all();
+  }
+
+  // After this returns, the connection is never touched again, and the push
+  // thread stops waiting for frames.
+  void Close() {
+    {
+      std::scoped_lock lock(state_->m);
+      state_->connection = nullptr;
+    }
+    state_->cv.notify_all();
+    state_->canceller.Cancel();
+  }
+
+ private:
+  struct State {
+    State(crow::websocket::connection* connection, Handler* handler)
+      : connection(connection), handler(*handler) {}
+
+    std::mutex m;
+    std::condition_variable cv;
+    // Null once closed.
+    crow::websocket::connection* connection;
+    // Unowned.
+    Handler& handler;
+    std::optional<FractalParams> params;
+    // Cancelled on close, to wake the push thread from GetFrame().
+    WaitCanceller canceller;
+  };
+
+  static void AppendLittleEndian64(std::string* out, uint64_t value) {
+    for (int i = 0; i < 8; ++i) {
+      out->push_back(static_cast<char>(value >> (8 * i)));
+    }
+  }
+
+  static void PushLoop(std::shared_ptr<State> state) {
+    uint64_t last_data_id = 0;
+    uint64_t last_viewport_id = 0;
+    uint64_t failed_request_id = 0;
+
+    // What the client was last sent, if deltas can be computed against it.
+    std::optional<FractalParams> last_sent_params;
+    size_t deltas_since_keyframe = 0;
+
+    while (true) {
+      // Wait until the client has params that we haven't sent a complete frame
+      // for yet. Everything that can come back for older params is superseded.
+      FractalParams params;
+      {
+	std::unique_lock lock(state->m);
+	while (state->connection != nullptr &&
+	       (!state->params.has_value() ||
+		state->params->request_id <= std::min(last_data_id, last_viewport_id) ||
+		state->params->request_id <= failed_request_id)) {
+	  state->cv.wait(lock);
+	}
+	if (state->connection == nullptr) {
+	  std::cout << "FrameStream closed" << std::endl;
+	  return;
+	}
+	params = *state->params;
+      }
+
+      params.last_data_id = last_data_id;
+      params.last_viewport_id = last_viewport_id;
+      const std::optional<Frame> frame = state->handler.GetFrame(params, &state->canceller);
+      if (!frame.has_value()) {
+	// Either we were closed, or the handler was reset under us, in which
+	// case wait for the client to move on.
+	failed_request_id = params.request_id;
+	continue;
+      }
+
+      // Send just what's changed if the client's frame is a pan away.
+      std::optional<std::string> delta = std::nullopt;
+      if (last_sent_params.has_value() && frame->params.has_value() && frame->image != nullptr &&
+	  deltas_since_keyframe < kMaxDeltasBetweenKeyframes) {
+	const uint64_t start_time = Now();
+	delta = EncodePanDelta(*last_sent_params, *frame->params, *frame->image);
+	if (delta.has_value()) {
+	  std::cout << "Pan delta encode time (ms): " << (Now() - start_time)
+		    << ", bytes: " << delta->size() << std::endl;
+	}
+      }
+
+      std::string message;
+      AppendLittleEndian64(&message, frame->data_id);
+      AppendLittleEndian64(&message, frame->viewport_id);
+      AppendLittleEndian32(&message, static_cast<uint32_t>(frame->precision));
+      if (delta.has_value()) {
+	AppendLittleEndian32(&message, kPanDelta);
+	message.append(*delta);
+	++deltas_since_keyframe;
+      } else {
+	// Encodes the PNG now if the handler left it until it was asked for.
+	const EncodedPng png = frame->png->Get();
+	message.reserve(kHeaderBytes + png->size());
+	AppendLittleEndian32(&message, kKeyframe);
+	message.append(*png);
+	deltas_since_keyframe = 0;
+      }
+      {
+	std::scoped_lock lock(state->m);
+	if (state->connection == nullptr) {
+	  continue;
+	}
+	state->connection->send_binary(std::move(message));
+      }
+      last_data_id = frame->data_id;
+      last_viewport_id = frame->viewport_id;
+      last_sent_params = frame->params;
+    }
+  }
+
+  std::shared_ptr<State> state_;
+};
+
+#endif // _CROW_FRACTAL_SERVER_FRAME_STREAM_
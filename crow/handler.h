@@ -3,15 +3,54 @@
 
 #include <string>
 #include <utility>
+#include <optional>
+#include <iostream>
+#include <memory>
 
 #include <crow.h>
 
 #include "fractal_params.h"
+#include "rgb_image.h"
+#include "png_encoding.h"
+#include "response.h"
+#include "synchronized_resource.h"
+
+// An encoded frame along with the request ids of the data and viewport that it
+// shows.
+struct Frame {
+  std::shared_ptr<LazyPng> png;
+  uint64_t data_id;
+  uint64_t viewport_id;
+
+  // What the image was drawn with, e.g. if it was picked automatically.
+  Precision precision;
+
+  // The params and image that were encoded, if the image is exactly what the
+  // params describe (i.e. not a layout of some other image). Lets a
+  // FrameStream send just what changed since the client's previous frame.
+  std::optional<FractalParams> params = std::nullopt;
+  std::shared_ptr<const RGBImage> image = nullptr;
+};
 
 class Handler {
  public:
   virtual crow::response HandleParamsRequest(const FractalParams& params) = 0;
-  virtual crow::response HandleFractalRequest(const FractalParams& params) = 0;
+
+  // Hands over the params, and blocks until there's a frame newer than
+  // params.last_data_id / params.last_viewport_id. Returns nullopt if the
+  // handler was reset while waiting, or if `canceller` was cancelled.
+  virtual std::optional<Frame> GetFrame(const FractalParams& params,
+					WaitCanceller* canceller = nullptr) = 0;
+
+  virtual crow::response HandleFractalRequest(const FractalParams& params) {
+    std::optional<Frame> frame = GetFrame(params);
+    if (!frame.has_value()) {
+      std::cout << "PNG resource is dead :(" << std::endl;
+      return crow::response(500);
+    }
+    return ImageWithMetadata(*frame->png->Get(), frame->data_id, frame->viewport_id,
+			     frame->precision);
+  }
 
   virtual ~Handler() {}
 };
@@ -20,6 +20,11 @@ class HandlerGroup : public Handler {
     return GetHandler(params).HandleParamsRequest(params);
   }
 
+  std::optional<Frame> GetFrame(const FractalParams& params,
+				WaitCanceller* canceller = nullptr) override {
+    return GetHandler(params).GetFrame(params, canceller);
+  }
+
   crow::response HandleFractalRequest(const FractalParams& params) override {
     return GetHandler(params).HandleFractalRequest(params);
   }
@@ -28,6 +33,14 @@ class HandlerGroup : public Handler {
     return synchronous_handler_.HandleSaveRequest(params);
   }
 
+  crow::response HandleSaveStatusRequest(const SaveJobParams& params) {
+    return synchronous_handler_.HandleSaveStatusRequest(params);
+  }
+
+  crow::response HandleSaveCancelRequest(const SaveJobParams& params) {
+    return synchronous_handler_.HandleSaveCancelRequest(params);
+  }
+
   crow::response HandleLoadRequest(const LoadParams& params) {
     return synchronous_handler_.HandleLoadRequest(params);
   }
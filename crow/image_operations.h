@@ -1,8 +1,16 @@
 #ifndef _CROW_FRACTAL_SERVER_IMAGE_OPERATIONS_
 #define _CROW_FRACTAL_SERVER_IMAGE_OPERATIONS_
 
+#include <vector>
+#include <optional>
+#include <cstdint>
+#include <algorithm>
+
 #include "rgb_image.h"
+#include "indexed_image.h"
 #include "image_regions.h"
+#include "thread_pool.h"
+#include "task_group.h"
 
 struct IntRGBPixel {
   int r;
@@ -37,7 +45,17 @@ struct IntRGBPixel {
 };
 
 // Can likely be optimized, but not clear if necessary.
+// Whether CopyImage() from `from` leaves `to` with all the palette indices it
+// keeps, i.e. unless `to` keeps them and `from` doesn't.
+bool CopiesPaletteIndices(const RGBImage& from, const RGBImage& to) {
+  return to.get_pixbuf().palette_indices() == nullptr || from.get_pixbuf().palette_indices() != nullptr;
+}
+
+// Palette indices are copied too, if both images keep them.
 void CopyImage(const RGBImage& from, RGBImage& to, const ImageOverlap& overlap) {
+  const uint8_t* from_indices = from.get_pixbuf().palette_indices();
+  uint8_t* to_indices = to.get_pixbuf().palette_indices();
+  const bool copy_indices = from_indices != nullptr && to_indices != nullptr;
   size_t from_y = overlap.a_region.y_min;
   size_t to_y = overlap.b_region.y_min;
   for (; from_y < overlap.a_region.y_max; ++from_y, ++to_y) {
@@ -46,6 +64,11 @@ void CopyImage(const RGBImage& from, RGBImage& to, const ImageOverlap& overlap)
     for (; from_x < overlap.a_region.x_max; ++from_x, ++to_x) {
       to[to_y][to_x] = from[from_y][from_x];
     }
+    if (copy_indices) {
+      std::copy(from_indices + from_y * from.get_width() + overlap.a_region.x_min,
+		from_indices + from_y * from.get_width() + overlap.a_region.x_max,
+		to_indices + to_y * to.get_width() + overlap.b_region.x_min);
+    }
   }
 }
 
@@ -89,4 +112,147 @@ void ResizeBilinear(const RGBImage& from, RGBImage& to, const ImageOverlap& over
   }
 }
 
+// Fixed-point setup for ResizeBilinearParallel. Positions are computed with the
+// same 11 bits of fraction as ResizeBilinear, but blend weights are cut down to
+// 7 bits so that a horizontally blended channel fits in 16 bits.
+constexpr int kResizePositionShift = 11;
+constexpr int kResizeWeightShift = 7;
+constexpr int kResizeWeightOne = 1 << kResizeWeightShift;
+
+// Where one output column (or row) samples from, and with what weights.
+struct ResizeTap {
+  int from_0;
+  uint16_t weight_0;
+  uint16_t weight_1;
+};
+
+// Computes the taps for every output position along one axis, stopping at the
+// first one that would read past the end of the source (from_0 is monotonic, so
+// everything after it is out of range too).
+std::vector<ResizeTap> ComputeResizeTaps(size_t from_min, size_t from_extent,
+					 size_t to_extent, size_t from_limit) {
+  constexpr int kFactor = 1 << kResizePositionShift;
+  const int scale_i = static_cast<int>(1.0 * kFactor * from_extent / to_extent + 0.5);
+  std::vector<ResizeTap> taps;
+  taps.reserve(to_extent);
+  for (size_t i = 0; i < to_extent; ++i) {
+    const int from_i = i * scale_i + from_min * kFactor;
+    const int from_0 = from_i >> kResizePositionShift;
+    if (from_0 + 1 >= static_cast<int>(from_limit)) {
+      break;
+    }
+    const int frac = (from_i - (from_0 << kResizePositionShift)) >>
+      (kResizePositionShift - kResizeWeightShift);
+    taps.push_back({
+	.from_0 = from_0,
+	.weight_0 = static_cast<uint16_t>(kResizeWeightOne - frac),
+	.weight_1 = static_cast<uint16_t>(frac),
+      });
+  }
+  return taps;
+}
+
+// Blends horizontally along one source row, writing one 16-bit value per
+// channel per output column.
+void ResizeRowHorizontal(const png::rgb_pixel* from_row,
+			 const std::vector<ResizeTap>& x_taps,
+			 uint16_t* out) {
+  const size_t N = x_taps.size();
+  for (size_t x = 0; x < N; ++x) {
+    const ResizeTap& tap = x_taps[x];
+    const png::rgb_pixel& p0 = from_row[tap.from_0];
+    const png::rgb_pixel& p1 = from_row[tap.from_0 + 1];
+    out[3 * x + 0] = p0.red * tap.weight_0 + p1.red * tap.weight_1;
+    out[3 * x + 1] = p0.green * tap.weight_0 + p1.green * tap.weight_1;
+    out[3 * x + 2] = p0.blue * tap.weight_0 + p1.blue * tap.weight_1;
+  }
+}
+
+// Blends two horizontally-blended rows together into output bytes. This is a
+// plain loop over contiguous arrays so that it vectorizes.
+void ResizeRowVertical(const uint16_t* top, const uint16_t* bottom,
+		       uint16_t weight_0, uint16_t weight_1,
+		       size_t count, unsigned char* out) {
+  constexpr uint32_t kRound = 1 << (2 * kResizeWeightShift - 1);
+  for (size_t i = 0; i < count; ++i) {
+    const uint32_t blend = top[i] * uint32_t(weight_0) + bottom[i] * uint32_t(weight_1);
+    out[i] = static_cast<unsigned char>((blend + kRound) >> (2 * kResizeWeightShift));
+  }
+}
+
+// Accessors that let the resampler read rows from different kinds of source
+// image. RGB rows are read in place; indexed rows are expanded into `scratch`.
+const png::rgb_pixel* SourceRow(const RGBImage& from, size_t y,
+				std::vector<png::rgb_pixel>& /*scratch*/) {
+  return from[y];
+}
+
+const png::rgb_pixel* SourceRow(const IndexedImage& from, size_t y,
+				std::vector<png::rgb_pixel>& scratch) {
+  scratch.resize(from.get_width());
+  from.ExpandRow(y, scratch.data());
+  return scratch.data();
+}
+
+// Resizes output rows [y_begin, y_end) (relative to the output region).
+template <typename Source>
+void ResizeBilinearRows(const Source& from, RGBImage& to, const ImageRect& to_rect,
+			const std::vector<ResizeTap>& x_taps,
+			const std::vector<ResizeTap>& y_taps,
+			size_t y_begin, size_t y_end) {
+  const size_t count = 3 * x_taps.size();
+  std::vector<uint16_t> top(count);
+  std::vector<uint16_t> bottom(count);
+  std::vector<png::rgb_pixel> scratch;
+  std::optional<int> top_row;
+
+  for (size_t y = y_begin; y < y_end && y < y_taps.size(); ++y) {
+    const ResizeTap& tap = y_taps[y];
+
+    // Neighbouring output rows usually share source rows, so only blend the
+    // source rows we don't already have.
+    if (tap.from_0 != top_row) {
+      if (top_row.has_value() && tap.from_0 == *top_row + 1) {
+	std::swap(top, bottom);
+      } else {
+	ResizeRowHorizontal(SourceRow(from, tap.from_0, scratch), x_taps, top.data());
+      }
+      ResizeRowHorizontal(SourceRow(from, tap.from_0 + 1, scratch), x_taps, bottom.data());
+      top_row = tap.from_0;
+    }
+
+    unsigned char* out = reinterpret_cast<unsigned char*>(&to[to_rect.y_min + y][to_rect.x_min]);
+    ResizeRowVertical(top.data(), bottom.data(), tap.weight_0, tap.weight_1, count, out);
+  }
+}
+
+// Same result as ResizeBilinear (up to rounding), but with per-column
+// coefficients computed once, 16-bit intermediates, and bands of rows spread
+// across the thread pool. Source can be an RGBImage or an IndexedImage.
+template <typename Source>
+void ResizeBilinearParallel(const Source& from, RGBImage& to, const ImageOverlap& overlap,
+			    ThreadPool& thread_pool) {
+  const ImageRect& from_rect = overlap.a_region;
+  const ImageRect& to_rect = overlap.b_region;
+  const std::vector<ResizeTap> x_taps =
+    ComputeResizeTaps(from_rect.x_min, from_rect.width(), to_rect.width(), from.get_width());
+  const std::vector<ResizeTap> y_taps =
+    ComputeResizeTaps(from_rect.y_min, from_rect.height(), to_rect.height(), from.get_height());
+  if (x_taps.empty() || y_taps.empty()) {
+    return;
+  }
+
+  constexpr size_t bands_per_thread = 4; // TUNE.
+  const size_t bands = thread_pool.size() * bands_per_thread;
+  const size_t rows_per_band = (y_taps.size() + bands - 1) / bands;
+  TaskGroup task_group(&thread_pool);
+  for (size_t y_begin = 0; y_begin < y_taps.size(); y_begin += rows_per_band) {
+    const size_t y_end = std::min(y_begin + rows_per_band, y_taps.size());
+    task_group.Add([&from, &to, &to_rect, &x_taps, &y_taps, y_begin, y_end]() {
+      ResizeBilinearRows(from, to, to_rect, x_taps, y_taps, y_begin, y_end);
+    });
+  }
+  task_group.WaitUntilDone();
+}
+
 #endif // _CROW_FRACTAL_SERVER_IMAGE_OPERATIONS_
@@ -0,0 +1,150 @@
+#ifndef _CROW_FRACTAL_SERVER_IMAGE_POOL_
+#define _CROW_FRACTAL_SERVER_IMAGE_POOL_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <utility>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "rgb_image.h"
+#include "development_utils.h"
+
+// Hands out RGBImages of a requested size, recycling images whose shared_ptrs
+// have all been dropped instead of allocating a fresh buffer for every frame.
+class ImagePool {
+ public:
+  // Images bigger than this are advised to use transparent huge pages.
+  static constexpr size_t kHugePageThresholdBytes = 8 << 20;
+  static constexpr size_t kHugePageBytes = 2 << 20;
+
+  explicit ImagePool(size_t max_free_bytes)
+    : state_(std::make_shared<State>()) {
+    state_->max_free_bytes = max_free_bytes;
+  }
+
+  // Returns an image of the given size. If `clear` is false the contents of the
+  // image are unspecified, which is fine when the caller is going to overwrite
+  // every pixel anyway.
+  std::shared_ptr<RGBImage> Acquire(size_t width, size_t height, bool clear) {
+    std::unique_ptr<RGBImage> image = TakeFree(width, height);
+    if (image == nullptr) {
+      image = Allocate(width, height);
+    }
+    if (clear) {
+      std::memset(reinterpret_cast<unsigned char*>(&(*image)[0][0]), 0, ImageBytes(*image));
+    }
+    // Whatever indices a recycled image kept are for its old contents.
+    image->get_pixbuf().KeepPaletteIndices(false);
+
+    // Return the image to the pool once the last reference is dropped. The
+    // pool may be gone by then, in which case we just free it.
+    std::weak_ptr<State> weak_state = state_;
+    return std::shared_ptr<RGBImage>(image.release(), [weak_state](RGBImage* released) {
+      std::unique_ptr<RGBImage> owned(released);
+      if (std::shared_ptr<State> state = weak_state.lock()) {
+	Release(*state, std::move(owned));
+      }
+    });
+  }
+
+ private:
+  using Size = std::pair<size_t, size_t>;
+
+  struct State {
+    std::mutex m;
+    std::map<Size, std::vector<std::unique_ptr<RGBImage>>> free_images;
+    size_t free_bytes = 0;
+    size_t max_free_bytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+  };
+
+  static size_t ImageBytes(const RGBImage& image) {
+    return image.get_width() * image.get_height() * sizeof(png::rgb_pixel);
+  }
+
+  std::unique_ptr<RGBImage> TakeFree(size_t width, size_t height) {
+    std::scoped_lock lock(state_->m);
+    auto it = state_->free_images.find(Size(width, height));
+    if (it == state_->free_images.end() || it->second.empty()) {
+      ++state_->misses;
+      return nullptr;
+    }
+    std::unique_ptr<RGBImage> image = std::move(it->second.back());
+    it->second.pop_back();
+    state_->free_bytes -= ImageBytes(*image);
+    ++state_->hits;
+    return image;
+  }
+
+  std::unique_ptr<RGBImage> Allocate(size_t width, size_t height) {
+    const uint64_t start_time = Now();
+    const long start_faults = MinorPageFaults();
+    // Sized without zero-filling, so nothing has touched the pages yet when
+    // AdviseHugePages() runs, and they can be faulted in as huge pages.
+    auto image = std::make_unique<RGBImage>();
+    image->get_pixbuf().set_zero_fill(false);
+    image->resize(width, height);
+    image->get_pixbuf().set_zero_fill(true);
+    AdviseHugePages(*image);
+    const uint64_t end_time = Now();
+    const long end_faults = MinorPageFaults();
+
+    uint64_t hits, misses;
+    {
+      std::scoped_lock lock(state_->m);
+      hits = state_->hits;
+      misses = state_->misses;
+    }
+    std::cout << "ImagePool allocated " << width << "x" << height
+	      << " image, allocation time (ms): " << (end_time - start_time)
+	      << ", page faults: " << (end_faults - start_faults)
+	      << " (hits: " << hits << ", misses: " << misses << ")" << std::endl;
+    return image;
+  }
+
+  static void Release(State& state, std::unique_ptr<RGBImage> image) {
+    const size_t bytes = ImageBytes(*image);
+    std::scoped_lock lock(state.m);
+    if (state.free_bytes + bytes > state.max_free_bytes) {
+      // Over budget, just let the image be freed.
+      return;
+    }
+    state.free_bytes += bytes;
+    state.free_images[Size(image->get_width(), image->get_height())].push_back(std::move(image));
+  }
+
+  // Asks the kernel to back the (huge page aligned) interior of a large image
+  // with transparent huge pages. Must be called before the image's pixels are
+  // first touched, so that the first faults already get huge pages rather than
+  // waiting for khugepaged to collapse them.
+  static void AdviseHugePages(RGBImage& image) {
+    const size_t bytes = ImageBytes(image);
+    if (bytes < kHugePageThresholdBytes) {
+      return;
+    }
+    const uintptr_t begin = reinterpret_cast<uintptr_t>(&image[0][0]);
+    const uintptr_t aligned_begin = (begin + kHugePageBytes - 1) & ~(kHugePageBytes - 1);
+    const uintptr_t aligned_end = (begin + bytes) & ~(kHugePageBytes - 1);
+    if (aligned_end <= aligned_begin) {
+      return;
+    }
+    madvise(reinterpret_cast<void*>(aligned_begin), aligned_end - aligned_begin, MADV_HUGEPAGE);
+  }
+
+  static long MinorPageFaults() {
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return usage.ru_minflt;
+  }
+
+  std::shared_ptr<State> state_;
+};
+
+#endif // _CROW_FRACTAL_SERVER_IMAGE_POOL_
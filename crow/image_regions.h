@@ -67,7 +67,8 @@ std::optional<RangeOverlap> FindPanOnlyRangeOverlap(T a_min, T b_min, T step, si
     prev = curr;
     curr += step;
   }
-  if (offset > 0 && std::abs(end - prev) < std::abs(end - curr)) {
+  using std::abs;
+  if (offset > 0 && abs(end - prev) < abs(end - curr)) {
     --offset;
   }
   if (offset == num_pixels) {
@@ -95,8 +96,8 @@ std::optional<ImageOverlap> FindPanOnlyImageOverlap(const FractalParams& a, cons
   const size_t height = a.height;
   const T step = a.r_range / width;
 
-  std::optional<RangeOverlap> r_overlap = FindPanOnlyRangeOverlap<T>(a.r_min, b.r_min, step, width);
-  std::optional<RangeOverlap> i_overlap = FindPanOnlyRangeOverlap<T>(a.i_min, b.i_min, step, height);
+  std::optional<RangeOverlap> r_overlap = FindPanOnlyRangeOverlap<T>(a.r_min_as<T>(), b.r_min_as<T>(), step, width);
+  std::optional<RangeOverlap> i_overlap = FindPanOnlyRangeOverlap<T>(a.i_min_as<T>(), b.i_min_as<T>(), step, height);
   if (!r_overlap.has_value() || !i_overlap.has_value()) {
     return std::nullopt;
   }
@@ -172,41 +173,42 @@ ImageDelta ComputePanOnlyImageDelta(const FractalParams& a, const FractalParams&
   return delta;
 }
 
-size_t TransformAndClampX(size_t pixel, size_t image_dim,
+size_t TransformAndClampX(size_t pixel, size_t from_dim, size_t to_dim,
 			  double from_float_range, double to_float_range,
 			  double from_float_min, double to_float_min) {
-  const double float_value = 1.0 * pixel / image_dim * from_float_range + from_float_min;
-  const double to_pixel = (float_value - to_float_min) / to_float_range * image_dim;
+  const double float_value = 1.0 * pixel / from_dim * from_float_range + from_float_min;
+  const double to_pixel = (float_value - to_float_min) / to_float_range * to_dim;
   return (to_pixel < 0 ? 0 :
-	  to_pixel >= image_dim ? image_dim :
+	  to_pixel >= to_dim ? to_dim :
 	  static_cast<size_t>(to_pixel));
 }
 
-size_t TransformAndClampY(size_t pixel, size_t image_dim,
+size_t TransformAndClampY(size_t pixel, size_t from_dim, size_t to_dim,
 			  double from_float_range, double to_float_range,
 			  double from_float_min, double to_float_min) {
   const double from_float_max = from_float_min + from_float_range;
   const double to_float_max = to_float_min + to_float_range;
-  const double float_value = from_float_max - 1.0 * pixel / image_dim * from_float_range;
-  const double to_pixel = (to_float_max - float_value) / to_float_range * image_dim;
+  const double float_value = from_float_max - 1.0 * pixel / from_dim * from_float_range;
+  const double to_pixel = (to_float_max - float_value) / to_float_range * to_dim;
   return (to_pixel < 0 ? 0 :
-	  to_pixel >= image_dim ? image_dim :
+	  to_pixel >= to_dim ? to_dim :
 	  static_cast<size_t>(to_pixel));
 }
 
+// The two sets of params may have different image sizes.
 ImageRect TransformAndClamp(const ImageRect& from_rect,
 			    const FractalParams& from_params,
 			    const FractalParams& to_params) {
-  const size_t x_min = TransformAndClampX(from_rect.x_min, from_params.width,
+  const size_t x_min = TransformAndClampX(from_rect.x_min, from_params.width, to_params.width,
 					  from_params.r_range, to_params.r_range,
 					  from_params.r_min, to_params.r_min);
-  const size_t x_max = TransformAndClampX(from_rect.x_max, from_params.width,
+  const size_t x_max = TransformAndClampX(from_rect.x_max, from_params.width, to_params.width,
 					  from_params.r_range, to_params.r_range,
 					  from_params.r_min, to_params.r_min);
-  const size_t y_min = TransformAndClampY(from_rect.y_min, from_params.height,
+  const size_t y_min = TransformAndClampY(from_rect.y_min, from_params.height, to_params.height,
 					  from_params.i_range(), to_params.i_range(),
 					  from_params.i_min, to_params.i_min);
-  const size_t y_max = TransformAndClampY(from_rect.y_max, from_params.height,
+  const size_t y_max = TransformAndClampY(from_rect.y_max, from_params.height, to_params.height,
 					  from_params.i_range(), to_params.i_range(),
 					  from_params.i_min, to_params.i_min);
   return ImageRect{
@@ -0,0 +1,106 @@
+#ifndef _CROW_FRACTAL_SERVER_INDEXED_IMAGE_
+#define _CROW_FRACTAL_SERVER_INDEXED_IMAGE_
+
+#include <vector>
+#include <optional>
+#include <cstdint>
+
+#include "rgb_image.h"
+#include "fractal_params.h"
+
+// An image stored as one palette index (i.e. root index) per pixel. A third the
+// size of the equivalent RGBImage.
+class IndexedImage {
+ public:
+  IndexedImage(size_t width, size_t height, const std::vector<png::rgb_pixel>& palette)
+    : width_(width), height_(height), indices_(width * height), palette_(palette) {}
+
+  // Converts an image whose pixels are all palette colors, keeping every
+  // `downsample`th pixel in each direction. Returns nullopt if some pixel isn't
+  // in the palette, or if the palette is too big to index with a byte.
+  static std::optional<IndexedImage> FromRGB(const RGBImage& image,
+					     const std::vector<png::rgb_pixel>& palette,
+					     size_t downsample = 1) {
+    if (palette.empty() || palette.size() > 256) {
+      return std::nullopt;
+    }
+    IndexedImage result(image.get_width() / downsample, image.get_height() / downsample, palette);
+
+    // Neighbouring pixels are almost always the same color, so check the last
+    // match before searching the palette.
+    uint8_t last = 0;
+    for (size_t y = 0; y < result.height_; ++y) {
+      const png::rgb_pixel* from = &image[y * downsample][0];
+      uint8_t* to = result[y];
+      for (size_t x = 0; x < result.width_; ++x) {
+	const png::rgb_pixel& pixel = from[x * downsample];
+	if (pixel != palette[last]) {
+	  size_t i = 0;
+	  while (i < palette.size() && pixel != palette[i]) {
+	    ++i;
+	  }
+	  if (i == palette.size()) {
+	    return std::nullopt;
+	  }
+	  last = static_cast<uint8_t>(i);
+	}
+	to[x] = last;
+      }
+    }
+    return result;
+  }
+
+  uint8_t* operator[](size_t y) {
+    return &indices_[y * width_];
+  }
+
+  const uint8_t* operator[](size_t y) const {
+    return &indices_[y * width_];
+  }
+
+  size_t get_width() const {
+    return width_;
+  }
+
+  size_t get_height() const {
+    return height_;
+  }
+
+  const std::vector<png::rgb_pixel>& palette() const {
+    return palette_;
+  }
+
+  size_t Bytes() const {
+    return indices_.size();
+  }
+
+  // Expands row y back into RGB.
+  void ExpandRow(size_t y, png::rgb_pixel* output) const {
+    const uint8_t* row = (*this)[y];
+    for (size_t x = 0; x < width_; ++x) {
+      output[x] = palette_[row[x]];
+    }
+  }
+
+ private:
+  size_t width_;
+  size_t height_;
+  std::vector<uint8_t> indices_;
+  std::vector<png::rgb_pixel> palette_;
+};
+
+// Returns params describing an image downsampled by the given factor, such that
+// pixel (x, y) of the downsampled image lines up with pixel
+// (x * downsample, y * downsample) of the original.
+FractalParams DownsampleParams(const FractalParams& params, size_t downsample) {
+  FractalParams result = params;
+  result.width = params.width / downsample;
+  result.height = params.height / downsample;
+  result.r_range = params.r_range / params.width * result.width * downsample;
+  // Keeping the top edge where it was, and the origin as precise as it was,
+  // so it's still exact for deep zooms.
+  result.ShiftIMin(params.i_range() - result.i_range());
+  return result;
+}
+
+#endif // _CROW_FRACTAL_SERVER_INDEXED_IMAGE_
@@ -0,0 +1,101 @@
+#ifndef _CROW_FRACTAL_SERVER_PAN_DELTA_
+#define _CROW_FRACTAL_SERVER_PAN_DELTA_
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <cstdint>
+
+#include "rgb_image.h"
+#include "fractal_params.h"
+#include "image_regions.h"
+#include "image_operations.h"
+#include "png_encoding.h"
+
+// When panning, a client that already has the previous frame only needs the
+// pixel offset and the newly exposed strips. A pan delta is laid out as:
+//   int32 dx, int32 dy: offset to draw the previous frame at,
+//   uint32 strip count, then for each strip:
+//     uint32 x, uint32 y: position of the strip,
+//     uint32 length, then that many bytes of PNG.
+// All little-endian.
+
+void AppendLittleEndian32(std::string* out, uint32_t value) {
+  for (int i = 0; i < 4; ++i) {
+    out->push_back(static_cast<char>(value >> (8 * i)));
+  }
+}
+
+template <typename T>
+std::optional<std::string> EncodePanDeltaImpl(const FractalParams& from,
+					      const FractalParams& to,
+					      const RGBImage& image) {
+  const ImageDelta delta = ComputePanOnlyImageDelta<T>(from, to);
+  if (!delta.overlap.has_value()) {
+    return std::nullopt;
+  }
+
+  // Past a certain point we may as well send the whole frame.
+  size_t new_pixels = 0;
+  for (const ImageRect& rect : delta.b_only) {
+    new_pixels += rect.CountPixels();
+  }
+  constexpr size_t max_new_pixel_fraction = 4; // TUNE.
+  if (new_pixels * max_new_pixel_fraction > to.width * to.height) {
+    return std::nullopt;
+  }
+
+  std::string payload;
+  const ImageOverlap& overlap = *delta.overlap;
+  AppendLittleEndian32(&payload, static_cast<int32_t>(overlap.b_region.x_min) -
+		       static_cast<int32_t>(overlap.a_region.x_min));
+  AppendLittleEndian32(&payload, static_cast<int32_t>(overlap.b_region.y_min) -
+		       static_cast<int32_t>(overlap.a_region.y_min));
+  AppendLittleEndian32(&payload, delta.b_only.size());
+  for (const ImageRect& rect : delta.b_only) {
+    RGBImage strip(rect.width(), rect.height());
+    CopyImage(image, strip, {
+	.a_region = rect,
+	.b_region = {
+	  .x_min = 0,
+	  .x_max = rect.width(),
+	  .y_min = 0,
+	  .y_max = rect.height(),
+	},
+      });
+    const std::string png = EncodeWithFPng(strip);
+    AppendLittleEndian32(&payload, rect.x_min);
+    AppendLittleEndian32(&payload, rect.y_min);
+    AppendLittleEndian32(&payload, png.size());
+    payload.append(png);
+  }
+  return payload;
+}
+
+// Returns the pan delta that takes a frame drawn with `from` to `image`, drawn
+// with `to`, or nullopt if a full frame should be sent instead.
+std::optional<std::string> EncodePanDelta(const FractalParams& from,
+					  const FractalParams& to,
+					  const RGBImage& image) {
+  if (!CanReuseAfterPan(from, to)) {
+    return std::nullopt;
+  }
+  // Match the pixel alignment that the drawing code used.
+  switch (ResolvePrecision(to)) {
+    case Precision::SINGLE:
+    case Precision::MIXED:
+    case Precision::FAST:
+      return EncodePanDeltaImpl<float>(from, to, image);
+    case Precision::DOUBLE:
+      return EncodePanDeltaImpl<double>(from, to, image);
+    case Precision::DOUBLE_DOUBLE:
+      return EncodePanDeltaImpl<DoubleDouble>(from, to, image);
+    case Precision::PERTURBATION:
+      return EncodePanDeltaImpl<ReferenceFloat>(from, to, image);
+    case Precision::FIXED:
+      break;
+  }
+  return std::nullopt;
+}
+
+#endif // _CROW_FRACTAL_SERVER_PAN_DELTA_
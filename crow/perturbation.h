@@ -0,0 +1,472 @@
+#ifndef _CROW_FRACTAL_SERVER_PERTURBATION_
+#define _CROW_FRACTAL_SERVER_PERTURBATION_
+
+#include <vector>
+#include <array>
+#include <memory>
+#include <optional>
+#include <mutex>
+#include <limits>
+#include <iostream>
+
+#include "rgb_image.h"
+#include "complex.h"
+#include "polynomial.h"
+#include "analyzed_polynomial.h"
+#include "double_double.h"
+#include "reference_float.h"
+#include "fractal_params.h"
+#include "image_regions.h"
+#include "pixel_iterator.h"
+#include "thread_pool.h"
+#include "task_group.h"
+#include "cost_map.h"
+#include "development_utils.h"
+
+// Perturbation rendering, for zooms too deep to iterate every pixel at high
+// precision.
+//
+// One pixel per view, the reference, has its Newton orbit Z_n computed at high
+// precision. Every other pixel only tracks the offset d_n = z_n - Z_n of its
+// orbit from the reference. The offsets start out tiny but double holds them
+// just as accurately as big numbers, so they can be iterated in double lanes
+// however deep the zoom is. Expanding p about Z_n gives d_{n+1} from d_n and a
+// handful of coefficients per reference iteration, without the cancellation
+// that computing z_n - Z_n directly would suffer (see ReferenceOrbit::Step).
+//
+// Where p' along a pixel's orbit is much smaller than along the reference's,
+// the expansion loses precision (a "glitch", cf. Pauldelbrot's criterion for
+// the Mandelbrot set). Those pixels are set aside and redrawn around a
+// secondary reference picked from among them, for a few rounds. Any left after
+// that are iterated directly, at double-double precision if that can resolve
+// the view, and otherwise as references of their own.
+
+// A reference orbit, with what the per-pixel iteration needs at each step
+// rounded to double.
+class ReferenceOrbit {
+ public:
+  // Iterates the pixel at (x, y) of the view until it converges or runs out of
+  // iterations. `polynomial` is p at reference precision.
+  ReferenceOrbit(const FractalParams& params,
+		 const Polynomial<ReferenceFloat>& polynomial,
+		 const AnalyzedPolynomialD& p,
+		 size_t x, size_t y)
+    : x_(x), y_(y), degree_(polynomial.coefficients.size() - 1) {
+    const ReferenceFloat step = params.r_range / params.width;
+    Complex<ReferenceFloat> z(params.r_min_as<ReferenceFloat>() + step * x,
+			      params.i_min_as<ReferenceFloat>() + step * (params.height - 1 - y));
+
+    std::vector<Complex<ReferenceFloat>> taylor;
+    for (size_t n = 0; n < params.max_iters; ++n) {
+      // The Taylor coefficients of p about z, i.e. c_k with
+      // p(z + d) = sum_k c_k d^k, by repeated synthetic division.
+      taylor = polynomial.coefficients;
+      for (size_t k = 0; k < degree_; ++k) {
+	for (size_t j = degree_ - 1; j + 1 > k; --j) {
+	  taylor[j] += taylor[j + 1] * z;
+	}
+      }
+
+      const ComplexD z_double = ToDouble(z);
+      zs_.push_back(z_double);
+      for (const Complex<ReferenceFloat>& c : taylor) {
+	coefficients_.push_back(ToDouble(c));
+      }
+      if (p.ConvergedToZero(z_double)) {
+	break;
+      }
+      z -= taylor[0] / taylor[1];
+    }
+  }
+
+  size_t x() const {
+    return x_;
+  }
+
+  size_t y() const {
+    return y_;
+  }
+
+  size_t size() const {
+    return zs_.size();
+  }
+
+  // Z_n. Once the orbit has ended it stays put, i.e. Z_n = Z_{size() - 1}.
+  const ComplexD& z(size_t n) const {
+    return zs_[std::min(n, zs_.size() - 1)];
+  }
+
+  // Takes the offsets of N pixels' orbits from this one from step n to n + 1,
+  // all at once. The offsets are held as separate real and imaginary parts, and
+  // every lane shares step n's coefficients, so each part of the update is a
+  // branch free loop over lanes that vectorizes. Only lanes with `active` set
+  // are updated. Lanes that would lose too much precision (i.e. the pixel has
+  // glitched) get `glitched` set instead, and are left as they were.
+  //
+  // With A = p(Z), B = p'(Z), and dp, dp' the changes in p and p' from Z to
+  // Z + d (which the Taylor coefficients give without cancellation):
+  //   p/p' (Z + d) - A/B = (dp B - A dp') / (B (B + dp')).
+  template <size_t N>
+  void Step(size_t n, const bool* active, double* d_r, double* d_i, bool* glitched) const {
+    const bool ended = (n + 1 >= zs_.size());
+    const ComplexD* c = &coefficients_[std::min(n, zs_.size() - 1) * (degree_ + 1)];
+
+    // q = c_1 + c_2 d + ..., r = 2 c_2 + 3 c_3 d + ..., so dp = d q, dp' = d r.
+    double q_r[N], q_i[N], r_r[N], r_i[N];
+    const ComplexD top_r = (degree_ >= 2) ? c[degree_] * ComplexD(degree_, 0) : ComplexD(0, 0);
+    for (size_t b = 0; b < N; ++b) {
+      q_r[b] = c[degree_].r;
+      q_i[b] = c[degree_].i;
+      r_r[b] = top_r.r;
+      r_i[b] = top_r.i;
+    }
+    for (size_t k = degree_ - 1; k >= 1; --k) {
+      for (size_t b = 0; b < N; ++b) {
+	const double q_r_next = q_r[b] * d_r[b] - q_i[b] * d_i[b] + c[k].r;
+	q_i[b] = q_r[b] * d_i[b] + q_i[b] * d_r[b] + c[k].i;
+	q_r[b] = q_r_next;
+      }
+      if (k >= 2) {
+	const ComplexD ck = c[k] * ComplexD(k, 0);
+	for (size_t b = 0; b < N; ++b) {
+	  const double r_r_next = r_r[b] * d_r[b] - r_i[b] * d_i[b] + ck.r;
+	  r_i[b] = r_r[b] * d_i[b] + r_i[b] * d_r[b] + ck.i;
+	  r_r[b] = r_r_next;
+	}
+      }
+    }
+
+    const ComplexD& a = c[0];
+    const ComplexD& bb = c[1];
+    // The reference isn't moving once it's ended, so its step is the pixel's too.
+    const ComplexD reference_step = ended ? a / bb : ComplexD(0, 0);
+    // p' at the pixel, with a lot less magnitude than at the reference means
+    // the subtraction above has cancelled away most of the precision.
+    constexpr double glitch_tolerance = 1e-6; // TUNE.
+    const double min_sqr_derivative =
+      glitch_tolerance * glitch_tolerance * bb.sqr_magnitude();
+    for (size_t b = 0; b < N; ++b) {
+      const double dp_r = d_r[b] * q_r[b] - d_i[b] * q_i[b];
+      const double dp_i = d_r[b] * q_i[b] + d_i[b] * q_r[b];
+      const double dpp_r = d_r[b] * r_r[b] - d_i[b] * r_i[b];
+      const double dpp_i = d_r[b] * r_i[b] + d_i[b] * r_r[b];
+      const double pd_r = bb.r + dpp_r;
+      const double pd_i = bb.i + dpp_i;
+      // (dp B - A dp') / (B pd), as Complex's operator/ would.
+      const double num_r = (dp_r * bb.r - dp_i * bb.i) - (a.r * dpp_r - a.i * dpp_i);
+      const double num_i = (dp_r * bb.i + dp_i * bb.r) - (a.r * dpp_i + a.i * dpp_r);
+      const double den_r = bb.r * pd_r - bb.i * pd_i;
+      const double den_i = bb.r * pd_i + bb.i * pd_r;
+      const double den = den_r * den_r + den_i * den_i;
+      const double next_r = (d_r[b] - (num_r * den_r + num_i * den_i) / den) - reference_step.r;
+      const double next_i = (d_i[b] - (num_i * den_r - num_r * den_i) / den) - reference_step.i;
+      const bool glitch = active[b] && (pd_r * pd_r + pd_i * pd_i < min_sqr_derivative);
+      const bool update = active[b] && !glitch;
+      glitched[b] = glitch;
+      d_r[b] = update ? next_r : d_r[b];
+      d_i[b] = update ? next_i : d_i[b];
+    }
+  }
+
+ private:
+  static double ToDouble(const ReferenceFloat& value) {
+    return static_cast<double>(value);
+  }
+
+  static ComplexD ToDouble(const Complex<ReferenceFloat>& value) {
+    return ComplexD(ToDouble(value.r), ToDouble(value.i));
+  }
+
+  const size_t x_;
+  const size_t y_;
+  const size_t degree_;
+
+  // Z_n for each step, and the Taylor coefficients c_0 ... c_degree about it.
+  std::vector<ComplexD> zs_;
+  std::vector<ComplexD> coefficients_;
+};
+
+// Iterates the pixels handed out by `next_pixel` (returning PixelMetadata, or
+// nullopt when there are no more) relative to `reference`, in blocks of N.
+// Unlike FillRegionUsingDynamicBlocks, a block's pixels start together and
+// stay in lockstep, so that they're all at the same reference step and can
+// share its coefficients (see ReferenceOrbit::Step). Lanes whose pixel is done
+// sit idle until the block is, which costs little as neighbouring pixels take
+// similar numbers of iterations. Pixels that glitch are added to `glitched`
+// rather than drawn.
+template <size_t N, typename NextPixel>
+size_t FillPixelsPerturbed(const FractalParams& params,
+			   const AnalyzedPolynomialD& p,
+			   const ReferenceOrbit& reference,
+			   NextPixel next_pixel,
+			   RGBImage& image,
+			   std::vector<PixelMetadata>* glitched,
+			   CostMap::TileCounter* tile_iters) {
+  const double step = params.r_range / params.width;
+  size_t total_iters = 0;
+  while (true) {
+    // Start a block.
+    std::array<PixelMetadata, N> pixels;
+    bool active[N];
+    bool lane_glitched[N];
+    double d_r[N];
+    double d_i[N];
+    size_t remaining = 0;
+    for (size_t b = 0; b < N; ++b) {
+      const std::optional<PixelMetadata> pixel = next_pixel();
+      active[b] = pixel.has_value();
+      d_r[b] = 0.0;
+      d_i[b] = 0.0;
+      if (!pixel.has_value()) {
+	continue;
+      }
+      pixels[b] = *pixel;
+      ++remaining;
+      // Pixel offsets are exact in double however deep the zoom is.
+      d_r[b] = (static_cast<double>(pixel->x) - static_cast<double>(reference.x())) * step;
+      d_i[b] = (static_cast<double>(reference.y()) - static_cast<double>(pixel->y)) * step;
+    }
+    if (remaining == 0) {
+      return total_iters;
+    }
+
+    for (size_t n = 0; remaining > 0; ++n) {
+      reference.Step<N>(n, active, d_r, d_i, lane_glitched);
+      total_iters += remaining;
+      const ComplexD z_reference = reference.z(n + 1);
+      for (size_t b = 0; b < N; ++b) {
+	if (!active[b]) {
+	  continue;
+	}
+	if (lane_glitched[b]) {
+	  glitched->push_back(pixels[b]);
+	  active[b] = false;
+	  --remaining;
+	  continue;
+	}
+	const ComplexD z = z_reference + ComplexD(d_r[b], d_i[b]);
+	std::optional<size_t> zero_index;
+	if (n + 1 >= params.max_iters) {
+	  zero_index = p.ClosestZero(z);
+	} else {
+	  zero_index = p.GetZeroIndexIfConverged(z);
+	}
+	if (zero_index.has_value()) {
+	  PaintZero(image, pixels[b].x, pixels[b].y, params.colors, *zero_index);
+	  if (tile_iters != nullptr) {
+	    tile_iters->Add(pixels[b].x, pixels[b].y, n + 1);
+	  }
+	  active[b] = false;
+	  --remaining;
+	}
+      }
+    }
+  }
+}
+
+// Draws the given task rects of the image by perturbation, as described at the
+// top of this file. All the rects must be from the same image, since they share
+// references.
+template <size_t N>
+size_t PerturbationDraw(const FractalParams& params,
+			const std::vector<ImageRect>& tasks,
+			RGBImage& image,
+			ThreadPool& thread_pool,
+			CostMap* cost_map,
+			TaskPriority priority) {
+  if (tasks.empty()) {
+    return 0;
+  }
+  const AnalyzedPolynomialD p(params.zeros);
+  std::vector<Complex<ReferenceFloat>> reference_zeros;
+  for (const ComplexD& zero : params.zeros) {
+    reference_zeros.emplace_back(zero.r, zero.i);
+  }
+  const Polynomial<ReferenceFloat> reference_polynomial =
+    Polynomial<ReferenceFloat>::FromZeros(reference_zeros);
+
+  auto make_reference = [&](size_t x, size_t y) {
+    const uint64_t start_time = Now();
+    auto reference = std::make_unique<ReferenceOrbit>(params, reference_polynomial, p, x, y);
+    std::cout << "Reference orbit at (" << x << ", " << y << ") of " << reference->size()
+	      << " steps time (ms): " << (Now() - start_time) << std::endl;
+    return reference;
+  };
+
+  std::mutex m;
+  size_t total_iters = 0;
+  std::vector<PixelMetadata> glitched;
+
+  // First pass: everything, around a reference in the middle of the tasks.
+  ImageRect bounds = tasks[0];
+  for (const ImageRect& rect : tasks) {
+    bounds.x_min = std::min(bounds.x_min, rect.x_min);
+    bounds.x_max = std::max(bounds.x_max, rect.x_max);
+    bounds.y_min = std::min(bounds.y_min, rect.y_min);
+    bounds.y_max = std::max(bounds.y_max, rect.y_max);
+  }
+  std::unique_ptr<ReferenceOrbit> reference =
+    make_reference((bounds.x_min + bounds.x_max) / 2, (bounds.y_min + bounds.y_max) / 2);
+  {
+    TaskGroup task_group(&thread_pool, priority);
+    for (const ImageRect& task : tasks) {
+      task_group.Add([&, task]() {
+	std::vector<PixelMetadata> task_glitched;
+	std::optional<CostMap::TileCounter> tile_iters;
+	if (cost_map != nullptr) {
+	  tile_iters.emplace(task);
+	}
+	// Less urgent work goes a few rows at a time, like FillRegionYielding.
+	const size_t rows_per_tile =
+	  (priority == TaskPriority::INTERACTIVE) ? task.height() : 8; // TUNE.
+	size_t iters = 0;
+	for (size_t y_min = task.y_min; y_min < task.y_max; y_min += rows_per_tile) {
+	  ImageRect tile = task;
+	  tile.y_min = y_min;
+	  tile.y_max = std::min(y_min + rows_per_tile, task.y_max);
+	  size_t x = tile.x_min;
+	  size_t y = tile.y_min;
+	  iters += FillPixelsPerturbed<N>(
+	      params, p, *reference,
+	      [&]() -> std::optional<PixelMetadata> {
+		if (y >= tile.y_max) {
+		  return std::nullopt;
+		}
+		const PixelMetadata pixel = {.x = x, .y = y, .iteration_count = 0};
+		if (++x >= tile.x_max) {
+		  x = tile.x_min;
+		  ++y;
+		}
+		return pixel;
+	      },
+	      image, &task_glitched, tile_iters.has_value() ? &*tile_iters : nullptr);
+	  thread_pool.Yield(priority);
+	}
+	if (cost_map != nullptr) {
+	  cost_map->Record(*tile_iters);
+	}
+	std::scoped_lock lock(m);
+	total_iters += iters;
+	glitched.insert(glitched.end(), task_glitched.begin(), task_glitched.end());
+      });
+    }
+    task_group.WaitUntilDone();
+  }
+
+  // Then glitched pixels, around a reference among them: the one closest to
+  // their centroid. It can't glitch against itself, so each round makes
+  // progress.
+  constexpr size_t max_references = 8; // TUNE.
+  size_t references = 1;
+  size_t total_glitched = glitched.size();
+  while (!glitched.empty() && references < max_references) {
+    double x_sum = 0.0, y_sum = 0.0;
+    for (const PixelMetadata& pixel : glitched) {
+      x_sum += pixel.x;
+      y_sum += pixel.y;
+    }
+    const double x_mean = x_sum / glitched.size();
+    const double y_mean = y_sum / glitched.size();
+    const PixelMetadata* center = &glitched[0];
+    double center_sqr_distance = std::numeric_limits<double>::infinity();
+    for (const PixelMetadata& pixel : glitched) {
+      const double sqr_distance =
+	(pixel.x - x_mean) * (pixel.x - x_mean) + (pixel.y - y_mean) * (pixel.y - y_mean);
+      if (sqr_distance < center_sqr_distance) {
+	center_sqr_distance = sqr_distance;
+	center = &pixel;
+      }
+    }
+    reference = make_reference(center->x, center->y);
+    ++references;
+
+    std::vector<PixelMetadata> pixels;
+    pixels.swap(glitched);
+    TaskGroup task_group(&thread_pool, priority);
+    const size_t pixels_per_task = pixels.size() / thread_pool.size() + 1;
+    for (size_t begin = 0; begin < pixels.size(); begin += pixels_per_task) {
+      const size_t end = std::min(begin + pixels_per_task, pixels.size());
+      task_group.Add([&, begin, end]() {
+	std::vector<PixelMetadata> task_glitched;
+	size_t i = begin;
+	const size_t iters = FillPixelsPerturbed<N>(
+	    params, p, *reference,
+	    [&]() -> std::optional<PixelMetadata> {
+	      if (i >= end) {
+		return std::nullopt;
+	      }
+	      PixelMetadata pixel = pixels[i++];
+	      pixel.iteration_count = 0;
+	      return pixel;
+	    },
+	    image, &task_glitched, nullptr);
+	std::scoped_lock lock(m);
+	total_iters += iters;
+	glitched.insert(glitched.end(), task_glitched.begin(), task_glitched.end());
+      });
+    }
+    task_group.WaitUntilDone();
+    total_glitched += glitched.size();
+  }
+
+  // Whatever's left is drawn the slow way, split over the pool like the
+  // rounds above. Past what double-double can resolve, that's as a reference
+  // orbit, which is Newton's method at full precision.
+  const bool direct_double_double =
+    CanResolvePixels(params, std::numeric_limits<DoubleDouble>::epsilon().hi);
+  if (!glitched.empty() && !direct_double_double) {
+    TaskGroup task_group(&thread_pool, priority);
+    const size_t pixels_per_task = glitched.size() / thread_pool.size() + 1;
+    for (size_t begin = 0; begin < glitched.size(); begin += pixels_per_task) {
+      const size_t end = std::min(begin + pixels_per_task, glitched.size());
+      task_group.Add([&, begin, end]() {
+	size_t task_iters = 0;
+	for (size_t i = begin; i < end; ++i) {
+	  const PixelMetadata& pixel = glitched[i];
+	  const ReferenceOrbit orbit(params, reference_polynomial, p, pixel.x, pixel.y);
+	  PaintZero(image, pixel.x, pixel.y, params.colors,
+		    p.ClosestZero(orbit.z(orbit.size() - 1)));
+	  task_iters += orbit.size();
+	}
+	std::scoped_lock lock(m);
+	total_iters += task_iters;
+      });
+    }
+    task_group.WaitUntilDone();
+  } else if (!glitched.empty()) {
+    std::vector<Complex<DoubleDouble>> direct_zeros;
+    for (const ComplexD& zero : params.zeros) {
+      direct_zeros.emplace_back(zero.r, zero.i);
+    }
+    const AnalyzedPolynomial<DoubleDouble> p_direct(direct_zeros);
+    const DoubleDouble r_min = params.r_min_as<DoubleDouble>();
+    const DoubleDouble i_min = params.i_min_as<DoubleDouble>();
+    const double step = params.r_range / params.width;
+    TaskGroup task_group(&thread_pool, priority);
+    const size_t pixels_per_task = glitched.size() / thread_pool.size() + 1;
+    for (size_t begin = 0; begin < glitched.size(); begin += pixels_per_task) {
+      const size_t end = std::min(begin + pixels_per_task, glitched.size());
+      task_group.Add([&, begin, end]() {
+	size_t task_iters = 0;
+	for (size_t i = begin; i < end; ++i) {
+	  const PixelMetadata& pixel = glitched[i];
+	  size_t iters;
+	  const Complex<DoubleDouble> z(r_min + DoubleDouble(pixel.x * step),
+					i_min + DoubleDouble((params.height - 1 - pixel.y) * step));
+	  const Complex<DoubleDouble> result = Newton(p_direct, z, params.max_iters, &iters);
+	  PaintZero(image, pixel.x, pixel.y, params.colors, p_direct.ClosestZero(result));
+	  task_iters += iters;
+	}
+	std::scoped_lock lock(m);
+	total_iters += task_iters;
+      });
+    }
+    task_group.WaitUntilDone();
+  }
+  std::cout << "Perturbation used " << references << " references, redrew "
+	    << total_glitched << " glitched pixels, drew " << glitched.size()
+	    << " directly" << std::endl;
+  return total_iters;
+}
+
+#endif // _CROW_FRACTAL_SERVER_PERTURBATION_
@@ -10,10 +10,13 @@
 #include "response.h"
 #include "thread_pool.h"
 #include "synchronized_resource.h"
+#include "image_pool.h"
 
 class PipelinedHandler : public Handler {
  public:
-  explicit PipelinedHandler(ThreadPool* thread_pool) : thread_pool_(*thread_pool) {
+  explicit PipelinedHandler(ThreadPool* thread_pool)
+    : thread_pool_(*thread_pool),
+      image_pool_(/*max_free_bytes=*/256 << 20) {
     Start();
   }
 
@@ -29,27 +32,24 @@ class PipelinedHandler : public Handler {
     return crow::response(json);
   }
 
-  crow::response HandleFractalRequest(const FractalParams& params) {
+  std::optional<Frame> GetFrame(const FractalParams& params,
+				WaitCanceller* canceller = nullptr) override {
     SetSessionId(params.session_id);
-    std::cout << "HandleFractalRequest putting version: " << params.request_id << std::endl;
+    std::cout << "GetFrame putting version: " << params.request_id << std::endl;
     latest_params_.Set(params, /*version=*/params.request_id);
-    std::cout << "HandleFractalRequest waiting for above version: " << params.last_data_id << std::endl;
-    auto png = latest_png_.GetAboveVersion(params.last_data_id);
-    if (!png.has_value()) {
-      std::cout << "PNG resource is dead :(" << std::endl;
-      return crow::response(500);
+    std::cout << "GetFrame waiting for above version: " << params.last_data_id << std::endl;
+    auto frame = latest_frame_.GetAboveVersion(params.last_data_id, canceller);
+    if (!frame.has_value()) {
+      return std::nullopt;
     }
-
-    return ImageWithMetadata(**png,
-			     {{"data_id", png.version()},
-			      {"viewport_id", png.version()}});
+    return *frame;
   }
 
  private:
   void Start() {
     latest_params_.Reset();
     latest_image_.Reset();
-    latest_png_.Reset();
+    latest_frame_.Reset();
     computation_thread_ = std::make_unique<boost::thread>(&PipelinedHandler::ComputeLoop, this);
     encoding_thread_ = std::make_unique<boost::thread>(&PipelinedHandler::EncodeLoop, this);
   }
@@ -57,7 +57,7 @@ class PipelinedHandler : public Handler {
   void Stop() {
     latest_params_.Kill();
     latest_image_.Kill();
-    latest_png_.Kill();
+    latest_frame_.Kill();
     computation_thread_->join();
     encoding_thread_->join();
   }
@@ -78,6 +78,8 @@ class PipelinedHandler : public Handler {
     uint64_t latest_version = 0;
     std::optional<FractalParams> previous_params = std::nullopt;
     std::shared_ptr<RGBImage> previous_image = nullptr;
+    ScrollingImage scrolling_image;
+    CostMap cost_map;
 
     while (true) {
       std::cout << "ComputeLoop start, waiting for above version: " << latest_version << std::endl;
@@ -91,8 +93,21 @@ class PipelinedHandler : public Handler {
       std::cout << Now() << ": Start pipelined computation" << std::endl;
       const uint64_t start_time = Now();
 
-      // Set up the image.
-      auto image = std::make_shared<RGBImage>(input->width, input->height);
+      // Set up the image. Every pixel gets drawn, so no need to clear it.
+      auto image = image_pool_.Acquire(input->width, input->height, /*clear=*/false);
+      std::cout << "Image acquire time (ms): " << (Now() - start_time) << std::endl;
+
+      // If we can, encode bands of rows as soon as they're drawn, rather than
+      // leaving all the encoding to EncodeLoop. Not if the PNG is likely to go
+      // unused though.
+      std::optional<StreamingPngEncoder> streaming_encoder;
+      std::function<void(const FrameRows&, size_t, size_t)> on_rows_ready = nullptr;
+      if (!input->png_optional && SupportsStreamingEncode(*input)) {
+	streaming_encoder.emplace(image->get_width(), image->get_height(), &thread_pool_);
+	on_rows_ready = [&streaming_encoder](const FrameRows& rows, size_t y_begin, size_t y_end) {
+	  streaming_encoder->AddRows(rows, y_begin, y_end);
+	};
+      }
 
       // Draw the fractal.
       DrawFractalArgs args = {
@@ -101,14 +116,23 @@ class PipelinedHandler : public Handler {
 	.previous_params = previous_params,
 	.previous_image = previous_image.get(),
 	.thread_pool = thread_pool_,
+	.scrolling_image = &scrolling_image,
+	.on_rows_ready = on_rows_ready,
+	.cost_map = &cost_map,
       };
       const size_t total_iters = DrawFractal(args);
       const uint64_t end_time = Now();
       std::cout << "Total iterations: " << total_iters << std::endl;
       std::cout << "Computation time (ms): " << (end_time - start_time) << std::endl;
 
+      EncodedPng png = nullptr;
+      if (streaming_encoder.has_value()) {
+	png = std::make_shared<const std::string>(streaming_encoder->Finish());
+	std::cout << "Streaming PNG finish time (ms): " << (Now() - end_time) << std::endl;
+      }
+
       // Push out the results.
-      latest_image_.Set(std::make_pair(*input, image), /*version=*/input.version());
+      latest_image_.Set(std::make_tuple(*input, image, png), /*version=*/input.version());
       previous_image = image;
       previous_params = *input;
       latest_version = input.version();
@@ -126,22 +150,34 @@ class PipelinedHandler : public Handler {
 	std::cout << "Killing PipelinedHandler::EncodeLoop, image is dead" << std::endl;
 	return;
       }
-      const auto [params, image] = *input;
+      auto [params, image, png] = *input;
       std::cout << "EncodeLoop got version: " << input.version() << std::endl;
 
-      std::cout << Now() << ": Start pipelined encoding" << std::endl;
-      const uint64_t start_time = Now();
-
-      // Prepare the output string.
-      auto png = std::make_shared<std::string>();
-
-      // Encode to PNG.
-      *png = EncodePng(params, *image);
-      const uint64_t end_time = Now();
-      std::cout << "PNG encode time (ms): " << (end_time - start_time) << std::endl;
+      // Encode to PNG, unless ComputeLoop already did so while drawing, or the
+      // PNG is likely to go unused, in which case it's encoded if asked for.
+      std::shared_ptr<LazyPng> lazy_png;
+      if (png != nullptr) {
+	lazy_png = std::make_shared<LazyPng>(png);
+      } else if (params.png_optional) {
+	lazy_png = EncodePngLazily(params, image, thread_pool_);
+      } else {
+	std::cout << Now() << ": Start pipelined encoding" << std::endl;
+	const uint64_t start_time = Now();
+	lazy_png = std::make_shared<LazyPng>(
+	    std::make_shared<const std::string>(EncodePng(params, *image, thread_pool_)));
+	const uint64_t end_time = Now();
+	std::cout << "PNG encode time (ms): " << (end_time - start_time) << std::endl;
+      }
 
       // Push out the results.
-      latest_png_.Set(png, /*version=*/input.version());
+      latest_frame_.Set({
+	  .png = lazy_png,
+	  .data_id = input.version(),
+	  .viewport_id = input.version(),
+	  .precision = ResolvePrecision(params),
+	  .params = params,
+	  .image = image,
+	}, /*version=*/input.version());
       latest_version = input.version();
       std::cout << "EncodeLoop done" << std::endl;
     }
@@ -150,14 +186,18 @@ class PipelinedHandler : public Handler {
   // Unowned.
   ThreadPool& thread_pool_;
 
+  ImagePool image_pool_;
+
   std::string session_id_;
   std::unique_ptr<boost::thread> computation_thread_;
   std::unique_ptr<boost::thread> encoding_thread_;
 
   SynchronizedResource<FractalParams> latest_params_;
-  SynchronizedResource<std::pair<FractalParams,
-				 std::shared_ptr<RGBImage>>> latest_image_;
-  SynchronizedResource<std::shared_ptr<std::string>> latest_png_;
+  // The PNG is set if the image was already encoded as it was drawn.
+  SynchronizedResource<std::tuple<FractalParams,
+				  std::shared_ptr<RGBImage>,
+				  EncodedPng>> latest_image_;
+  SynchronizedResource<Frame> latest_frame_;
 };
 
 #endif // _CROW_FRACTAL_SERVER_PIPELINED_HANDLER_
@@ -0,0 +1,254 @@
+#ifndef _CROW_FRACTAL_SERVER_PNG_CHUNKS_
+#define _CROW_FRACTAL_SERVER_PNG_CHUNKS_
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+
+#include <zlib.h>
+#include <png++/png.hpp>
+
+// Helpers for the encoders that write PNG files by hand rather than going
+// through fpng or libpng.
+
+constexpr unsigned char kPngSignature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+// PNG color types.
+constexpr uint8_t kPngColorTypeRGB = 2;
+constexpr uint8_t kPngColorTypeIndexed = 3;
+
+// PNG filter types.
+constexpr unsigned char kPngFilterNone = 0;
+constexpr unsigned char kPngFilterUp = 2;
+
+void AppendBigEndian32(std::string* out, uint32_t value) {
+  out->push_back(static_cast<char>(value >> 24));
+  out->push_back(static_cast<char>(value >> 16));
+  out->push_back(static_cast<char>(value >> 8));
+  out->push_back(static_cast<char>(value));
+}
+
+void AppendChunk(std::string* out, const char* type, const std::string& data) {
+  AppendBigEndian32(out, data.size());
+  out->append(type, 4);
+  out->append(data);
+  uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(type), 4);
+  crc = crc32(crc, reinterpret_cast<const Bytef*>(data.data()), data.size());
+  AppendBigEndian32(out, crc);
+}
+
+void AppendPngHeader(std::string* out, uint32_t width, uint32_t height,
+		     uint8_t bit_depth, uint8_t color_type) {
+  out->append(reinterpret_cast<const char*>(kPngSignature), sizeof(kPngSignature));
+  std::string ihdr;
+  AppendBigEndian32(&ihdr, width);
+  AppendBigEndian32(&ihdr, height);
+  ihdr.push_back(static_cast<char>(bit_depth));
+  ihdr.push_back(static_cast<char>(color_type));
+  ihdr.push_back(0); // Compression method: deflate.
+  ihdr.push_back(0); // Filter method: adaptive.
+  ihdr.push_back(0); // Interlace method: none.
+  AppendChunk(out, "IHDR", ihdr);
+}
+
+// Writes the PLTE chunk for an indexed image.
+void AppendPalette(std::string* out, const std::vector<png::rgb_pixel>& palette) {
+  std::string plte;
+  for (const png::rgb_pixel& color : palette) {
+    plte.push_back(static_cast<char>(color.red));
+    plte.push_back(static_cast<char>(color.green));
+    plte.push_back(static_cast<char>(color.blue));
+  }
+  AppendChunk(out, "PLTE", plte);
+}
+
+// The smallest bit depth that can index a palette of the given size.
+uint8_t IndexedBitDepth(size_t palette_size) {
+  if (palette_size <= 2) {
+    return 1;
+  } else if (palette_size <= 4) {
+    return 2;
+  } else if (palette_size <= 16) {
+    return 4;
+  }
+  return 8;
+}
+
+// Packs a row of one byte indices into `bit_depth` bits each, most significant
+// bits first, as PNG wants. `out` must have room for
+// (width * bit_depth + 7) / 8 bytes.
+void PackIndexedRow(const uint8_t* indices, size_t width, uint8_t bit_depth, unsigned char* out) {
+  if (bit_depth == 8) {
+    std::copy(indices, indices + width, out);
+    return;
+  }
+  const size_t per_byte = 8 / bit_depth;
+  size_t x = 0;
+  for (; x + per_byte <= width; x += per_byte) {
+    unsigned char packed = 0;
+    for (size_t i = 0; i < per_byte; ++i) {
+      packed = (packed << bit_depth) | indices[x + i];
+    }
+    *out++ = packed;
+  }
+  if (x < width) {
+    // Partial last byte, padded with zeros on the right.
+    unsigned char packed = 0;
+    for (size_t i = 0; i < per_byte; ++i) {
+      packed = (packed << bit_depth) | (x + i < width ? indices[x + i] : 0);
+    }
+    *out = packed;
+  }
+}
+
+void AppendPngTrailer(std::string* out) {
+  AppendChunk(out, "IEND", "");
+}
+
+// One independently deflated piece of a zlib stream. Pieces other than the last
+// end in a sync flush, so they're byte aligned and can simply be concatenated.
+struct DeflatedPiece {
+  std::string data;
+
+  // Adler-32 and length of the uncompressed input.
+  uint32_t adler;
+  size_t raw_length;
+
+  // CRC-32 of `data`.
+  uint32_t crc;
+};
+
+DeflatedPiece DeflatePiece(const unsigned char* raw, size_t raw_length, bool last,
+			   int level, int strategy) {
+  DeflatedPiece piece;
+  piece.raw_length = raw_length;
+  piece.adler = adler32(adler32(0, nullptr, 0), raw, raw_length);
+
+  // Raw deflate (negative window bits); the zlib header and trailer are written
+  // once for the whole stream.
+  z_stream stream = {};
+  deflateInit2(&stream, level, Z_DEFLATED, -15, /*memLevel=*/8, strategy);
+  piece.data.resize(deflateBound(&stream, raw_length) + 16);
+  stream.next_in = const_cast<Bytef*>(raw);
+  stream.avail_in = raw_length;
+  stream.next_out = reinterpret_cast<Bytef*>(piece.data.data());
+  stream.avail_out = piece.data.size();
+  const int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+  while (deflate(&stream, flush) == Z_OK && stream.avail_out == 0) {
+    // Out of space (shouldn't happen given deflateBound), grow and continue.
+    const size_t used = piece.data.size();
+    piece.data.resize(used * 2);
+    stream.next_out = reinterpret_cast<Bytef*>(piece.data.data() + used);
+    stream.avail_out = used;
+  }
+  piece.data.resize(stream.total_out);
+  deflateEnd(&stream);
+
+  piece.crc = crc32(0, reinterpret_cast<const Bytef*>(piece.data.data()), piece.data.size());
+  return piece;
+}
+
+// Writes a single IDAT chunk holding a zlib stream made of the given pieces, in
+// order. The Adler-32 and CRC-32 are combined from the per-piece values rather
+// than recomputed over the whole stream.
+void AppendIdat(std::string* out, const std::vector<DeflatedPiece>& pieces) {
+  // zlib header: deflate with a 32K window, no preset dictionary.
+  const unsigned char zlib_header[2] = {0x78, 0x01};
+
+  size_t length = sizeof(zlib_header) + 4;
+  uint32_t adler = adler32(0, nullptr, 0);
+  for (const DeflatedPiece& piece : pieces) {
+    length += piece.data.size();
+    adler = adler32_combine(adler, piece.adler, piece.raw_length);
+  }
+  std::string adler_bytes;
+  AppendBigEndian32(&adler_bytes, adler);
+
+  AppendBigEndian32(out, length);
+  out->append("IDAT", 4);
+  out->append(reinterpret_cast<const char*>(zlib_header), sizeof(zlib_header));
+  uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>("IDAT"), 4);
+  crc = crc32(crc, zlib_header, sizeof(zlib_header));
+  for (const DeflatedPiece& piece : pieces) {
+    out->append(piece.data);
+    crc = crc32_combine(crc, piece.crc, piece.data.size());
+  }
+  out->append(adler_bytes);
+  crc = crc32(crc, reinterpret_cast<const Bytef*>(adler_bytes.data()), adler_bytes.size());
+  AppendBigEndian32(out, crc);
+}
+
+// Writes a zlib stream as a series of IDAT chunks, one per piece, so pieces can
+// be written out as soon as they're ready rather than all at once. Every piece
+// must end in a sync flush (i.e. not be the last); Finish() ends the stream.
+class IdatWriter {
+ public:
+  explicit IdatWriter(std::string* out)
+    : out_(*out) {}
+
+  void Append(const DeflatedPiece& piece) {
+    std::string prefix;
+    if (!started_) {
+      prefix = ZlibHeader();
+      started_ = true;
+    }
+    AppendBigEndian32(&out_, prefix.size() + piece.data.size());
+    out_.append("IDAT", 4);
+    out_.append(prefix);
+    out_.append(piece.data);
+    uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>("IDAT"), 4);
+    crc = crc32(crc, reinterpret_cast<const Bytef*>(prefix.data()), prefix.size());
+    crc = crc32_combine(crc, piece.crc, piece.data.size());
+    AppendBigEndian32(&out_, crc);
+    adler_ = adler32_combine(adler_, piece.adler, piece.raw_length);
+  }
+
+  void Finish() {
+    std::string data = started_ ? "" : ZlibHeader();
+    // An empty final block with fixed Huffman codes, then the Adler-32.
+    data.push_back(0x03);
+    data.push_back(0x00);
+    AppendBigEndian32(&data, adler_);
+    AppendChunk(&out_, "IDAT", data);
+  }
+
+ private:
+  static std::string ZlibHeader() {
+    // Deflate with a 32K window, no preset dictionary.
+    return std::string("\x78\x01", 2);
+  }
+
+  // Unowned.
+  std::string& out_;
+
+  bool started_ = false;
+  uint32_t adler_ = adler32(0, nullptr, 0);
+};
+
+// Filters rows [y_begin, y_end) of an image with `row_bytes` bytes per row
+// using the Up filter, writing filter byte + filtered row for each into `out`.
+// If `image_bytes` is one band of a taller image, `row_above` is the last row of
+// the band above it, if any.
+void FilterRowsUp(const unsigned char* image_bytes, size_t row_bytes,
+		  size_t y_begin, size_t y_end, std::vector<unsigned char>* out,
+		  const unsigned char* row_above = nullptr) {
+  out->resize((y_end - y_begin) * (row_bytes + 1));
+  unsigned char* dest = out->data();
+  for (size_t y = y_begin; y < y_end; ++y) {
+    const unsigned char* curr = image_bytes + y * row_bytes;
+    const bool first_row = (y == 0 && row_above == nullptr);
+    *dest++ = first_row ? kPngFilterNone : kPngFilterUp;
+    if (first_row) {
+      std::copy(curr, curr + row_bytes, dest);
+    } else {
+      const unsigned char* prev = (y == 0) ? row_above : curr - row_bytes;
+      for (size_t i = 0; i < row_bytes; ++i) {
+	dest[i] = curr[i] - prev[i];
+      }
+    }
+    dest += row_bytes;
+  }
+}
+
+#endif // _CROW_FRACTAL_SERVER_PNG_CHUNKS_
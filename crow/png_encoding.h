@@ -1,17 +1,60 @@
 #ifndef _CROW_FRACTAL_SERVER_PNG_ENCODING_
 #define _CROW_FRACTAL_SERVER_PNG_ENCODING_
 
+#include <deque>
 #include <vector>
 #include <string>
+#include <memory>
+#include <mutex>
+#include <functional>
 #include <optional>
 #include <sstream>
+#include <iostream>
 
 #include <png++/png.hpp>
 
 #include "fpng/fpng.h"
 
 #include "rgb_image.h"
+#include "indexed_image.h"
+#include "scrolling_image.h"
 #include "fractal_params.h"
+#include "png_chunks.h"
+#include "thread_pool.h"
+#include "task_group.h"
+#include "development_utils.h"
+
+// An encoded frame. Immutable, so one buffer can be shared by everything that
+// needs it without copies.
+using EncodedPng = std::shared_ptr<const std::string>;
+
+// A frame's PNG, encoded the first time it's asked for, unless it already was
+// (e.g. as the frame was drawn). That way frames that go out as pan deltas
+// (see FrameStream) are never encoded whole. Safe to share between threads,
+// and only ever encodes once.
+class LazyPng {
+ public:
+  explicit LazyPng(EncodedPng png)
+    : png_(std::move(png)) {}
+
+  explicit LazyPng(std::function<std::string()> encode)
+    : encode_(std::move(encode)) {}
+
+  EncodedPng Get() {
+    std::call_once(encoded_, [this]() {
+      if (png_ == nullptr) {
+	png_ = std::make_shared<const std::string>(encode_());
+      }
+      encode_ = nullptr;
+    });
+    return png_;
+  }
+
+ private:
+  std::once_flag encoded_;
+  std::function<std::string()> encode_;
+  EncodedPng png_;
+};
 
 std::string EncodeWithPngPlusPlus(RGBImage& image) {
   std::ostringstream ss;
@@ -20,13 +63,200 @@ std::string EncodeWithPngPlusPlus(RGBImage& image) {
 }
 
 std::string EncodeWithFPng(RGBImage& image) {
-  const void* image_bytes = image.get_pixbuf().get_bytes().data();
-  std::vector<uint8_t> encoded;
+  const void* image_bytes = image.get_pixbuf().data();
+  std::string encoded;
   fpng::fpng_encode_image_to_memory(image_bytes, image.get_width(), image.get_height(), /*num_channels=*/3, encoded);
-  return std::string(encoded.begin(), encoded.end());
+  return encoded;
+}
+
+// Deflates filtered RGB rows with fpng's single pass compressor. `filtered`
+// must have a few bytes of padding past `rows` rows, as fpng reads pixels four
+// bytes at a time.
+DeflatedPiece DeflatePieceWithFPng(const std::vector<unsigned char>& filtered, size_t width,
+				   size_t rows, bool last) {
+  const size_t raw_length = rows * (3 * width + 1);
+  DeflatedPiece piece;
+  fpng::fpng_deflate_filtered_rows_rgb(filtered.data(), width, rows, /*final_block=*/last, piece.data);
+  piece.raw_length = raw_length;
+  piece.adler = fpng::fpng_adler32(filtered.data(), raw_length);
+  piece.crc = crc32(0, reinterpret_cast<const Bytef*>(piece.data.data()), piece.data.size());
+  return piece;
+}
+
+// As FilterRowsUp, for rows [y_begin, y_end) of a frame. Rows are read one at a
+// time, so a frame in a ScrollingImage's ring buffer is never copied out whole.
+void FilterFrameRowsUp(const FrameRows& rows, size_t y_begin, size_t y_end,
+		       std::vector<unsigned char>* out) {
+  const size_t row_bytes = 3 * rows.get_width();
+  out->resize((y_end - y_begin) * (row_bytes + 1));
+  unsigned char* dest = out->data();
+  // Rows read into scratch stay there for one more row, as the row above.
+  std::vector<png::rgb_pixel> scratch(rows.get_width());
+  std::vector<png::rgb_pixel> scratch_above(rows.get_width());
+  const unsigned char* above = y_begin == 0 ? nullptr :
+    reinterpret_cast<const unsigned char*>(rows.PeekRow(y_begin - 1, scratch_above.data()));
+  for (size_t y = y_begin; y < y_end; ++y) {
+    const unsigned char* curr = reinterpret_cast<const unsigned char*>(rows.Row(y, scratch.data()));
+    *dest++ = above == nullptr ? kPngFilterNone : kPngFilterUp;
+    if (above == nullptr) {
+      std::copy(curr, curr + row_bytes, dest);
+    } else {
+      for (size_t i = 0; i < row_bytes; ++i) {
+	dest[i] = curr[i] - above[i];
+      }
+    }
+    dest += row_bytes;
+    above = curr;
+    std::swap(scratch, scratch_above);
+  }
+}
+
+// Splits the frame into horizontal stripes, then filters and deflates each one
+// on the thread pool with fpng's compressor. Its matches never reach further
+// back than one pixel, so the stripes compress just as well independently, and
+// are stitched back together into a single IDAT stream.
+std::string EncodeWithParallelPng(const FrameRows& rows, ThreadPool& thread_pool,
+				  TaskPriority priority = TaskPriority::INTERACTIVE) {
+  const size_t width = rows.get_width();
+  const size_t height = rows.get_height();
+
+  constexpr size_t stripes_per_thread = 2; // TUNE.
+  const size_t stripes = std::min(height, thread_pool.size() * stripes_per_thread);
+  const size_t rows_per_stripe = (height + stripes - 1) / stripes;
+
+  std::vector<DeflatedPiece> pieces((height + rows_per_stripe - 1) / rows_per_stripe);
+  TaskGroup task_group(&thread_pool, priority);
+  for (size_t i = 0; i < pieces.size(); ++i) {
+    task_group.Add([i, rows_per_stripe, height, width, &rows, &pieces]() {
+      const size_t y_begin = i * rows_per_stripe;
+      const size_t y_end = std::min(y_begin + rows_per_stripe, height);
+      std::vector<unsigned char> filtered;
+      FilterFrameRowsUp(rows, y_begin, y_end, &filtered);
+      filtered.resize(filtered.size() + 4);
+      pieces[i] = DeflatePieceWithFPng(filtered, width, y_end - y_begin,
+				       /*last=*/(i == pieces.size() - 1));
+    });
+  }
+  task_group.WaitUntilDone();
+
+  std::string png;
+  AppendPngHeader(&png, width, height, /*bit_depth=*/8, kPngColorTypeRGB);
+  AppendIdat(&png, pieces);
+  AppendPngTrailer(&png);
+  return png;
+}
+
+// Encodes palette indices (one byte per pixel, row after row) as a palettized
+// PNG, packing them into as few bits as the palette allows. Frames are mostly
+// long runs of a single index, so the Up filter plus zlib's cheap RLE strategy
+// does most of the work.
+std::string EncodeIndexedPng(const uint8_t* indices, size_t width, size_t height,
+			     const std::vector<png::rgb_pixel>& palette, ThreadPool& thread_pool,
+			     TaskPriority priority = TaskPriority::INTERACTIVE) {
+  const uint8_t bit_depth = IndexedBitDepth(palette.size());
+  const size_t row_bytes = (width * bit_depth + 7) / 8;
+
+  constexpr size_t stripes_per_thread = 2; // TUNE.
+  const size_t stripes = std::min(height, thread_pool.size() * stripes_per_thread);
+  const size_t rows_per_stripe = (height + stripes - 1) / stripes;
+  const size_t num_pieces = (height + rows_per_stripe - 1) / rows_per_stripe;
+
+  // Pack every row first, since filtering a stripe needs the last row of the
+  // stripe before it. At 8 bits the indices are already packed.
+  std::vector<unsigned char> packed;
+  const unsigned char* packed_bytes = indices;
+  if (bit_depth != 8) {
+    packed.resize(height * row_bytes);
+    TaskGroup task_group(&thread_pool, priority);
+    for (size_t i = 0; i < num_pieces; ++i) {
+      task_group.Add([i, rows_per_stripe, height, width, bit_depth, row_bytes, indices, &packed]() {
+	const size_t y_end = std::min((i + 1) * rows_per_stripe, height);
+	for (size_t y = i * rows_per_stripe; y < y_end; ++y) {
+	  PackIndexedRow(indices + y * width, width, bit_depth, &packed[y * row_bytes]);
+	}
+      });
+    }
+    task_group.WaitUntilDone();
+    packed_bytes = packed.data();
+  }
+
+  std::vector<DeflatedPiece> pieces(num_pieces);
+  TaskGroup task_group(&thread_pool, priority);
+  for (size_t i = 0; i < num_pieces; ++i) {
+    task_group.Add([i, rows_per_stripe, height, row_bytes, packed_bytes, &pieces]() {
+      const size_t y_begin = i * rows_per_stripe;
+      const size_t y_end = std::min(y_begin + rows_per_stripe, height);
+      std::vector<unsigned char> filtered;
+      FilterRowsUp(packed_bytes, row_bytes, y_begin, y_end, &filtered);
+      pieces[i] = DeflatePiece(filtered.data(), filtered.size(),
+			       /*last=*/(i == pieces.size() - 1),
+			       /*level=*/1, /*strategy=*/Z_RLE);
+    });
+  }
+  task_group.WaitUntilDone();
+
+  std::string png;
+  AppendPngHeader(&png, width, height, bit_depth, kPngColorTypeIndexed);
+  AppendPalette(&png, palette);
+  AppendIdat(&png, pieces);
+  AppendPngTrailer(&png);
+  return png;
+}
+
+// Encodes a frame the same way as EncodeWithParallelPng, but a band of rows at
+// a time, so that encoding can overlap with drawing the rest of the frame. So
+// that bands don't wait for the whole frame's drawing tasks to get through the
+// pool first, they're encoded at a more urgent priority than the drawing.
+class StreamingPngEncoder {
+ public:
+  // The thread pool must outlive the encoder.
+  StreamingPngEncoder(size_t width, size_t height, ThreadPool* thread_pool,
+		      TaskPriority priority = TaskPriority::FINISHING)
+    : task_group_(thread_pool, priority), idat_writer_(&png_) {
+    AppendPngHeader(&png_, width, height, /*bit_depth=*/8, kPngColorTypeRGB);
+  }
+
+  // Queues rows [y_begin, y_end) of `rows` for encoding. Rows must be added in
+  // order, once they (and the rows above them) are final, and stay put until
+  // Finish() returns.
+  void AddRows(const FrameRows& rows, size_t y_begin, size_t y_end) {
+    // Deque elements don't move as more are added, so tasks can write in place.
+    DeflatedPiece* piece = &pieces_.emplace_back();
+    task_group_.Add([rows, y_begin, y_end, piece]() {
+      std::vector<unsigned char> filtered;
+      FilterFrameRowsUp(rows, y_begin, y_end, &filtered);
+      filtered.resize(filtered.size() + 4);
+      *piece = DeflatePieceWithFPng(filtered, rows.get_width(), y_end - y_begin, /*last=*/false);
+    }, /*band=*/pieces_.size() - 1);
+  }
+
+  // Waits for the queued rows to be encoded and returns the whole PNG.
+  std::string Finish() {
+    for (size_t i = 0; i < pieces_.size(); ++i) {
+      task_group_.WaitForBand(i);
+      idat_writer_.Append(pieces_[i]);
+    }
+    idat_writer_.Finish();
+    AppendPngTrailer(&png_);
+    return std::move(png_);
+  }
+
+ private:
+  TaskGroup task_group_;
+
+  std::deque<DeflatedPiece> pieces_;
+  std::string png_;
+  IdatWriter idat_writer_;
+};
+
+// Whether frames with these params can be encoded with StreamingPngEncoder
+// while they're drawn.
+bool SupportsStreamingEncode(const FractalParams& params) {
+  return params.png_encoder == PngEncoder::PARALLEL;
 }
 
-std::string EncodePng(const FractalParams& params, RGBImage& image) {
+std::string EncodePng(const FractalParams& params, RGBImage& image, ThreadPool& thread_pool,
+		      TaskPriority priority = TaskPriority::INTERACTIVE) {
   std::string png;
   switch (params.png_encoder.value_or(PngEncoder::FPNG)) {
   case PngEncoder::PNGPP:
@@ -35,8 +265,42 @@ std::string EncodePng(const FractalParams& params, RGBImage& image) {
   case PngEncoder::FPNG:
     png = EncodeWithFPng(image);
     break;
+  case PngEncoder::PARALLEL:
+    png = EncodeWithParallelPng(image, thread_pool, priority);
+    break;
+  case PngEncoder::INDEXED: {
+    // Drawn frames come with the index of every pixel's zero (see
+    // KeepsPaletteIndices). Others, e.g. laid out frames, have to be looked up
+    // in the palette, falling back to RGB if some pixel isn't a zero's color.
+    if (const uint8_t* indices = image.get_pixbuf().palette_indices()) {
+      png = EncodeIndexedPng(indices, image.get_width(), image.get_height(), params.colors,
+			     thread_pool, priority);
+      break;
+    }
+    std::optional<IndexedImage> indexed = IndexedImage::FromRGB(image, params.colors);
+    if (indexed.has_value()) {
+      png = EncodeIndexedPng((*indexed)[0], indexed->get_width(), indexed->get_height(),
+			     indexed->palette(), thread_pool, priority);
+    } else {
+      png = EncodeWithFPng(image);
+    }
+    break;
+  }
   }
   return png;
 }
 
+// Leaves the image to be encoded with EncodePng() when its PNG is first asked
+// for, if ever.
+std::shared_ptr<LazyPng> EncodePngLazily(const FractalParams& params,
+					 std::shared_ptr<RGBImage> image,
+					 ThreadPool& thread_pool) {
+  return std::make_shared<LazyPng>([params, image, &thread_pool]() {
+    const uint64_t start_time = Now();
+    std::string png = EncodePng(params, *image, thread_pool);
+    std::cout << "Lazy PNG encode time (ms): " << (Now() - start_time) << std::endl;
+    return png;
+  });
+}
+
 #endif // _CROW_FRACTAL_SERVER_PNG_ENCODING_
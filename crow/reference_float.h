@@ -0,0 +1,49 @@
+#ifndef _CROW_FRACTAL_SERVER_REFERENCE_FLOAT_
+#define _CROW_FRACTAL_SERVER_REFERENCE_FLOAT_
+
+#include <string>
+#include <limits>
+#include <stdexcept>
+
+#include <boost/multiprecision/cpp_bin_float.hpp>
+
+#include "double_double.h"
+
+// Decimal digits for view origins past double-double, and for the reference
+// orbits that perturbation draws them with (see perturbation.h). Views are
+// only drawn at depths that leave headroom for an orbit to lose a few digits
+// along the way, see ChoosePrecision().
+constexpr unsigned kReferenceDigits = 50;
+
+using ReferenceFloat = boost::multiprecision::number<
+  boost::multiprecision::cpp_bin_float<kReferenceDigits>,
+  boost::multiprecision::et_off>;
+
+template <>
+ReferenceFloat FromHighAndLow<ReferenceFloat>(double high, double low) {
+  return ReferenceFloat(high) + ReferenceFloat(low);
+}
+
+// Parses a decimal number, e.g. "-1.5626000000000000000000000000000000000031", to
+// ReferenceFloat precision. Returns false if it isn't a finite number.
+bool ToFiniteReferenceFloat(const char* c_str, ReferenceFloat* output) {
+  const std::string s(c_str);
+  // Boost also reads "inf", "nan" and hex, none of which a view origin is.
+  if (s.empty() ||
+      s.find_first_not_of("0123456789+-.eE") != std::string::npos) {
+    return false;
+  }
+  ReferenceFloat num;
+  try {
+    num = ReferenceFloat(s);
+  } catch (std::runtime_error const& ex) {
+    return false;
+  }
+  if (!boost::multiprecision::isfinite(num)) {
+    return false;
+  }
+  *output = num;
+  return true;
+}
+
+#endif // _CROW_FRACTAL_SERVER_REFERENCE_FLOAT_
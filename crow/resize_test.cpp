@@ -1,39 +1,95 @@
+#include <iostream>
+#include <cstdlib>
+
 #include "image_operations.h"
+#include "development_utils.h"
+
+// Returns the largest per-channel difference between the two images.
+int MaxDifference(const RGBImage& a, const RGBImage& b) {
+  int max_diff = 0;
+  for (size_t y = 0; y < a.get_height(); ++y) {
+    for (size_t x = 0; x < a.get_width(); ++x) {
+      max_diff = std::max(max_diff, std::abs(a[y][x].red - b[y][x].red));
+      max_diff = std::max(max_diff, std::abs(a[y][x].green - b[y][x].green));
+      max_diff = std::max(max_diff, std::abs(a[y][x].blue - b[y][x].blue));
+    }
+  }
+  return max_diff;
+}
+
+void Benchmark(const std::string& name, const RGBImage& from, size_t to_width, size_t to_height,
+	       const ImageOverlap& overlap, ThreadPool& thread_pool) {
+  constexpr int kIterations = 20;
+  RGBImage serial(to_width, to_height);
+  RGBImage parallel(to_width, to_height);
+
+  uint64_t start_time = Now();
+  for (int i = 0; i < kIterations; ++i) {
+    ResizeBilinear(from, serial, overlap);
+  }
+  const double serial_ms = 1.0 * (Now() - start_time) / kIterations;
+
+  start_time = Now();
+  for (int i = 0; i < kIterations; ++i) {
+    ResizeBilinearParallel(from, parallel, overlap, thread_pool);
+  }
+  const double parallel_ms = 1.0 * (Now() - start_time) / kIterations;
+
+  std::cout << name << ": ResizeBilinear (ms): " << serial_ms
+	    << ", ResizeBilinearParallel (ms): " << parallel_ms
+	    << ", max channel difference: " << MaxDifference(serial, parallel) << std::endl;
+  parallel.write("resize_test_output_" + name + ".png");
+}
 
 int main() {
   RGBImage from("images/a.png");
-  RGBImage to(2000, 1000);
-
-  ImageOverlap overlap = {
-    .a_region = {
-      .x_min = from.get_width() / 2,
-      .x_max = from.get_width(),
-      .y_min = 0,
-      .y_max = from.get_height() / 2,
-    },
-    .b_region = {
-      .x_min = 500,
-      .x_max = 1000,
-      .y_min = 250,
-      .y_max = 750,
-    },
-  };
-
-  // ImageOverlap overlap = {
-  //   .a_region = {
-  //     .x_min = from.get_width() / 2,
-  //     .x_max = from.get_width(),
-  //     .y_min = 0,
-  //     .y_max = from.get_height() / 2,
-  //   },
-  //   .b_region = {
-  //     .x_min = 0,
-  //     .x_max = to.get_width(),
-  //     .y_min = 0,
-  //     .y_max = to.get_height(),
-  //   },
-  // };
-
-  ResizeBilinear(from, to, overlap);
-  to.write("resize_test_output.png");
+  ThreadPool thread_pool(/*num_threads=*/7);
+
+  // Zoom in on a quarter of the source.
+  Benchmark("zoom_in", from, 2000, 1000, {
+      .a_region = {
+	.x_min = from.get_width() / 2,
+	.x_max = from.get_width(),
+	.y_min = 0,
+	.y_max = from.get_height() / 2,
+      },
+      .b_region = {
+	.x_min = 500,
+	.x_max = 1000,
+	.y_min = 250,
+	.y_max = 750,
+      },
+    }, thread_pool);
+
+  // Blow a quarter of the source up to a full 4K frame.
+  Benchmark("zoom_in_4k", from, 3840, 2160, {
+      .a_region = {
+	.x_min = from.get_width() / 2,
+	.x_max = from.get_width(),
+	.y_min = 0,
+	.y_max = from.get_height() / 2,
+      },
+      .b_region = {
+	.x_min = 0,
+	.x_max = 3840,
+	.y_min = 0,
+	.y_max = 2160,
+      },
+    }, thread_pool);
+
+  // Shrink the whole source into the middle of a 4K frame.
+  Benchmark("zoom_out_4k", from, 3840, 2160, {
+      .a_region = {
+	.x_min = 0,
+	.x_max = from.get_width(),
+	.y_min = 0,
+	.y_max = from.get_height(),
+      },
+      .b_region = {
+	.x_min = 960,
+	.x_max = 2880,
+	.y_min = 540,
+	.y_max = 1620,
+      },
+    }, thread_pool);
 }
@@ -6,37 +6,22 @@
 
 #include <crow.h>
 
-crow::response ImageWithMetadata(std::string png_contents,
-				 const crow::json::wvalue& metadata) {
-
-  crow::multipart::part png_part;
-  png_part.body = std::move(png_contents);
-  {
-    crow::multipart::header content_type_header;
-    content_type_header.value = "image/png";
-    crow::multipart::header content_disposition_header;
-    content_disposition_header.value = "form-data";
-    content_disposition_header.params["name"] = "fractal_image";
-    content_disposition_header.params["filename"] = "fractal_image.png";
-    png_part.headers.emplace("Content-Type", content_type_header);
-    png_part.headers.emplace("Content-Disposition", content_disposition_header);
-  }
+#include "fractal_params.h"
 
-  crow::multipart::part metadata_part;
-  metadata_part.body = metadata.dump();
-  {
-    crow::multipart::header content_type_header;
-    content_type_header.value = "application/json";
-    crow::multipart::header content_disposition_header;
-    content_disposition_header.value = "form-data";
-    content_disposition_header.params["name"] = "metadata";
-    metadata_part.headers.emplace("Content-Type", content_type_header);
-    metadata_part.headers.emplace("Content-Disposition", content_disposition_header);
-  }
-
-  return crow::response(crow::multipart::message(/*header=*/{},
-						 /*boudary=*/"CROW-BOUNDARY",
-						 /*parts=*/{png_part, metadata_part}));
+// Responds with the PNG as the entire body and the ids (and precision) describing
+// it in headers, so the PNG is copied into the response at most once and never
+// re-serialized around other parts.
+crow::response ImageWithMetadata(std::string png_contents,
+				 size_t data_id,
+				 size_t viewport_id,
+				 Precision precision) {
+  crow::response response;
+  response.body = std::move(png_contents);
+  response.set_header("Content-Type", "image/png");
+  response.set_header("X-Data-Id", std::to_string(data_id));
+  response.set_header("X-Viewport-Id", std::to_string(viewport_id));
+  response.set_header("X-Precision", ToString(precision));
+  return response;
 }
 
 #endif // _CROW_FRACTAL_SERVER_RESPONSE_
@@ -1,8 +1,184 @@
 #ifndef _CROW_FRACTAL_SERVER_RGB_IMAGE_
 #define _CROW_FRACTAL_SERVER_RGB_IMAGE_
 
+#include <memory>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
 #include <png++/png.hpp>
 
-using RGBImage = png::image<png::rgb_pixel, png::solid_pixel_buffer<png::rgb_pixel>>;
+// Like png::solid_pixel_buffer (one contiguous block of pixels, row after row),
+// but can be sized without zero-filling the pixels. Frames are drawn over in
+// full, so filling them first is wasted work, and it touches every page before
+// ImagePool gets the chance to ask for huge pages for them.
+//
+// Can also keep, alongside the pixels, the palette index that each pixel was
+// painted with (see PaintZero()). Frames are painted in the zeros' colors, so
+// an indexed encoder can take the indices as drawn rather than looking each
+// pixel's color back up in the palette.
+//
+// Implements the parts of png++'s pixel buffer interface that png::image uses.
+template <typename Pixel>
+class FramePixelBuffer {
+ public:
+  struct row_traits {
+    typedef Pixel* row_access;
+    typedef const Pixel* row_const_access;
+
+    static png::byte* get_data(row_access row) {
+      return reinterpret_cast<png::byte*>(row);
+    }
+  };
+  typedef typename row_traits::row_access row_access;
+  typedef typename row_traits::row_const_access row_const_access;
+  typedef row_access row_type;
+
+  FramePixelBuffer() {}
+
+  FramePixelBuffer(png::uint_32 width, png::uint_32 height) {
+    resize(width, height);
+  }
+
+  FramePixelBuffer(const FramePixelBuffer& other) {
+    *this = other;
+  }
+
+  FramePixelBuffer& operator=(const FramePixelBuffer& other) {
+    if (this != &other) {
+      Allocate(other.width_, other.height_);
+      std::memcpy(pixels_.get(), other.pixels_.get(), size_bytes());
+      KeepPaletteIndices(other.keep_indices_);
+      if (keep_indices_) {
+	std::memcpy(indices_.get(), other.indices_.get(), size_t(width_) * height_);
+      }
+    }
+    return *this;
+  }
+
+  FramePixelBuffer(FramePixelBuffer&&) = default;
+  FramePixelBuffer& operator=(FramePixelBuffer&&) = default;
+
+  png::uint_32 get_width() const {
+    return width_;
+  }
+
+  png::uint_32 get_height() const {
+    return height_;
+  }
+
+  // Zero-fills, like png::solid_pixel_buffer, unless set_zero_fill(false).
+  // Stops keeping palette indices.
+  void resize(png::uint_32 width, png::uint_32 height) {
+    Allocate(width, height);
+    keep_indices_ = false;
+    if (zero_fill_) {
+      std::memset(pixels_.get(), 0, size_bytes());
+    }
+  }
+
+  // Whether resize() (and so png::image::resize()) zero-fills the pixels. If
+  // not, they're left unspecified.
+  void set_zero_fill(bool zero_fill) {
+    zero_fill_ = zero_fill;
+  }
+
+  row_access get_row(size_t index) {
+    return reinterpret_cast<row_access>(pixels_.get()) + index * width_;
+  }
+
+  row_const_access get_row(size_t index) const {
+    return reinterpret_cast<row_const_access>(pixels_.get()) + index * width_;
+  }
+
+  row_access operator[](size_t index) {
+    return get_row(index);
+  }
+
+  row_const_access operator[](size_t index) const {
+    return get_row(index);
+  }
+
+  void put_row(size_t index, row_const_access row) {
+    std::copy(row, row + width_, get_row(index));
+  }
+
+  Pixel get_pixel(size_t x, size_t y) const {
+    return get_row(y)[x];
+  }
+
+  void set_pixel(size_t x, size_t y, Pixel pixel) {
+    get_row(y)[x] = pixel;
+  }
+
+  // All the pixels, row after row.
+  const png::byte* data() const {
+    return pixels_.get();
+  }
+
+  // Starts or stops keeping palette indices. Once started, they're
+  // unspecified until every pixel has been painted with SetIndexedPixel().
+  void KeepPaletteIndices(bool keep) {
+    keep_indices_ = keep;
+    const size_t pixels = size_t(width_) * height_;
+    if (keep && (indices_ == nullptr || indices_pixels_ != pixels)) {
+      // Default initialized, i.e. not filled.
+      indices_.reset(new uint8_t[std::max<size_t>(pixels, 1)]);
+      indices_pixels_ = pixels;
+    }
+  }
+
+  // The palette index of each pixel, row after row, or null if they're not
+  // being kept.
+  const uint8_t* palette_indices() const {
+    return keep_indices_ ? indices_.get() : nullptr;
+  }
+
+  uint8_t* palette_indices() {
+    return keep_indices_ ? indices_.get() : nullptr;
+  }
+
+  // Sets the pixel, and its palette index if they're being kept.
+  void SetIndexedPixel(size_t x, size_t y, Pixel pixel, uint8_t index) {
+    get_row(y)[x] = pixel;
+    if (keep_indices_) {
+      indices_[y * width_ + x] = index;
+    }
+  }
+
+  size_t size_bytes() const {
+    return size_t(width_) * height_ * sizeof(Pixel);
+  }
+
+ private:
+  void Allocate(png::uint_32 width, png::uint_32 height) {
+    const size_t old_bytes = size_bytes();
+    width_ = width;
+    height_ = height;
+    if (size_bytes() != old_bytes || pixels_ == nullptr) {
+      // Default initialized, i.e. not filled.
+      pixels_.reset(new png::byte[std::max<size_t>(size_bytes(), 1)]);
+    }
+  }
+
+  png::uint_32 width_ = 0;
+  png::uint_32 height_ = 0;
+  bool zero_fill_ = true;
+  std::unique_ptr<png::byte[]> pixels_;
+
+  bool keep_indices_ = false;
+  size_t indices_pixels_ = 0;
+  std::unique_ptr<uint8_t[]> indices_;
+};
+
+using RGBImage = png::image<png::rgb_pixel, FramePixelBuffer<png::rgb_pixel>>;
+
+// Paints pixel (x, y) the color of the zero it goes to, keeping the zero's
+// index too if the image keeps palette indices.
+void PaintZero(RGBImage& image, size_t x, size_t y,
+	       const std::vector<png::rgb_pixel>& colors, size_t zero_index) {
+  image.get_pixbuf().SetIndexedPixel(x, y, colors[zero_index], zero_index);
+}
 
 #endif // _CROW_FRACTAL_SERVER_RGB_IMAGE_
@@ -0,0 +1,319 @@
+#ifndef _CROW_FRACTAL_SERVER_SAVE_JOBS_
+#define _CROW_FRACTAL_SERVER_SAVE_JOBS_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include <boost/thread.hpp>
+
+#include "fractal_params.h"
+#include "fractal_drawing.h"
+#include "png_chunks.h"
+#include "png_encoding.h"
+#include "rgb_image.h"
+#include "thread_pool.h"
+#include "development_utils.h"
+
+// Saves render in the background, one at a time, a band of rows at a time.
+// Each band is encoded and written straight to the PNG on disk before the next
+// is drawn, so memory use depends on the width of the output but not its
+// height. Drawing is BULK priority, so saves only use what live frames leave.
+class SaveJobQueue {
+ public:
+  enum class State { QUEUED, RUNNING, DONE, FAILED, CANCELLED };
+
+  struct Status {
+    State state = State::QUEUED;
+    size_t rows_done = 0;
+    size_t total_rows = 0;
+    // Where the PNG goes, without the extension.
+    std::string base_path;
+    std::string error_message;
+  };
+
+  // The thread pool must outlive the queue.
+  explicit SaveJobQueue(ThreadPool* thread_pool)
+    : thread_pool_(*thread_pool),
+      worker_(&SaveJobQueue::WorkLoop, this) {}
+
+  ~SaveJobQueue() {
+    {
+      std::scoped_lock lock(m_);
+      stopping_ = true;
+      for (auto& [id, job] : jobs_) {
+	job->cancelled = true;
+      }
+    }
+    cv_.notify_all();
+    worker_.join();
+  }
+
+  // Queues a save of `params` (already scaled up) to base_path + ".png", with
+  // `metadata` alongside. Returns the job id.
+  size_t Submit(const FractalParams& params, const std::string& base_path,
+		const std::string& metadata, const std::string& metadata_path) {
+    auto job = std::make_shared<Job>();
+    job->params = params;
+    job->metadata = metadata;
+    job->metadata_path = metadata_path;
+    job->status.base_path = base_path;
+    job->status.total_rows = params.height;
+    size_t id;
+    {
+      std::scoped_lock lock(m_);
+      id = next_id_++;
+      jobs_[id] = job;
+      queue_.push_back(job);
+      ForgetOldJobs();
+    }
+    cv_.notify_all();
+    std::cout << "Save job " << id << " queued: " << base_path << std::endl;
+    return id;
+  }
+
+  std::optional<Status> GetStatus(size_t id) {
+    std::scoped_lock lock(m_);
+    auto it = jobs_.find(id);
+    if (it == jobs_.end()) {
+      return std::nullopt;
+    }
+    return it->second->status;
+  }
+
+  // Asks a job to stop. Returns false if there's no such job, or it's already
+  // finished.
+  bool Cancel(size_t id) {
+    std::scoped_lock lock(m_);
+    auto it = jobs_.find(id);
+    if (it == jobs_.end()) {
+      return false;
+    }
+    Job& job = *it->second;
+    if (job.status.state != State::QUEUED && job.status.state != State::RUNNING) {
+      return false;
+    }
+    job.cancelled = true;
+    if (job.status.state == State::QUEUED) {
+      job.status.state = State::CANCELLED;
+    }
+    return true;
+  }
+
+ private:
+  struct Job {
+    FractalParams params;
+    std::string metadata;
+    std::string metadata_path;
+    std::atomic<bool> cancelled = false;
+
+    // Guarded by the queue's mutex.
+    Status status;
+  };
+
+  // Finished jobs are kept around for a while so their status can be checked.
+  static constexpr size_t kMaxFinishedJobs = 100;
+
+  void ForgetOldJobs() {
+    size_t finished = 0;
+    for (auto it = jobs_.rbegin(); it != jobs_.rend(); ++it) {
+      const State state = it->second->status.state;
+      if (state != State::QUEUED && state != State::RUNNING) {
+	++finished;
+      }
+    }
+    for (auto it = jobs_.begin(); it != jobs_.end() && finished > kMaxFinishedJobs; ) {
+      const State state = it->second->status.state;
+      if (state != State::QUEUED && state != State::RUNNING) {
+	it = jobs_.erase(it);
+	--finished;
+      } else {
+	++it;
+      }
+    }
+  }
+
+  void WorkLoop() {
+    while (true) {
+      std::shared_ptr<Job> job;
+      {
+	std::unique_lock lock(m_);
+	while (!stopping_ && queue_.empty()) {
+	  cv_.wait(lock);
+	}
+	if (stopping_) {
+	  return;
+	}
+	job = queue_.front();
+	queue_.pop_front();
+	if (job->status.state == State::CANCELLED) {
+	  continue;
+	}
+	job->status.state = State::RUNNING;
+      }
+
+      const uint64_t start_time = Now();
+      std::string error_message;
+      const bool success = Run(job.get(), &error_message);
+      std::cout << "Save job for " << job->status.base_path << " finished in (ms): "
+		<< (Now() - start_time) << std::endl;
+      std::scoped_lock lock(m_);
+      if (success) {
+	job->status.state = State::DONE;
+      } else if (job->cancelled) {
+	job->status.state = State::CANCELLED;
+      } else {
+	job->status.state = State::FAILED;
+	job->status.error_message = error_message;
+      }
+    }
+  }
+
+  // Renders, encodes and writes out the job. On failure (including
+  // cancellation) removes anything partially written.
+  bool Run(Job* job, std::string* error_message) {
+    const std::string path = job->status.base_path + ".png";
+    if (std::ifstream(path, std::ios_base::binary).good()) {
+      *error_message = "File already exists: " + path;
+      return false;
+    }
+    std::ofstream outfile(path, std::ios_base::binary);
+    if (!outfile.good()) {
+      *error_message = "Could not open file: " + path;
+      return false;
+    }
+
+    if (!WritePng(job, &outfile, error_message)) {
+      outfile.close();
+      std::remove(path.c_str());
+      return false;
+    }
+    outfile.close();
+    if (!outfile.good()) {
+      *error_message = "Close failed";
+      std::remove(path.c_str());
+      return false;
+    }
+
+    std::ofstream metadata_file(job->metadata_path);
+    metadata_file << job->metadata;
+    metadata_file.close();
+    if (!metadata_file.good()) {
+      *error_message = "Could not write metadata file: " + job->metadata_path;
+      return false;
+    }
+    return true;
+  }
+
+  bool WritePng(Job* job, std::ofstream* outfile, std::string* error_message) {
+    const FractalParams& params = job->params;
+    const size_t row_bytes = 3 * params.width;
+
+    // Bands of roughly constant size, however wide the output is.
+    constexpr size_t pixels_per_band = 4 << 20; // TUNE.
+    const size_t rows_per_band =
+      std::min(params.height, std::max<size_t>(1, pixels_per_band / params.width));
+    const double scale = params.r_range / params.width;
+
+    // Pending output, flushed to disk after every band.
+    std::string png;
+    AppendPngHeader(&png, params.width, params.height, /*bit_depth=*/8, kPngColorTypeRGB);
+    IdatWriter idat_writer(&png);
+
+    RGBImage band_image(params.width, rows_per_band);
+    std::vector<unsigned char> row_above;
+    std::vector<unsigned char> filtered;
+    for (size_t y_begin = 0; y_begin < params.height; y_begin += rows_per_band) {
+      if (job->cancelled) {
+	*error_message = "Cancelled";
+	return false;
+      }
+      const size_t y_end = std::min(y_begin + rows_per_band, params.height);
+      const size_t band_rows = y_end - y_begin;
+      if (band_rows != band_image.get_height()) {
+	band_image = RGBImage(params.width, band_rows);
+      }
+
+      // The band is its own image, whose bottom row is row y_end - 1 of the
+      // whole thing. Its origin keeps the whole thing's precision, so it's
+      // still exact for deep zooms.
+      FractalParams band_params = params;
+      band_params.height = band_rows;
+      band_params.ShiftIMin((params.height - y_end) * scale);
+      DrawFractal({
+	  .params = band_params,
+	  .image = band_image,
+	  .previous_params = std::nullopt,
+	  .previous_image = nullptr,
+	  .thread_pool = thread_pool_,
+	  .priority = TaskPriority::BULK,
+	});
+
+      const unsigned char* band_bytes = band_image.get_pixbuf().data();
+      FilterRowsUp(band_bytes, row_bytes, 0, band_rows, &filtered,
+		   row_above.empty() ? nullptr : row_above.data());
+      filtered.resize(filtered.size() + 4);
+      idat_writer.Append(DeflatePieceWithFPng(filtered, params.width, band_rows, /*last=*/false));
+      row_above.assign(band_bytes + (band_rows - 1) * row_bytes, band_bytes + band_rows * row_bytes);
+
+      outfile->write(png.data(), png.size());
+      png.clear();
+      if (!outfile->good()) {
+	*error_message = "Write failed";
+	return false;
+      }
+
+      std::scoped_lock lock(m_);
+      job->status.rows_done = y_end;
+    }
+
+    idat_writer.Finish();
+    AppendPngTrailer(&png);
+    outfile->write(png.data(), png.size());
+    if (!outfile->good()) {
+      *error_message = "Write failed";
+      return false;
+    }
+    return true;
+  }
+
+  // Unowned.
+  ThreadPool& thread_pool_;
+
+  std::mutex m_;
+  std::condition_variable cv_;
+  bool stopping_ = false;
+  size_t next_id_ = 1;
+  std::map<size_t, std::shared_ptr<Job>> jobs_;
+  std::deque<std::shared_ptr<Job>> queue_;
+
+  // Declared last, so everything it uses is set up before it starts.
+  boost::thread worker_;
+};
+
+const char* ToString(SaveJobQueue::State state) {
+  switch (state) {
+    case SaveJobQueue::State::QUEUED:
+      return "QUEUED";
+    case SaveJobQueue::State::RUNNING:
+      return "RUNNING";
+    case SaveJobQueue::State::DONE:
+      return "DONE";
+    case SaveJobQueue::State::FAILED:
+      return "FAILED";
+    case SaveJobQueue::State::CANCELLED:
+      return "CANCELLED";
+  }
+  return "UNKNOWN";
+}
+
+#endif // _CROW_FRACTAL_SERVER_SAVE_JOBS_
@@ -0,0 +1,213 @@
+#ifndef _CROW_FRACTAL_SERVER_SCROLLING_IMAGE_
+#define _CROW_FRACTAL_SERVER_SCROLLING_IMAGE_
+
+#include <optional>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+
+#include "rgb_image.h"
+#include "fractal_params.h"
+#include "image_regions.h"
+
+// An image stored in a fixed-size buffer that wraps around in both dimensions
+// (i.e. a torus). Panning only moves the origin of the image within the buffer,
+// so the pixels that survive a pan are never copied and only the newly exposed
+// strips need to be drawn.
+class ScrollingImage {
+ public:
+  class Row {
+   public:
+    Row(png::rgb_pixel* pixels, size_t x_origin, size_t width)
+      : pixels_(pixels), x_origin_(x_origin), width_(width) {}
+
+    png::rgb_pixel& operator[](size_t x) {
+      x += x_origin_;
+      if (x >= width_) x -= width_;
+      return pixels_[x];
+    }
+
+   private:
+    png::rgb_pixel* pixels_;
+    size_t x_origin_;
+    size_t width_;
+  };
+
+  // Clears the origin and the params, reallocating only if the size changed.
+  void Reset(size_t width, size_t height) {
+    if (buffer_.get_width() != width || buffer_.get_height() != height) {
+      buffer_ = RGBImage(width, height);
+    }
+    x_origin_ = 0;
+    y_origin_ = 0;
+    params_.reset();
+  }
+
+  Row operator[](size_t y) {
+    y += y_origin_;
+    if (y >= buffer_.get_height()) y -= buffer_.get_height();
+    return Row(&buffer_[y][0], x_origin_, buffer_.get_width());
+  }
+
+  // As FramePixelBuffer::SetIndexedPixel.
+  void SetIndexedPixel(size_t x, size_t y, png::rgb_pixel pixel, uint8_t index) {
+    x += x_origin_;
+    if (x >= buffer_.get_width()) x -= buffer_.get_width();
+    buffer_.get_pixbuf().SetIndexedPixel(x, BufferY(y), pixel, index);
+  }
+
+  // As FramePixelBuffer::KeepPaletteIndices. Indices scroll with the pixels.
+  void KeepPaletteIndices(bool keep) {
+    buffer_.get_pixbuf().KeepPaletteIndices(keep);
+  }
+
+  bool keeps_palette_indices() const {
+    return buffer_.get_pixbuf().palette_indices() != nullptr;
+  }
+
+  size_t get_width() const {
+    return buffer_.get_width();
+  }
+
+  size_t get_height() const {
+    return buffer_.get_height();
+  }
+
+  // Moves the origin so that the pixels in overlap.a_region (the old image) are
+  // now addressed by overlap.b_region (the new image). Everything outside of
+  // b_region is stale and needs to be redrawn.
+  void Scroll(const ImageOverlap& overlap) {
+    const size_t width = buffer_.get_width();
+    const size_t height = buffer_.get_height();
+    x_origin_ = (x_origin_ + overlap.a_region.x_min + width - overlap.b_region.x_min) % width;
+    y_origin_ = (y_origin_ + overlap.a_region.y_min + height - overlap.b_region.y_min) % height;
+  }
+
+  // Writes the image out in normal row-major order. Each row is at most two
+  // contiguous runs in the buffer, so this is just a couple of memcpys per row.
+  // Palette indices are written too, if both keep them.
+  void Linearize(RGBImage& output) const {
+    LinearizeRows(output, 0, buffer_.get_height());
+  }
+
+  // As above, but only for rows [y_begin, y_end).
+  void LinearizeRows(RGBImage& output, size_t y_begin, size_t y_end) const {
+    const size_t width = buffer_.get_width();
+    const uint8_t* from_indices = buffer_.get_pixbuf().palette_indices();
+    uint8_t* to_indices = output.get_pixbuf().palette_indices();
+    for (size_t y = y_begin; y < y_end; ++y) {
+      CopyRow(y, &output[y][0]);
+      if (from_indices != nullptr && to_indices != nullptr) {
+	CopyRow(from_indices + BufferY(y) * width, to_indices + y * width);
+      }
+    }
+  }
+
+  // Row y in normal order: points straight into the buffer if the row doesn't
+  // wrap, otherwise it's copied to `scratch`, which must have room for a row.
+  const png::rgb_pixel* ReadRow(size_t y, png::rgb_pixel* scratch) const {
+    if (x_origin_ == 0) {
+      return &buffer_[BufferY(y)][0];
+    }
+    CopyRow(y, scratch);
+    return scratch;
+  }
+
+  // The params that the current contents of the image were drawn with, if any.
+  const std::optional<FractalParams>& params() const {
+    return params_;
+  }
+
+  void set_params(const FractalParams& params) {
+    params_ = params;
+  }
+
+ private:
+  size_t BufferY(size_t y) const {
+    y += y_origin_;
+    return y >= buffer_.get_height() ? y - buffer_.get_height() : y;
+  }
+
+  template <typename Element>
+  void CopyRow(const Element* from, Element* to) const {
+    const size_t tail = buffer_.get_width() - x_origin_;
+    std::memcpy(to, from + x_origin_, tail * sizeof(Element));
+    std::memcpy(to + tail, from, x_origin_ * sizeof(Element));
+  }
+
+  void CopyRow(size_t y, png::rgb_pixel* to) const {
+    CopyRow(&buffer_[BufferY(y)][0], to);
+  }
+
+  RGBImage buffer_;
+  size_t x_origin_ = 0;
+  size_t y_origin_ = 0;
+  std::optional<FractalParams> params_;
+};
+
+// Paints pixel (x, y) the color of the zero it goes to, as for RGBImage.
+void PaintZero(ScrollingImage& image, size_t x, size_t y,
+	       const std::vector<png::rgb_pixel>& colors, size_t zero_index) {
+  image.SetIndexedPixel(x, y, colors[zero_index], zero_index);
+}
+
+// The rows of a drawn frame, wherever it was drawn: an RGBImage, or the ring
+// buffer of a ScrollingImage. Lets an encoder read a frame straight out of the
+// ring a row at a time, rather than the whole frame being copied out first.
+//
+// If `copy_to` is set, each row read from the ring with Row() is also left
+// there, for callers that need a linear copy of the frame as well (e.g. to
+// hand on to another thread). That way the copy is made once, by whoever is
+// reading the rows anyway, rather than in a pass of its own.
+class FrameRows {
+ public:
+  FrameRows(const RGBImage& image)
+    : image_(&image), width_(image.get_width()), height_(image.get_height()) {}
+
+  FrameRows(const ScrollingImage& scrolling_image, RGBImage* copy_to = nullptr)
+    : scrolling_image_(&scrolling_image), copy_to_(copy_to),
+      width_(scrolling_image.get_width()), height_(scrolling_image.get_height()) {}
+
+  size_t get_width() const {
+    return width_;
+  }
+
+  size_t get_height() const {
+    return height_;
+  }
+
+  // Row y, contiguous. `scratch` must have room for a row, and the result may
+  // point into it.
+  const png::rgb_pixel* Row(size_t y, png::rgb_pixel* scratch) const {
+    if (image_ != nullptr) {
+      return &(*image_)[y][0];
+    }
+    if (copy_to_ != nullptr) {
+      png::rgb_pixel* row = &(*copy_to_)[y][0];
+      scrolling_image_->LinearizeRows(*copy_to_, y, y + 1);
+      return row;
+    }
+    return scrolling_image_->ReadRow(y, scratch);
+  }
+
+  // As Row(), but never writes to `copy_to`. For reading a row that someone
+  // else may be reading with Row() at the same time, e.g. the last row of the
+  // band above when filtering.
+  const png::rgb_pixel* PeekRow(size_t y, png::rgb_pixel* scratch) const {
+    if (image_ != nullptr) {
+      return &(*image_)[y][0];
+    }
+    return scrolling_image_->ReadRow(y, scratch);
+  }
+
+ private:
+  // Exactly one of these is set.
+  const RGBImage* image_ = nullptr;
+  const ScrollingImage* scrolling_image_ = nullptr;
+
+  RGBImage* copy_to_ = nullptr;
+  size_t width_;
+  size_t height_;
+};
+
+#endif // _CROW_FRACTAL_SERVER_SCROLLING_IMAGE_
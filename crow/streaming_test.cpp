@@ -0,0 +1,125 @@
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+#include <optional>
+#include <thread>
+
+#include <png.h>
+
+#include "synchronous_handler.h"
+#include "pipelined_handler.h"
+#include "async_handler.h"
+#include "test_utils.h"
+
+// Decodes a PNG to RGB with libpng, independently of the encoders under test.
+std::optional<std::vector<unsigned char>> DecodePng(const std::string& data, size_t* width,
+						      size_t* height) {
+  png_image image;
+  std::memset(&image, 0, sizeof(image));
+  image.version = PNG_IMAGE_VERSION;
+  if (!png_image_begin_read_from_memory(&image, data.data(), data.size())) {
+    return std::nullopt;
+  }
+  image.format = PNG_FORMAT_RGB;
+  std::vector<unsigned char> pixels(PNG_IMAGE_SIZE(image));
+  if (!png_image_finish_read(&image, nullptr, pixels.data(), 0, nullptr)) {
+    return std::nullopt;
+  }
+  *width = image.width;
+  *height = image.height;
+  return pixels;
+}
+
+// Whether the frame's PNG decodes to exactly the frame's image.
+bool PngMatchesImage(const Frame& frame) {
+  size_t width, height;
+  const std::optional<std::vector<unsigned char>> decoded = DecodePng(*frame.png->Get(), &width,
+									  &height);
+  if (!decoded.has_value() || width != frame.image->get_width() ||
+      height != frame.image->get_height()) {
+    return false;
+  }
+  for (size_t y = 0; y < height; ++y) {
+    if (std::memcmp(&(*decoded)[3 * width * y], &(*frame.image)[y][0], 3 * width) != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Asks the handler for frames that pan around (far enough for the scrolling
+// image to wrap around) and then zoom, streamed with PngEncoder::PARALLEL
+// except for the pans whose PNGs are left to be encoded lazily, and checks that every drawn frame's PNG is its image. Returns whether they
+// all were.
+bool CheckHandler(const std::string& name, Handler& handler) {
+  FractalParams params = OverviewScene();
+  params.width = 480;
+  params.height = 270;
+  params.png_encoder = PngEncoder::PARALLEL;
+  params.session_id = name;
+  const double pixel = params.r_range / params.width;
+
+  bool ok = true;
+  uint64_t last_data_id = 0;
+  uint64_t last_viewport_id = 0;
+  size_t frames = 0;
+  for (uint64_t request_id = 1; request_id <= 12; ++request_id) {
+    if (request_id == 12) {
+      params.r_range /= 2;
+    } else if (request_id > 1) {
+      params.r_min += 97 * pixel;
+      params.i_min -= 61 * pixel;
+    }
+    params.request_id = request_id;
+    // Every other pan leaves its PNG to be encoded when it's asked for.
+    params.png_optional = (request_id > 1 && request_id < 12 && request_id % 2 == 0);
+
+    // The async handler may send laid out frames first, which are encoded
+    // whole rather than streamed. Wait for the drawn one.
+    while (last_data_id < request_id) {
+      params.last_data_id = last_data_id;
+      params.last_viewport_id = last_viewport_id;
+      const std::optional<Frame> frame = handler.GetFrame(params);
+      if (!frame.has_value()) {
+	std::cout << name << ": handler was reset" << std::endl;
+	return false;
+      }
+      last_data_id = frame->data_id;
+      last_viewport_id = frame->viewport_id;
+      if (frame->image == nullptr) {
+	continue;
+      }
+      ++frames;
+      if (!PngMatchesImage(*frame)) {
+	std::cout << name << ": PNG of frame " << frame->data_id << " differs from its image"
+		  << std::endl;
+	ok = false;
+      }
+    }
+  }
+  std::cout << name << ": checked " << frames << " frames" << (ok ? "" : " -- FAILED") << std::endl;
+  return ok;
+}
+
+int main() {
+  fpng::fpng_init();
+  ThreadPool thread_pool(TestThreads());
+
+  bool ok = true;
+  {
+    SynchronousHandler handler(&thread_pool);
+    ok &= CheckHandler("synchronous", handler);
+  }
+  {
+    PipelinedHandler handler(&thread_pool);
+    ok &= CheckHandler("pipelined", handler);
+  }
+  {
+    AsyncHandler handler(&thread_pool);
+    ok &= CheckHandler("async", handler);
+  }
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
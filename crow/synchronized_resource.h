@@ -35,6 +35,47 @@ struct Synchronizer {
   std::condition_variable cv;
 };
 
+// Lets one thread give up another's wait on a SynchronizedResource, e.g. once
+// whoever it was waiting for a frame for has gone away. Once cancelled, it
+// stays cancelled: waits that are passed it return straight away.
+class WaitCanceller {
+ public:
+  void Cancel() {
+    Synchronizer* waiting_on;
+    {
+      std::scoped_lock lock(m_);
+      cancelled_ = true;
+      waiting_on = waiting_on_;
+    }
+    if (waiting_on != nullptr) {
+      // Once we have the lock, the waiter has either yet to check cancelled()
+      // or is waiting on the condition variable, so it can't miss the notify.
+      { std::scoped_lock lock(waiting_on->m); }
+      waiting_on->cv.notify_all();
+    }
+  }
+
+  bool cancelled() {
+    std::scoped_lock lock(m_);
+    return cancelled_;
+  }
+
+ private:
+  template <typename T, typename V>
+  friend class SynchronizedResourceBase;
+
+  // Called by waiters with sync->m held, before they check cancelled(). The
+  // synchronizer must outlive the canceller, or be unset again.
+  void SetWaitingOn(Synchronizer* sync) {
+    std::scoped_lock lock(m_);
+    waiting_on_ = sync;
+  }
+
+  std::mutex m_;
+  bool cancelled_ = false;
+  Synchronizer* waiting_on_ = nullptr;
+};
+
 template <typename T, typename V = uint64_t>
 class SynchronizedResourceBase {
  public:
@@ -62,13 +103,22 @@ class SynchronizedResourceBase {
     }
   }
 
-  MaybeResource<T, V> GetAboveVersion(V version) {
+  // If `canceller` is set and gets cancelled, gives up waiting and returns
+  // nothing, as if the resource had been killed.
+  MaybeResource<T, V> GetAboveVersion(V version, WaitCanceller* canceller = nullptr) {
     std::unique_lock lock(sync_.m);
-    while (still_alive && (!resource_.has_value() ||
-			   resource_->version <= version)) {
+    if (canceller != nullptr) {
+      canceller->SetWaitingOn(&sync_);
+    }
+    bool cancelled = false;
+    while (still_alive && !(cancelled = canceller != nullptr && canceller->cancelled()) &&
+	   (!resource_.has_value() || resource_->version <= version)) {
       sync_.cv.wait(lock);
     }
-    if (!still_alive) {
+    if (canceller != nullptr) {
+      canceller->SetWaitingOn(nullptr);
+    }
+    if (!still_alive || cancelled) {
       return {.resource = std::nullopt, .still_alive = false};
     } else {
       return {.resource = resource_, .still_alive = true};
@@ -15,13 +15,18 @@
 #include "png_encoding.h"
 #include "response.h"
 #include "thread_pool.h"
+#include "image_pool.h"
+#include "save_jobs.h"
 
 static constexpr char image_directory[] = "/mnt/c/Users/young/Documents/Newton Fractal Saved Images/";
 static constexpr char metadata_suffix[] = "_metadata.txt";
 
 class SynchronousHandler : public Handler {
  public:
-  explicit SynchronousHandler(ThreadPool* thread_pool) : thread_pool_(*thread_pool) {}
+  explicit SynchronousHandler(ThreadPool* thread_pool)
+    : thread_pool_(*thread_pool),
+      image_pool_(/*max_free_bytes=*/256 << 20),
+      save_jobs_(thread_pool) {}
 
   crow::response HandleParamsRequest(const FractalParams& params) override {
     // Just black-hole the params and respond with an ack.
@@ -29,36 +34,82 @@ class SynchronousHandler : public Handler {
     return crow::response(json);
   }
 
+  // Draws the frame there and then, so there's no waiting to cancel.
+  std::optional<Frame> GetFrame(const FractalParams& params,
+				WaitCanceller* /*canceller*/ = nullptr) override {
+    // If the PNG is likely to go unused, don't encode it as the frame is drawn.
+    DrawnFrame drawn = Draw(params, /*stream_png=*/!params.png_optional);
+    std::shared_ptr<LazyPng> png = drawn.png.has_value() ?
+      std::make_shared<LazyPng>(std::make_shared<const std::string>(std::move(*drawn.png))) :
+      EncodePngLazily(params, drawn.image, thread_pool_);
+    return Frame{
+      .png = png,
+      .data_id = params.request_id,
+      .viewport_id = params.request_id,
+      .precision = ResolvePrecision(params),
+      .params = params,
+      .image = drawn.image,
+    };
+  }
+
+  // Overridden to move the PNG straight into the response.
   crow::response HandleFractalRequest(const FractalParams& params) override {
-    std::string png = GeneratePng(params);
-    return ImageWithMetadata(std::move(png),
-			     {{"data_id", params.request_id},
-			      {"viewport_id", params.request_id}});
+    DrawnFrame drawn = Draw(params, /*stream_png=*/true);
+    std::string png;
+    if (drawn.png.has_value()) {
+      png = std::move(*drawn.png);
+    } else {
+      const uint64_t start_time = Now();
+      png = EncodePng(params, *drawn.image, thread_pool_);
+      std::cout << "PNG encode time (ms): " << (Now() - start_time) << std::endl;
+    }
+    return ImageWithMetadata(std::move(png), params.request_id, params.request_id,
+			     ResolvePrecision(params));
   }
 
+  // Starts a background save job, see save_jobs.h. Responds with its id.
   crow::response HandleSaveRequest(const SaveParams& params) {
     // Render the fractal, potentially at increased scale.
     FractalParams render_params = params.fractal_params;
     render_params.width *= params.scale;
     render_params.height *= params.scale;
-    std::string png = GeneratePng(render_params);
+    // Pick the precision for the whole image once, at the saved scale, rather
+    // than letting each band pick its own.
+    render_params.precision = ResolvePrecision(render_params);
 
     // Construct the file path to write to.
     std::string path = std::string(image_directory) + params.filename;
 
-    // Construct a default-successful response.
-    crow::json::wvalue json({{"success", true}});
-    crow::response save_response(json);
+    const size_t job_id = save_jobs_.Submit(render_params, path, params.metadata,
+					    path + std::string(metadata_suffix));
+    crow::json::wvalue json({{"success", true},
+			     {"job_id", job_id}});
+    return crow::response(json);
+  }
 
-    // Try to write the PNG and metadata.
-    if (!SavePng(png, path, &save_response)) {
-      return save_response;
-    }
-    if (!SaveMetadata(params.metadata, path, &save_response)) {
-      return save_response;
+  crow::response HandleSaveStatusRequest(const SaveJobParams& params) {
+    const std::optional<SaveJobQueue::Status> status = save_jobs_.GetStatus(params.job_id);
+    if (!status.has_value()) {
+      crow::json::wvalue json({{"success", false},
+			       {"error_message", "No such save job"}});
+      return crow::response(json);
     }
+    crow::json::wvalue json({{"success", true},
+			     {"state", ToString(status->state)},
+			     {"rows_done", status->rows_done},
+			     {"total_rows", status->total_rows},
+			     {"path", status->base_path + ".png"},
+			     {"error_message", status->error_message}});
+    return crow::response(json);
+  }
 
-    return save_response;
+  crow::response HandleSaveCancelRequest(const SaveJobParams& params) {
+    const bool cancelled = save_jobs_.Cancel(params.job_id);
+    crow::json::wvalue json({{"success", cancelled}});
+    if (!cancelled) {
+      json["error_message"] = "No such save job, or it's already finished";
+    }
+    return crow::response(json);
   }
 
   crow::response HandleLoadRequest(const LoadParams& params) {
@@ -111,12 +162,31 @@ class SynchronousHandler : public Handler {
   }
 
  private:
-  std::string GeneratePng(const FractalParams& params) {
-    std::cout << Now() << ": Start generating PNG" << std::endl;
+  // The image that was drawn, and its PNG if it was encoded as it was drawn.
+  struct DrawnFrame {
+    std::shared_ptr<RGBImage> image;
+    std::optional<std::string> png;
+  };
+
+  // If `stream_png` is set, encodes the PNG as the frame is drawn, if the
+  // encoder can.
+  DrawnFrame Draw(const FractalParams& params, bool stream_png) {
+    std::cout << Now() << ": Start drawing frame" << std::endl;
     const uint64_t start_time = Now();
 
-    // Set up the image.
-    auto image = std::make_unique<RGBImage>(params.width, params.height);
+    // Set up the image. Every pixel gets drawn, so no need to clear it.
+    auto image = image_pool_.Acquire(params.width, params.height, /*clear=*/false);
+    std::cout << "Image acquire time (ms): " << (Now() - start_time) << std::endl;
+
+    // If we can, encode bands of rows as soon as they're drawn.
+    std::optional<StreamingPngEncoder> streaming_encoder;
+    std::function<void(const FrameRows&, size_t, size_t)> on_rows_ready = nullptr;
+    if (stream_png && SupportsStreamingEncode(params)) {
+      streaming_encoder.emplace(image->get_width(), image->get_height(), &thread_pool_);
+      on_rows_ready = [&streaming_encoder](const FrameRows& rows, size_t y_begin, size_t y_end) {
+	streaming_encoder->AddRows(rows, y_begin, y_end);
+      };
+    }
 
     // Draw the fractal.
     const size_t total_iters = DrawFractal({
@@ -125,93 +195,26 @@ class SynchronousHandler : public Handler {
 	.previous_params = previous_params_,
 	.previous_image = previous_image_.get(),
 	.thread_pool = thread_pool_,
+	.scrolling_image = &scrolling_image_,
+	.on_rows_ready = on_rows_ready,
+	.cost_map = &cost_map_,
       });
     const uint64_t end_time = Now();
     std::cout << "Total iterations: " << total_iters << std::endl;
     std::cout << "Computation time (ms): " << (end_time - start_time) << std::endl;
 
-    // Encode to PNG.
-    std::string png = EncodePng(params, *image);
-    const uint64_t encode_time = Now();
-    std::cout << "PNG encode time (ms): " << (encode_time - end_time) << std::endl;
-    std::cout << "Total time (ms): " << (encode_time - start_time) << std::endl;
+    DrawnFrame drawn = {.image = image, .png = std::nullopt};
+    if (streaming_encoder.has_value()) {
+      drawn.png = streaming_encoder->Finish();
+      std::cout << "Streaming PNG finish time (ms): " << (Now() - end_time) << std::endl;
+    }
 
     // Prepare for next request.
     previous_image_ = std::move(image);
     previous_params_ = params;
 
-    std::cout << Now() << ": Done generating PNG" << std::endl;
-    return png;
-  }
-
-  // Returns true on success; populates *response on error.
-  bool SavePng(const std::string& png, const std::string& base_path, crow::response* response) {
-    std::string path = base_path + ".png";
-
-    // Check that the file doesn't already exist.
-    std::ifstream infile(path, std::ios_base::binary);
-    if (infile.good()) {
-      crow::json::wvalue json({{"success", false},
-			       {"error_message", "File already exists: " + path}});
-      *response = crow::response(json);
-      return false;
-    }
-    infile.close();
-
-    // Try to write the PNG.
-    std::ofstream outfile(path, std::ios_base::binary);
-    if (!outfile.good()) {
-      crow::json::wvalue json({{"success", false},
-			       {"error_message", "Could not open file: " + path}});
-      *response = crow::response(json);
-      return false;
-    }
-    outfile.write(png.c_str(), png.size());
-    if (!outfile.good()) {
-      crow::json::wvalue json({{"success", false},
-			       {"error_message", "Write failed"}});
-      *response = crow::response(json);
-      return false;
-    }
-    outfile.close();
-    if (!outfile.good()) {
-      crow::json::wvalue json({{"success", false},
-			       {"error_message", "Close failed"}});
-      *response = crow::response(json);
-      return false;
-    }
-
-    return true;
-  }
-
-  // Returns true on success; populates *response on error.
-  bool SaveMetadata(const std::string& metadata, const std::string& base_path, crow::response* response) {
-    std::string path = base_path + std::string(metadata_suffix);
-
-    // Try to write the metadata.
-    std::ofstream outfile(path);
-    if (!outfile.good()) {
-      crow::json::wvalue json({{"success", false},
-			       {"error_message", "Could not open metadata file: " + path}});
-      *response = crow::response(json);
-      return false;
-    }
-    outfile << metadata;
-    if (!outfile.good()) {
-      crow::json::wvalue json({{"success", false},
-			       {"error_message", "Metadata write failed"}});
-      *response = crow::response(json);
-      return false;
-    }
-    outfile.close();
-    if (!outfile.good()) {
-      crow::json::wvalue json({{"success", false},
-			       {"error_message", "Metadata close failed"}});
-      *response = crow::response(json);
-      return false;
-    }
-
-    return true;
+    std::cout << Now() << ": Done drawing frame" << std::endl;
+    return drawn;
   }
 
   std::optional<std::vector<std::string>> GetDirectoryContents(const char* directory) {
@@ -248,7 +251,12 @@ class SynchronousHandler : public Handler {
   ThreadPool& thread_pool_;
 
   std::optional<FractalParams> previous_params_ = std::nullopt;
-  std::unique_ptr<RGBImage> previous_image_ = nullptr;
+  ImagePool image_pool_;
+  std::shared_ptr<RGBImage> previous_image_ = nullptr;
+  ScrollingImage scrolling_image_;
+  CostMap cost_map_;
+
+  SaveJobQueue save_jobs_;
 };
 
 #endif // _CROW_FRACTAL_SERVER_SYNCHRONOUS_HANDLER_
@@ -2,26 +2,38 @@
 #define _CROW_FRACTAL_SERVER_TASK_GROUP_
 
 #include <mutex>
+#include <vector>
+#include <optional>
 #include <condition_variable>
 
 #include "thread_pool.h"
 
 class TaskGroup {
  public:
-  // ThreadPool must outlive the TaskGroup.
-  explicit TaskGroup(ThreadPool* thread_pool)
-    : thread_pool_(*thread_pool) {}
+  // ThreadPool must outlive the TaskGroup. Tasks are queued with the given
+  // priority.
+  explicit TaskGroup(ThreadPool* thread_pool,
+		     TaskPriority priority = TaskPriority::INTERACTIVE)
+    : thread_pool_(*thread_pool), priority_(priority) {}
 
+  // Tasks can optionally be assigned to a band (e.g. a range of image rows),
+  // so that callers can wait for just that band's tasks with WaitForBand().
   template <typename F>
-  void Add(F f) {
+  void Add(F f, std::optional<size_t> band = std::nullopt) {
     // Increment the number of outstanding tasks.
     {
       std::scoped_lock lock(m_);
       ++outstanding_tasks_;
+      if (band.has_value()) {
+	if (*band >= outstanding_band_tasks_.size()) {
+	  outstanding_band_tasks_.resize(*band + 1, 0);
+	}
+	++outstanding_band_tasks_[*band];
+      }
     }
 
     // Queue the task.
-    thread_pool_.Queue([f, this]() {
+    thread_pool_.Queue([f, band, this]() {
       f();
       // After finishing, decrement the number of outstanding tasks.
       bool notify = false;
@@ -29,12 +41,17 @@ class TaskGroup {
 	std::scoped_lock lock(m_);
 	--outstanding_tasks_;
 	notify = (outstanding_tasks_ == 0);
+	if (band.has_value()) {
+	  --outstanding_band_tasks_[*band];
+	  notify |= (outstanding_band_tasks_[*band] == 0);
+	}
       }
-      // Notify any waiting threads if there are no more tasks.
+      // Notify any waiting threads if there are no more tasks, in the group or
+      // in the band.
       if (notify) {
 	cv_.notify_all();
       }
-    });
+    }, priority_);
   }
 
   void WaitUntilDone() {
@@ -45,13 +62,25 @@ class TaskGroup {
     lock.unlock();
   }
 
+  // Waits for the tasks added so far to the given band. A band with no tasks is
+  // done immediately.
+  void WaitForBand(size_t band) {
+    std::unique_lock lock(m_);
+    while (band < outstanding_band_tasks_.size() && outstanding_band_tasks_[band] > 0) {
+      cv_.wait(lock);
+    }
+    lock.unlock();
+  }
+
  private:
   // Unowned.
   ThreadPool& thread_pool_;
+  const TaskPriority priority_;
 
   std::mutex m_;
   std::condition_variable cv_;
   int outstanding_tasks_ = 0;
+  std::vector<int> outstanding_band_tasks_;
 };
 
 #endif // _CROW_FRACTAL_SERVER_TASK_GROUP_
@@ -0,0 +1,205 @@
+#ifndef _CROW_FRACTAL_SERVER_TEST_UTILS_
+#define _CROW_FRACTAL_SERVER_TEST_UTILS_
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "fractal_params.h"
+#include "fractal_drawing.h"
+#include "rgb_image.h"
+#include "thread_pool.h"
+#include "tuning.h"
+#include "development_utils.h"
+
+// Scenes and helpers shared by the check programs, which aren't part of the
+// server.
+
+// The whole of a four zero polynomial, at 720p.
+FractalParams OverviewScene() {
+  FractalParams overview;
+  overview.session_id = "test";
+  overview.request_id = 1;
+  overview.last_data_id = 0;
+  overview.last_viewport_id = 0;
+  overview.width = 1280;
+  overview.height = 720;
+  overview.r_min = -2.5;
+  overview.r_range = 5.0;
+  overview.i_min = -overview.i_range() / 2;
+  overview.max_iters = 200;
+  overview.zeros = {
+    ComplexD(-1.0, 0.0), ComplexD(1.0, 0.3), ComplexD(0.2, 1.0), ComplexD(0.4, -0.8),
+  };
+  overview.colors = {
+    png::rgb_pixel(230, 60, 60), png::rgb_pixel(60, 230, 60),
+    png::rgb_pixel(60, 60, 230), png::rgb_pixel(230, 230, 60),
+  };
+  overview.precision = Precision::SINGLE;
+  return overview;
+}
+
+// Zoomed in on where three basins meet.
+FractalParams BoundaryScene() {
+  FractalParams boundary = OverviewScene();
+  boundary.r_min = -1.6;
+  boundary.r_range = 0.1;
+  boundary.i_min = -1.43;
+  return boundary;
+}
+
+// A high degree polynomial, for which the divide is a smaller share of the
+// Newton step but the basins are much more intricate.
+FractalParams ManyZerosScene() {
+  FractalParams many_zeros = OverviewScene();
+  many_zeros.zeros.clear();
+  many_zeros.colors.clear();
+  for (int i = 0; i < 24; ++i) {
+    const double angle = 2 * M_PI * i / 24;
+    const double radius = 1.0 + 0.3 * std::sin(5.0 * angle);
+    // Rounded, so that the scene itself doesn't depend on the host's libm.
+    many_zeros.zeros.push_back(ComplexD(std::round(1024 * radius * std::cos(angle)) / 1024,
+					std::round(1024 * radius * std::sin(angle)) / 1024));
+    many_zeros.colors.push_back(png::rgb_pixel(40 + 9 * i, 250 - 9 * i, (97 * i) % 256));
+  }
+  many_zeros.r_min = -1.8;
+  many_zeros.r_range = 3.6;
+  many_zeros.i_min = -many_zeros.i_range() / 2;
+  return many_zeros;
+}
+
+// Zoomed in further than BoundaryScene(), to where float is close to running
+// out of bits.
+FractalParams DeepScene() {
+  FractalParams deep = BoundaryScene();
+  deep.r_min = -1.5626;
+  deep.r_range = 0.0002;
+  deep.i_min = -1.40631;
+  return deep;
+}
+
+// Zoomed in on a basin boundary until pixels are 1e-38 apart, past what
+// double-double can resolve, with the origin at full precision as the client
+// sends it (see FractalParams::r_min_exact). The boundary point is found by
+// bisecting, with Newton's method at that precision, between two corners of
+// DeepScene() that go to different zeros. Smaller than the other scenes, since
+// checking it means iterating every pixel at that precision.
+FractalParams PastDoubleDoubleScene() {
+  FractalParams past = DeepScene();
+  std::vector<Complex<ReferenceFloat>> zeros;
+  for (const ComplexD& zero : past.zeros) {
+    zeros.emplace_back(zero.r, zero.i);
+  }
+  const Polynomial<ReferenceFloat> p = Polynomial<ReferenceFloat>::FromZeros(zeros);
+  const Polynomial<ReferenceFloat> derivative = Differentiate(p);
+  auto zero_of = [&](Complex<ReferenceFloat> z) {
+    for (size_t i = 0; i < past.max_iters; ++i) {
+      z -= p(z) / derivative(z);
+    }
+    return ClosestZero(ComplexD(static_cast<double>(z.r), static_cast<double>(z.i)), past.zeros);
+  };
+
+  Complex<ReferenceFloat> a(past.r_min, past.i_min);
+  Complex<ReferenceFloat> b(past.r_min + past.r_range, past.i_min + past.i_range());
+  const size_t a_zero = zero_of(a);
+  for (int i = 0; i < 140; ++i) {
+    const Complex<ReferenceFloat> middle((a.r + b.r) / 2, (a.i + b.i) / 2);
+    if (zero_of(middle) == a_zero) {
+      a = middle;
+    } else {
+      b = middle;
+    }
+  }
+
+  past.width = 64;
+  past.height = 36;
+  past.r_range = 64e-38;
+  past.SetExactOrigin(a.r - past.r_range / 2, a.i - past.i_range() / 2);
+  return past;
+}
+
+// Zoomed out far enough that most pixels start well outside the zeros, and
+// crawl in for many steps before reaching them, which is what
+// FractalParams::far_field skips.
+FractalParams FarFieldScene() {
+  FractalParams far_field = OverviewScene();
+  far_field.r_min = -200.0;
+  far_field.r_range = 400.0;
+  far_field.i_min = -far_field.i_range() / 2;
+  return far_field;
+}
+
+// As FarFieldScene(), but for ManyZerosScene()'s polynomial, whose Newton steps
+// far out shrink the distance to the zeros by only 1/24 each, so the crawl in
+// is several times as many steps, and the jumps skip much of the work. At a
+// quarter of the pixels, since each takes so many steps.
+FractalParams FarFieldManyZerosScene() {
+  FractalParams far_field = ManyZerosScene();
+  far_field.width = 640;
+  far_field.height = 360;
+  far_field.r_min = -200.0;
+  far_field.r_range = 400.0;
+  far_field.i_min = -far_field.i_range() / 2;
+  return far_field;
+}
+
+// Returns the fraction of pixels that differ between the two images.
+double DifferingFraction(const RGBImage& a, const RGBImage& b) {
+  size_t differing = 0;
+  for (size_t y = 0; y < a.get_height(); ++y) {
+    for (size_t x = 0; x < a.get_width(); ++x) {
+      differing += (a[y][x].red != b[y][x].red ||
+		    a[y][x].green != b[y][x].green ||
+		    a[y][x].blue != b[y][x].blue);
+    }
+  }
+  return 1.0 * differing / (a.get_width() * a.get_height());
+}
+
+// Draws the scene from scratch `iterations` times at the given precision,
+// returning the best time taken (ms). The block width is the current
+// tuning's unless given.
+double Draw(FractalParams params, Precision precision, RGBImage& image, ThreadPool& thread_pool,
+	    Strategy strategy = Strategy::DYNAMIC_BLOCK_THREADED,
+	    std::optional<size_t> block_width = std::nullopt, int iterations = 3) {
+  params.precision = precision;
+  params.strategy = strategy;
+  TuningParams tuning = GetTuning();
+  tuning.block_width = block_width.value_or(tuning.block_width);
+  uint64_t best_ms = std::numeric_limits<uint64_t>::max();
+  for (int i = 0; i < iterations; ++i) {
+    const uint64_t start_time = Now();
+    DrawFractal({
+	.params = params,
+	.image = image,
+	.previous_params = std::nullopt,
+	.previous_image = nullptr,
+	.thread_pool = thread_pool,
+	.tuning = tuning,
+      });
+    best_ms = std::min(best_ms, Now() - start_time);
+  }
+  return best_ms;
+}
+
+// One thread per CPU, as the server would have before tuning.
+size_t TestThreads() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Where to write `filename`, so that test output goes in a directory of its
+// own under the system's temp directory rather than wherever the test is run.
+std::string TestOutputPath(const std::string& filename) {
+  const std::filesystem::path dir = std::filesystem::temp_directory_path() / "crow_test_output";
+  std::filesystem::create_directories(dir);
+  const std::string path = (dir / filename).string();
+  std::cout << "Writing " << path << std::endl;
+  return path;
+}
+
+#endif // _CROW_FRACTAL_SERVER_TEST_UTILS_
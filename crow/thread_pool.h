@@ -1,17 +1,66 @@
 #ifndef _CROW_FRACTAL_SERVER_THREAD_POOL_
 #define _CROW_FRACTAL_SERVER_THREAD_POOL_
 
-#include <boost/asio/io_service.hpp>
-#include <boost/bind.hpp>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <optional>
+
 #include <boost/thread/thread.hpp>
 
+// Classes of work sharing the pool, most urgent first. Threads always take the
+// most urgent task that's queued.
+enum class TaskPriority {
+  // Finishing off parts of a frame someone is waiting to see, e.g. encoding
+  // rows that are already drawn, so that it's done alongside drawing the rest
+  // rather than queued up behind it.
+  FINISHING = 0,
+  // Frames that someone is waiting to see.
+  INTERACTIVE = 1,
+  // Work whose result might be thrown away, e.g. prefetching.
+  SPECULATIVE = 2,
+  // Big jobs that nobody is watching, e.g. saves and batch renders.
+  BULK = 3,
+};
+
+constexpr size_t kNumTaskPriorities = 4;
+
+const char* ToString(TaskPriority priority) {
+  switch (priority) {
+    case TaskPriority::FINISHING:
+      return "finishing";
+    case TaskPriority::INTERACTIVE:
+      return "interactive";
+    case TaskPriority::SPECULATIVE:
+      return "speculative";
+    case TaskPriority::BULK:
+      return "bulk";
+  }
+  return "unknown";
+}
+
 class ThreadPool {
  public:
+  struct QueueStats {
+    // Current and maximum number of tasks waiting to start.
+    size_t queued = 0;
+    size_t max_queued = 0;
+
+    // Time from being queued to starting, over all started tasks.
+    size_t started = 0;
+    double total_wait_ms = 0.0;
+    double max_wait_ms = 0.0;
+  };
+
   explicit ThreadPool(size_t num_threads)
-    : work_(io_service_), size_(num_threads) {
+    : size_(num_threads) {
     for (size_t i = 0; i < num_threads; ++i) {
-      auto* thread = new boost::thread(boost::bind(&boost::asio::io_service::run,
-						   &io_service_));
+      auto* thread = new boost::thread(&ThreadPool::Run, this);
       std::cout << "ThreadPool created thread with handle: "
 		<< thread->native_handle() << std::endl;
 
@@ -44,21 +93,147 @@ class ThreadPool {
   }
 
   template <typename F>
-  void Queue(F f) {
-    // Post the task.
-    io_service_.post(f);
+  void Queue(F f, TaskPriority priority = TaskPriority::INTERACTIVE) {
+    const size_t index = static_cast<size_t>(priority);
+    {
+      std::scoped_lock lock(m_);
+      queues_[index].push_back({
+	  .run = std::move(f),
+	  .queued_at = std::chrono::steady_clock::now(),
+	});
+      QueueStats& stats = stats_[index];
+      stats.queued = queues_[index].size();
+      stats.max_queued = std::max(stats.max_queued, stats.queued);
+      ++queued_counts_[index];
+    }
+    cv_.notify_one();
+  }
+
+  // For long running tasks to call at convenient points (e.g. between tiles):
+  // runs any queued tasks that are more urgent than `priority` on this thread,
+  // then returns so the caller can carry on. Does nothing off the pool's
+  // threads.
+  void Yield(TaskPriority priority) {
+    if (current_pool_ != this) {
+      return;
+    }
+    while (true) {
+      bool more_urgent_queued = false;
+      for (size_t i = 0; i < static_cast<size_t>(priority); ++i) {
+	more_urgent_queued |= (queued_counts_[i] > 0);
+      }
+      if (!more_urgent_queued) {
+	return;
+      }
+      std::optional<Task> task;
+      {
+	std::scoped_lock lock(m_);
+	task = PopTask(static_cast<size_t>(priority));
+      }
+      if (!task.has_value()) {
+	return;
+      }
+      task->run();
+    }
+  }
+
+  // Whether no tasks are running or queued, e.g. for background work that
+  // mustn't compete with the pool. Just a snapshot, without locking.
+  bool Idle() const {
+    if (running_ > 0) {
+      return false;
+    }
+    for (const std::atomic<size_t>& count : queued_counts_) {
+      if (count > 0) {
+	return false;
+      }
+    }
+    return true;
+  }
+
+  std::array<QueueStats, kNumTaskPriorities> GetStats() {
+    std::scoped_lock lock(m_);
+    return stats_;
   }
 
   ~ThreadPool() {
-    io_service_.stop();
+    // Like io_service::stop(), tasks that haven't started yet are dropped.
+    {
+      std::scoped_lock lock(m_);
+      stopping_ = true;
+    }
+    cv_.notify_all();
     threads_.join_all();
   }
 
  private:
-  boost::asio::io_service io_service_;
-  boost::asio::io_service::work work_;
+  struct Task {
+    std::function<void()> run;
+    std::chrono::steady_clock::time_point queued_at;
+  };
+
+  void Run() {
+    current_pool_ = this;
+    while (true) {
+      std::optional<Task> task;
+      {
+	std::unique_lock lock(m_);
+	while (!stopping_ && !(task = PopTask(kNumTaskPriorities)).has_value()) {
+	  cv_.wait(lock);
+	}
+	if (stopping_) {
+	  return;
+	}
+	// Counted before the lock is released, so Idle() never sees the task as
+	// neither queued nor running.
+	++running_;
+      }
+      task->run();
+      --running_;
+    }
+  }
+
+  // Takes the most urgent queued task with priority index below `end`, if any.
+  // m_ must be held.
+  std::optional<Task> PopTask(size_t end) {
+    for (size_t i = 0; i < end; ++i) {
+      if (queues_[i].empty()) {
+	continue;
+      }
+      Task task = std::move(queues_[i].front());
+      queues_[i].pop_front();
+      --queued_counts_[i];
+
+      QueueStats& stats = stats_[i];
+      const double wait_ms = std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - task.queued_at).count();
+      stats.queued = queues_[i].size();
+      ++stats.started;
+      stats.total_wait_ms += wait_ms;
+      stats.max_wait_ms = std::max(stats.max_wait_ms, wait_ms);
+      return task;
+    }
+    return std::nullopt;
+  }
+
+  // The pool that the current thread belongs to, if any.
+  static thread_local ThreadPool* current_pool_;
+
   boost::thread_group threads_;
   size_t size_;
+
+  std::mutex m_;
+  std::condition_variable cv_;
+  bool stopping_ = false;
+  std::array<std::deque<Task>, kNumTaskPriorities> queues_;
+  std::array<QueueStats, kNumTaskPriorities> stats_;
+
+  // Mirrors the queue sizes, so Yield() can check them without locking.
+  std::array<std::atomic<size_t>, kNumTaskPriorities> queued_counts_ = {};
+  // Tasks that the pool's threads have taken and not yet finished.
+  std::atomic<size_t> running_ = 0;
 };
 
+thread_local ThreadPool* ThreadPool::current_pool_ = nullptr;
+
 #endif // _CROW_FRACTAL_SERVER_THREAD_POOL_
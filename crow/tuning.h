@@ -0,0 +1,105 @@
+#ifndef _CROW_FRACTAL_SERVER_TUNING_
+#define _CROW_FRACTAL_SERVER_TUNING_
+
+#include <string>
+#include <vector>
+#include <optional>
+#include <fstream>
+#include <sstream>
+#include <atomic>
+#include <algorithm>
+#include <iostream>
+
+// Throughput knobs whose best values depend on the machine. The defaults came
+// from one-off experiments on an 8 logical CPU box; see autotuner.h for finding
+// the best values on the current machine.
+struct TuningParams {
+  // The block widths that drawing is compiled for.
+  static constexpr size_t kBlockWidths[] = {8, 16, 32, 64};
+
+  // Number of pixels iterated together in a ComplexArray block.
+  size_t block_width = 32;
+
+  // Rough number of pixels per task when splitting regions into tasks.
+  size_t pixels_per_task = 25 * 2000;
+
+  // Rows per task for DYNAMIC_BLOCK_THREADED without a cost prediction.
+  size_t rows_per_task = 50;
+
+  // Threads in the drawing thread pool. Only takes effect at startup.
+  size_t num_threads = 7;
+
+  static bool IsValidBlockWidth(size_t block_width) {
+    return std::find(std::begin(kBlockWidths), std::end(kBlockWidths), block_width) !=
+      std::end(kBlockWidths);
+  }
+
+  // Reads tuning saved by Save(). Returns nullopt if the file doesn't exist or
+  // isn't valid, e.g. it's from a version with different knobs.
+  static std::optional<TuningParams> Load(const std::string& filename) {
+    std::ifstream fin(filename);
+    if (!fin) {
+      return std::nullopt;
+    }
+    TuningParams tuning;
+    size_t found = 0;
+    std::string key;
+    size_t value;
+    while (fin >> key >> value) {
+      if (value == 0) {
+	return std::nullopt;
+      }
+      if (key == "block_width") {
+	tuning.block_width = value;
+      } else if (key == "pixels_per_task") {
+	tuning.pixels_per_task = value;
+      } else if (key == "rows_per_task") {
+	tuning.rows_per_task = value;
+      } else if (key == "num_threads") {
+	tuning.num_threads = value;
+      } else {
+	return std::nullopt;
+      }
+      ++found;
+    }
+    if (found != 4 || !IsValidBlockWidth(tuning.block_width)) {
+      return std::nullopt;
+    }
+    return tuning;
+  }
+
+  bool Save(const std::string& filename) const {
+    std::ofstream fout(filename);
+    fout << ToString();
+    return static_cast<bool>(fout);
+  }
+
+  std::string ToString() const {
+    std::ostringstream ss;
+    ss << "block_width " << block_width << std::endl
+       << "pixels_per_task " << pixels_per_task << std::endl
+       << "rows_per_task " << rows_per_task << std::endl
+       << "num_threads " << num_threads << std::endl;
+    return ss.str();
+  }
+};
+
+// The tuning that drawing uses by default. Set at startup, and again whenever
+// the autotuner finishes. Every frame reads it, so it's published as an
+// immutable copy behind an atomic pointer rather than behind a lock. Replaced
+// copies are never freed, since a reader may still be copying one, but it's
+// only ever replaced a handful of times.
+std::atomic<const TuningParams*>& CurrentTuning() {
+  static std::atomic<const TuningParams*> current(new TuningParams());
+  return current;
+}
+
+TuningParams GetTuning() {
+  return *CurrentTuning().load(std::memory_order_acquire);
+}
+
+void SetTuning(const TuningParams& tuning) {
+  CurrentTuning().store(new TuningParams(tuning), std::memory_order_release);
+}
+
+#endif // _CROW_FRACTAL_SERVER_TUNING_
@@ -0,0 +1,135 @@
+#ifndef _CROW_FRACTAL_SERVER_ZERO_GRID_
+#define _CROW_FRACTAL_SERVER_ZERO_GRID_
+
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cmath>
+#include <stdint.h>
+
+#include "complex.h"
+#include "complex_array.h"
+
+// Polynomials with at least this many zeros find the zero an iterate has
+// converged to with a ZeroGrid, rather than by checking every zero.
+constexpr size_t kZeroGridMinZeros = 8; // TUNE.
+
+// Answers "which zero, if any, is z within the convergence radius of?" in
+// constant time, for the convergence check that runs on every lane after every
+// Newton step.
+//
+// The plane is cut into square cells 4 convergence radii across. Zeros are at
+// least 20 convergence radii apart (see ConservativeConvergenceRadius), so at
+// most one zero is within the convergence radius of any point in a cell: the
+// cell's candidate. The cells near zeros are hashed into a table of candidates,
+// so checking z is: hash z's cell, look up the candidate, and test whether z is
+// CloseTo it. The hash is plain integer arithmetic, done for a whole block of
+// lanes in a loop that the compiler can vectorize.
+//
+// The table has no collision handling beyond marking slots that two zeros hash
+// to as ambiguous, for which the caller falls back to checking every zero. With
+// the table sized at kSlotsPerZero per zero, that's rare.
+template <typename T>
+class ZeroGrid {
+ public:
+  static constexpr int32_t kNoCandidate = -1;
+  static constexpr int32_t kAmbiguous = -2;
+  static constexpr size_t kSlotsPerZero = 256; // TUNE.
+
+  ZeroGrid(const std::vector<Complex<T>>& zeros, T convergence_radius) {
+    T r_min = zeros[0].r, r_max = zeros[0].r, i_min = zeros[0].i, i_max = zeros[0].i;
+    for (const Complex<T>& zero : zeros) {
+      r_min = std::min(r_min, zero.r);
+      r_max = std::max(r_max, zero.r);
+      i_min = std::min(i_min, zero.i);
+      i_max = std::max(i_max, zero.i);
+    }
+    const T cell_size = convergence_radius * T(4);
+    // Cell coordinates have to fit comfortably in an int32_t. Otherwise (or if
+    // zeros repeat, so the radius is zero) every lookup is ambiguous.
+    const T cells_across = std::max(r_max - r_min, i_max - i_min) / cell_size;
+    if (!(convergence_radius > T(0)) || !(cells_across < T(kMaxCoordinate / 2))) {
+      slots_.assign(2, kAmbiguous);
+      shift_ = 31;
+      return;
+    }
+    inverse_cell_size_ = T(1) / cell_size;
+    // Keeps the cells around zeros at positive coordinates.
+    r_origin_ = r_min - cell_size * T(2);
+    i_origin_ = i_min - cell_size * T(2);
+
+    size_t bits = 1;
+    while ((size_t(1) << bits) < zeros.size() * kSlotsPerZero) {
+      ++bits;
+    }
+    shift_ = 32 - bits;
+    slots_.assign(size_t(1) << bits, kNoCandidate);
+    // A little more than the radius, so that rounding can't put a point that's
+    // CloseTo a zero in a cell that was left out.
+    const T reach = convergence_radius * T(1.01);
+    for (size_t z = 0; z < zeros.size(); ++z) {
+      // Every cell that a point within the convergence radius could be in.
+      const Complex<T>& zero = zeros[z];
+      const int32_t x_min = CellCoordinate((zero.r - reach - r_origin_) * inverse_cell_size_);
+      const int32_t x_max = CellCoordinate((zero.r + reach - r_origin_) * inverse_cell_size_);
+      const int32_t y_min = CellCoordinate((zero.i - reach - i_origin_) * inverse_cell_size_);
+      const int32_t y_max = CellCoordinate((zero.i + reach - i_origin_) * inverse_cell_size_);
+      for (int32_t y = y_min; y <= y_max; ++y) {
+	for (int32_t x = x_min; x <= x_max; ++x) {
+	  int32_t& slot = slots_[Hash(x, y)];
+	  if (slot == kNoCandidate) {
+	    slot = z;
+	  } else if (slot != static_cast<int32_t>(z)) {
+	    slot = kAmbiguous;
+	  }
+	}
+      }
+    }
+  }
+
+  // The index of the only zero that z could be CloseTo, or kNoCandidate if
+  // there isn't one, or kAmbiguous.
+  int32_t Candidate(const Complex<T>& z) const {
+    return slots_[Slot(z.r, z.i)];
+  }
+
+  template <size_t N>
+  void Candidates(const ComplexArray<T, N>& block, std::array<int32_t, N>* candidates) const {
+    std::array<uint32_t, N> slots;
+    for (size_t b = 0; b < N; ++b) {
+      slots[b] = Slot(block.rs(b), block.is(b));
+    }
+    for (size_t b = 0; b < N; ++b) {
+      (*candidates)[b] = slots_[slots[b]];
+    }
+  }
+
+ private:
+  static constexpr int32_t kMaxCoordinate = 1 << 30;
+
+  // Rounds towards zero, which is fine as it's the same for zeros and lookups,
+  // and clamps (NaNs included) so that the conversion is always defined.
+  static int32_t CellCoordinate(T t) {
+    const double d = static_cast<double>(t);
+    const double clamped_below = d > -kMaxCoordinate ? d : -kMaxCoordinate;
+    const double clamped = clamped_below < kMaxCoordinate ? clamped_below : kMaxCoordinate;
+    return static_cast<int32_t>(clamped);
+  }
+
+  uint32_t Hash(int32_t x, int32_t y) const {
+    return (static_cast<uint32_t>(x) * 0x9E3779B1u + static_cast<uint32_t>(y) * 0x85EBCA77u) >> shift_;
+  }
+
+  uint32_t Slot(T r, T i) const {
+    return Hash(CellCoordinate((r - r_origin_) * inverse_cell_size_),
+		CellCoordinate((i - i_origin_) * inverse_cell_size_));
+  }
+
+  T inverse_cell_size_ = T(0);
+  T r_origin_ = T(0);
+  T i_origin_ = T(0);
+  uint32_t shift_;
+  std::vector<int32_t> slots_;
+};
+
+#endif // _CROW_FRACTAL_SERVER_ZERO_GRID_
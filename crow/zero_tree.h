@@ -0,0 +1,637 @@
+#ifndef _CROW_FRACTAL_SERVER_ZERO_TREE_
+#define _CROW_FRACTAL_SERVER_ZERO_TREE_
+
+#include <vector>
+#include <array>
+#include <optional>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <cmath>
+#include <type_traits>
+#include <memory>
+#include <mutex>
+#include <list>
+#include <utility>
+#include <stdint.h>
+
+#include "complex.h"
+#include "complex_array.h"
+
+// Polynomials with at least this many zeros are iterated with a ZeroTree,
+// rather than by evaluating p and p' directly.
+constexpr size_t kZeroTreeMinZeros = 100; // TUNE.
+
+// For polynomials of high degree (hundreds to thousands of zeros), where
+// evaluating p and p' costs O(degree) per iterate. Newton's step is
+// z -= p(z) / p'(z), and p'(z) / p(z) = sum_i 1 / (z - zero_i), which this sums
+// in roughly constant time per iterate, after a fast multipole style setup:
+//
+// - A square about twice the size of the zeros' bounding box is cut into a
+//   grid of cells, with a few zeros in each cell that has any. Each cell keeps
+//   a list of the zeros in it and its 8 neighbours, which are summed directly,
+//   and a Taylor series about its center for all the other zeros, which are at
+//   least 1.5 cells away:
+//
+//     sum_far 1 / (z - zero_i) = sum_k L_k (z - center)^k,
+//     where L_k = -sum_far 1 / (zero_i - center)^(k+1)
+//
+//   Those are built fast multipole style, from coarser grids (see BuildGrid).
+//
+// - Outside the grid (or if the zeros are all equal, so there's no grid), a
+//   quadtree of clusters of zeros is used. Seen from far enough away, a
+//   cluster's share of the sum is a series in 1 / (z - center) (a multipole
+//   expansion):
+//
+//     sum_i 1 / (z - zero_i) = sum_k M_k / (z - center)^(k+1),
+//     where M_k = sum_i (zero_i - center)^k
+//
+//   so only nearby clusters need opening, making this O(log degree). The same
+//   tree finds the closest zero, and the zero an iterate has converged to.
+//
+// All series have enough terms that they are as accurate as summing directly.
+template <typename T>
+class ZeroTree {
+ public:
+  // Clusters are treated as far away from points more than 1 / kTheta of
+  // their radius from their center.
+  static constexpr double kTheta = 0.5; // TUNE.
+  static constexpr size_t kLeafZeros = 8; // TUNE.
+  static constexpr size_t kMaxDepth = 24;
+
+  static constexpr size_t kZerosPerCell = 4; // TUNE.
+  static constexpr double kGridPadding = 2.0; // TUNE.
+  static constexpr size_t kMaxGridLevels = 9;
+
+  explicit ZeroTree(const std::vector<Complex<T>>& zeros) {
+    using std::pow;
+    // Enough terms that series are as accurate as T.
+    tree_order_ = SeriesOrder(kTheta);
+    inverse_sqr_theta_ = T(1.0 / (kTheta * kTheta));
+
+    std::vector<uint32_t> order(zeros.size());
+    std::iota(order.begin(), order.end(), 0);
+    nodes_.emplace_back();
+    Build(zeros, order, 0, order.size(), 0, 0);
+    zeros_.reserve(order.size());
+    for (uint32_t i : order) {
+      zeros_.push_back(zeros[i]);
+    }
+    original_index_ = std::move(order);
+    min_zero_spacing_ = ComputeMinZeroSpacing();
+
+    BuildGrid(zeros);
+  }
+
+  // p'(z) / p(z).
+  Complex<T> LogDerivative(const Complex<T>& z) const {
+    const std::optional<size_t> cell = CellContaining(z);
+    if (!cell.has_value()) {
+      return TreeLogDerivative(z);
+    }
+    // Horner's rule in (z - center) / cell size, as the coefficients are scaled
+    // by cell size^k.
+    const Complex<T> w = z - cells_[*cell].center;
+    const Complex<T> v(w.r * inverse_cell_size_, w.i * inverse_cell_size_);
+    const Complex<T>* locals = &locals_[*cell * grid_order_];
+    Complex<T> sum = locals[grid_order_ - 1];
+    for (size_t k = grid_order_ - 1; k > 0; --k) {
+      sum = sum * v + locals[k - 1];
+    }
+    const Cell& c = cells_[*cell];
+    for (uint32_t i = c.first_near; i < c.first_near + c.near_count; ++i) {
+      const T dr = z.r - near_rs_[i];
+      const T di = z.i - near_is_[i];
+      const T inverse_sqr_magnitude = T(1) / (dr * dr + di * di);
+      sum.r += dr * inverse_sqr_magnitude;
+      sum.i -= di * inverse_sqr_magnitude;
+    }
+    return sum;
+  }
+
+  // LogDerivative() using only the tree.
+  Complex<T> TreeLogDerivative(const Complex<T>& z) const {
+    Complex<T> sum(T(0), T(0));
+    std::array<uint32_t, 3 * kMaxDepth + 4> stack;
+    size_t stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+      const Node& node = nodes_[stack[--stack_size]];
+      const Complex<T> w = z - node.center;
+      // Written so that NaNs take the series, rather than opening everything.
+      if (!(w.sqr_magnitude() <= node.sqr_far_radius)) {
+	// Horner's rule in (radius / w), as the moments are scaled by radius^k.
+	const Complex<T> u = Complex<T>(T(1), T(0)) / w;
+	const Complex<T> v(u.r * node.radius, u.i * node.radius);
+	const Complex<T>* moments = &moments_[node.first_moment];
+	Complex<T> series = moments[tree_order_ - 1];
+	for (size_t k = tree_order_ - 1; k > 0; --k) {
+	  series = series * v + moments[k - 1];
+	}
+	sum += series * u;
+      } else if (node.child_count == 0) {
+	for (uint32_t i = node.first_zero; i < node.first_zero + node.zero_count; ++i) {
+	  const Complex<T> d = z - zeros_[i];
+	  const T inverse_sqr_magnitude = T(1) / d.sqr_magnitude();
+	  sum += Complex<T>(d.r * inverse_sqr_magnitude, -d.i * inverse_sqr_magnitude);
+	}
+      } else {
+	for (uint32_t c = 0; c < node.child_count; ++c) {
+	  stack[stack_size++] = node.first_child + c;
+	}
+      }
+    }
+    return sum;
+  }
+
+  void NewtonIter(Complex<T>* z) const {
+    *z -= Complex<T>(T(1), T(0)) / LogDerivative(*z);
+  }
+
+  // Lane by lane: which clusters are near differs from lane to lane.
+  template <size_t N>
+  void NewtonIter(ComplexArray<T, N>* block) const {
+    for (size_t b = 0; b < N; ++b) {
+      Complex<T> z = block->get(b);
+      NewtonIter(&z);
+      block->rs(b) = z.r;
+      block->is(b) = z.i;
+    }
+  }
+
+  // The index of the zero that z is CloseTo, if any. Like scanning all the
+  // zeros in order, given that at most one zero is that close.
+  std::optional<size_t> FindCloseZero(const Complex<T>& z,
+				      T radius,
+				      T sqr_radius) const {
+    // Zeros that close are in the same or a neighbouring cell, as long as the
+    // radius is under a cell across, which it is for ConservativeConvergenceRadius.
+    const std::optional<size_t> cell = CellContaining(z);
+    if (cell.has_value() && radius < cell_size_) {
+      const Cell& c = cells_[*cell];
+      for (uint32_t i = c.first_near; i < c.first_near + c.near_count; ++i) {
+	if (z.CloseTo(Complex<T>(near_rs_[i], near_is_[i]), radius, sqr_radius)) {
+	  return near_index_[i];
+	}
+      }
+      return std::nullopt;
+    }
+    std::array<uint32_t, 3 * kMaxDepth + 4> stack;
+    size_t stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+      const Node& node = nodes_[stack[--stack_size]];
+      const T reach = node.radius + radius;
+      if (!((z - node.center).sqr_magnitude() <= reach * reach)) {
+	continue;
+      }
+      if (node.child_count == 0) {
+	for (uint32_t i = node.first_zero; i < node.first_zero + node.zero_count; ++i) {
+	  if (z.CloseTo(zeros_[i], radius, sqr_radius)) {
+	    return original_index_[i];
+	  }
+	}
+      } else {
+	for (uint32_t c = 0; c < node.child_count; ++c) {
+	  stack[stack_size++] = node.first_child + c;
+	}
+      }
+    }
+    return std::nullopt;
+  }
+
+  // The index of the zero closest to z, the lowest index on ties, like
+  // ClosestZero().
+  size_t ClosestZero(const Complex<T>& z) const {
+    using std::sqrt;
+    // Stays put for NaNs, like ClosestZero().
+    size_t closest = 0;
+    T closest_sqr_magnitude = std::numeric_limits<T>::infinity();
+    std::array<uint32_t, 3 * kMaxDepth + 4> stack;
+    size_t stack_size = 0;
+    stack[stack_size++] = 0;
+    while (stack_size > 0) {
+      const Node& node = nodes_[stack[--stack_size]];
+      const T lower_bound = sqrt((z - node.center).sqr_magnitude()) - node.radius;
+      if (!(lower_bound <= T(0) || lower_bound * lower_bound <= closest_sqr_magnitude)) {
+	continue;
+      }
+      if (node.child_count == 0) {
+	for (uint32_t i = node.first_zero; i < node.first_zero + node.zero_count; ++i) {
+	  const T sqr_magnitude = (z - zeros_[i]).sqr_magnitude();
+	  if (sqr_magnitude < closest_sqr_magnitude ||
+	      (sqr_magnitude == closest_sqr_magnitude && original_index_[i] < closest)) {
+	    closest_sqr_magnitude = sqr_magnitude;
+	    closest = original_index_[i];
+	  }
+	}
+      } else {
+	for (uint32_t c = 0; c < node.child_count; ++c) {
+	  stack[stack_size++] = node.first_child + c;
+	}
+      }
+    }
+    return closest;
+  }
+
+  // The smallest distance between two zeros, as ConservativeConvergenceRadius()
+  // needs. Worked out once when the tree is built.
+  T MinZeroSpacing() const {
+    return min_zero_spacing_;
+  }
+
+  size_t node_count() const {
+    return nodes_.size();
+  }
+
+  size_t cell_count() const {
+    return cells_.size();
+  }
+
+ private:
+  // MinZeroSpacing() without comparing every pair, by skipping nodes that are
+  // further away than the closest pair so far.
+  T ComputeMinZeroSpacing() const {
+    using std::sqrt;
+    T min_sqr_distance = std::numeric_limits<T>::infinity();
+    for (uint32_t i = 0; i < zeros_.size(); ++i) {
+      const Complex<T>& z = zeros_[i];
+      std::array<uint32_t, 3 * kMaxDepth + 4> stack;
+      size_t stack_size = 0;
+      stack[stack_size++] = 0;
+      while (stack_size > 0) {
+	const Node& node = nodes_[stack[--stack_size]];
+	const T lower_bound = sqrt((z - node.center).sqr_magnitude()) - node.radius;
+	if (lower_bound > T(0) && lower_bound * lower_bound >= min_sqr_distance) {
+	  continue;
+	}
+	if (node.child_count == 0) {
+	  for (uint32_t j = node.first_zero; j < node.first_zero + node.zero_count; ++j) {
+	    if (j != i) {
+	      min_sqr_distance = std::min(min_sqr_distance, (z - zeros_[j]).sqr_magnitude());
+	    }
+	  }
+	} else {
+	  for (uint32_t c = 0; c < node.child_count; ++c) {
+	    stack[stack_size++] = node.first_child + c;
+	  }
+	}
+      }
+    }
+    return sqrt(min_sqr_distance);
+  }
+
+  struct Node {
+    // Every zero in the cluster is within `radius` of `center`.
+    Complex<T> center;
+    T radius;
+    // (radius / theta)^2: points further than this use the series.
+    T sqr_far_radius;
+    // Zeros [first_zero, first_zero + zero_count) of zeros_.
+    uint32_t first_zero;
+    uint32_t zero_count;
+    // Children are nodes [first_child, first_child + child_count).
+    uint32_t first_child;
+    uint32_t child_count;
+    // M_0 .. M_(tree_order_ - 1), divided by radius^k, are moments_[first_moment...].
+    uint32_t first_moment;
+  };
+
+  // Fills in nodes_[index] for order[begin, end), and adds its descendants,
+  // reordering that range so that each descendant's zeros are contiguous.
+  void Build(const std::vector<Complex<T>>& zeros,
+	     std::vector<uint32_t>& order,
+	     size_t begin,
+	     size_t end,
+	     size_t depth,
+	     uint32_t index) {
+    using std::sqrt;
+
+    // Centering on the mean makes M_1 zero, and keeps the radius small.
+    Complex<T> center(T(0), T(0));
+    for (size_t i = begin; i < end; ++i) {
+      center += zeros[order[i]];
+    }
+    const T count = T(static_cast<double>(end - begin));
+    center = Complex<T>(center.r / count, center.i / count);
+    T sqr_radius = T(0);
+    for (size_t i = begin; i < end; ++i) {
+      sqr_radius = std::max(sqr_radius, (zeros[order[i]] - center).sqr_magnitude());
+    }
+
+    // Scaled by radius^k, so that they stay in range (e.g. for float) however
+    // big the cluster is.
+    const T radius = sqrt(sqr_radius);
+    const T inverse_radius = radius > T(0) ? T(1) / radius : T(0);
+    const uint32_t first_moment = moments_.size();
+    moments_.resize(moments_.size() + tree_order_, Complex<T>(T(0), T(0)));
+    for (size_t i = begin; i < end; ++i) {
+      const Complex<T> d_unscaled = zeros[order[i]] - center;
+      const Complex<T> d(d_unscaled.r * inverse_radius, d_unscaled.i * inverse_radius);
+      Complex<T> d_pow(T(1), T(0));
+      for (size_t k = 0; k < tree_order_; ++k) {
+	moments_[first_moment + k] += d_pow;
+	d_pow *= d;
+      }
+    }
+
+    uint32_t first_child = 0;
+    uint32_t child_count = 0;
+    if (end - begin > kLeafZeros && depth < kMaxDepth) {
+      // Split into quadrants around the center.
+      auto left = [&](uint32_t i) { return zeros[i].r < center.r; };
+      auto below = [&](uint32_t i) { return zeros[i].i < center.i; };
+      const size_t split = std::partition(
+	  order.begin() + begin, order.begin() + end, left) - order.begin();
+      const size_t splits[] = {
+	begin,
+	static_cast<size_t>(std::partition(
+	    order.begin() + begin, order.begin() + split, below) - order.begin()),
+	split,
+	static_cast<size_t>(std::partition(
+	    order.begin() + split, order.begin() + end, below) - order.begin()),
+	end,
+      };
+      // Children have to be contiguous in nodes_, but building one appends its
+      // own descendants, so make room for all of them up front.
+      std::vector<std::pair<size_t, size_t>> quadrants;
+      for (size_t q = 0; q < 4; ++q) {
+	if (splits[q] < splits[q + 1]) {
+	  quadrants.emplace_back(splits[q], splits[q + 1]);
+	}
+      }
+      if (quadrants.size() > 1) {
+	first_child = nodes_.size();
+	child_count = quadrants.size();
+	nodes_.resize(nodes_.size() + child_count);
+	for (uint32_t c = 0; c < child_count; ++c) {
+	  Build(zeros, order, quadrants[c].first, quadrants[c].second, depth + 1,
+		first_child + c);
+	}
+      }
+    }
+
+    nodes_[index] = {
+      .center = center,
+      .radius = radius,
+      .sqr_far_radius = sqr_radius * inverse_sqr_theta_,
+      .first_zero = static_cast<uint32_t>(begin),
+      .zero_count = static_cast<uint32_t>(end - begin),
+      .first_child = first_child,
+      .child_count = child_count,
+      .first_moment = first_moment,
+    };
+  }
+
+  struct Cell {
+    Complex<T> center;
+    // The zeros in this cell and its neighbours are near_*_[first_near, first_near + near_count).
+    uint32_t first_near;
+    uint32_t near_count;
+  };
+
+  // How many terms of a series whose terms shrink by `ratio` it takes to get
+  // to T's epsilon.
+  static size_t SeriesOrder(double ratio) {
+    const double epsilon = static_cast<double>(std::numeric_limits<T>::epsilon());
+    return static_cast<size_t>(std::ceil(std::log(epsilon) / std::log(ratio))) + 1;
+  }
+
+  std::optional<size_t> CellContaining(const Complex<T>& z) const {
+    if (cells_.empty()) {
+      return std::nullopt;
+    }
+    const double x = static_cast<double>((z.r - grid_r_min_) * inverse_cell_size_);
+    const double y = static_cast<double>((z.i - grid_i_min_) * inverse_cell_size_);
+    // Written so that NaNs fail.
+    if (!(x >= 0.0 && y >= 0.0 && x < grid_size_ && y < grid_size_)) {
+      return std::nullopt;
+    }
+    return static_cast<size_t>(y) * grid_size_ + static_cast<size_t>(x);
+  }
+
+  // Builds the grid's cells fast multipole style, from the coarsest level of
+  // cells (just one) down: each cell's Taylor series is its parent's re-centred
+  // on it, plus the zeros in its interaction list (the cells next to its
+  // parent's neighbours, but not next to it). So each zero is summed into at
+  // most 27 cells per level, rather than into every cell.
+  void BuildGrid(const std::vector<Complex<T>>& zeros) {
+    const size_t n = zeros.size();
+    T r_min = zeros[0].r, r_max = zeros[0].r, i_min = zeros[0].i, i_max = zeros[0].i;
+    for (const Complex<T>& zero : zeros) {
+      r_min = std::min(r_min, zero.r);
+      r_max = std::max(r_max, zero.r);
+      i_min = std::min(i_min, zero.i);
+      i_max = std::max(i_max, zero.i);
+    }
+    const T side = std::max(r_max - r_min, i_max - i_min);
+    if (!(side > T(0))) {
+      return;
+    }
+    // The grid covers a little more than kGridPadding times the bounding box,
+    // so that points outside it are far enough from the zeros that the tree
+    // only has to open a few clusters.
+    const double cells = kGridPadding * kGridPadding * n / kZerosPerCell;
+    const size_t levels = std::clamp<size_t>(
+	static_cast<size_t>(std::round(std::log(cells) / std::log(4.0))), 1, kMaxGridLevels);
+    grid_size_ = size_t(1) << levels;
+    cell_size_ = side * T(kGridPadding * (1.0 + 1.0 / 1024)) / T(grid_size_);
+    inverse_cell_size_ = T(1) / cell_size_;
+    grid_r_min_ = (r_min + r_max) / T(2) - cell_size_ * T(grid_size_) / T(2);
+    grid_i_min_ = (i_min + i_max) / T(2) - cell_size_ * T(grid_size_) / T(2);
+
+    // Far zeros are at least 1.5 cells from the center, and points in the cell
+    // at most 1/sqrt(2) cells, so terms shrink by at least this much.
+    grid_order_ = SeriesOrder(0.7071067811865476 / 1.5);
+    const size_t order = grid_order_;
+
+    std::vector<size_t> zero_xs(n), zero_ys(n);
+    for (size_t i = 0; i < n; ++i) {
+      zero_xs[i] = std::min(static_cast<size_t>(static_cast<double>(
+	  (zeros[i].r - grid_r_min_) * inverse_cell_size_)), grid_size_ - 1);
+      zero_ys[i] = std::min(static_cast<size_t>(static_cast<double>(
+	  (zeros[i].i - grid_i_min_) * inverse_cell_size_)), grid_size_ - 1);
+    }
+
+    // Re-centring a series on a child's center (with coefficients scaled by
+    // cell size^k, which halves) multiplies it by one of four matrices:
+    // child_k = sum_(j >= k) parent_j * C(j, k) * offset^(j-k) / 2^k,
+    // where offset = (child center - parent center) / parent cell size.
+    std::array<std::vector<Complex<T>>, 4> shifts;
+    for (size_t q = 0; q < 4; ++q) {
+      const ComplexD offset((q & 1) ? 0.25 : -0.25, (q & 2) ? 0.25 : -0.25);
+      std::vector<ComplexD> offset_pows(order, ComplexD(1, 0));
+      for (size_t k = 1; k < order; ++k) {
+	offset_pows[k] = offset_pows[k - 1] * offset;
+      }
+      shifts[q].assign(order * order, Complex<T>(T(0), T(0)));
+      for (size_t j = 0; j < order; ++j) {
+	double binomial = 1.0; // C(j, k)
+	for (size_t k = 0; k <= j; ++k) {
+	  const ComplexD entry = offset_pows[j - k] * ComplexD(binomial * std::ldexp(1.0, -k), 0);
+	  shifts[q][j * order + k] = Complex<T>(T(entry.r), T(entry.i));
+	  binomial = binomial * (j - k) / (k + 1);
+	}
+      }
+    }
+
+    // Level 0 is one cell, with no far zeros.
+    std::vector<Complex<T>> parent_locals(order, Complex<T>(T(0), T(0)));
+    std::vector<T> sum_rs(order), sum_is(order);
+    for (size_t level = 1; level <= levels; ++level) {
+      const size_t size = size_t(1) << level;
+      const size_t shift = levels - level;
+      const T level_cell_size = cell_size_ * T(grid_size_ >> level);
+      const T inverse_level_cell_size = T(1) / level_cell_size;
+
+      // The zeros in cell c of this level are cell_zeros[cell_starts[c]...].
+      std::vector<uint32_t> cell_starts(size * size + 1, 0);
+      for (size_t i = 0; i < n; ++i) {
+	++cell_starts[(zero_ys[i] >> shift) * size + (zero_xs[i] >> shift) + 1];
+      }
+      std::partial_sum(cell_starts.begin(), cell_starts.end(), cell_starts.begin());
+      std::vector<uint32_t> cell_zeros(n);
+      {
+	std::vector<uint32_t> next(cell_starts.begin(), cell_starts.end() - 1);
+	for (size_t i = 0; i < n; ++i) {
+	  cell_zeros[next[(zero_ys[i] >> shift) * size + (zero_xs[i] >> shift)]++] = i;
+	}
+      }
+
+      std::vector<Complex<T>> locals(size * size * order, Complex<T>(T(0), T(0)));
+      for (size_t y = 0; y < size; ++y) {
+	for (size_t x = 0; x < size; ++x) {
+	  Complex<T>* local = &locals[(y * size + x) * order];
+	  const Complex<T>* parent = &parent_locals[((y / 2) * (size / 2) + x / 2) * order];
+	  const std::vector<Complex<T>>& shift_matrix = shifts[(x & 1) + 2 * (y & 1)];
+	  for (size_t j = 0; j < order; ++j) {
+	    for (size_t k = 0; k <= j; ++k) {
+	      local[k] += parent[j] * shift_matrix[j * order + k];
+	    }
+	  }
+
+	  // (cell size / (zero - center))^(k+1), summed over the interaction list.
+	  const Complex<T> center(grid_r_min_ + (T(x) + T(0.5)) * level_cell_size,
+				  grid_i_min_ + (T(y) + T(0.5)) * level_cell_size);
+	  std::fill(sum_rs.begin(), sum_rs.end(), T(0));
+	  std::fill(sum_is.begin(), sum_is.end(), T(0));
+	  const size_t x_begin = (x / 2) * 2 >= 2 ? (x / 2) * 2 - 2 : 0;
+	  const size_t y_begin = (y / 2) * 2 >= 2 ? (y / 2) * 2 - 2 : 0;
+	  const size_t x_end = std::min((x / 2) * 2 + 4, size);
+	  const size_t y_end = std::min((y / 2) * 2 + 4, size);
+	  for (size_t ny = y_begin; ny < y_end; ++ny) {
+	    for (size_t nx = x_begin; nx < x_end; ++nx) {
+	      if (nx + 1 >= x && nx <= x + 1 && ny + 1 >= y && ny <= y + 1) {
+		continue;
+	      }
+	      const size_t neighbour = ny * size + nx;
+	      for (uint32_t c = cell_starts[neighbour]; c < cell_starts[neighbour + 1]; ++c) {
+		const Complex<T>& zero = zeros[cell_zeros[c]];
+		const T ar = zero.r - center.r;
+		const T ai = zero.i - center.i;
+		const T scale = level_cell_size / (ar * ar + ai * ai);
+		const T br = ar * scale;
+		const T bi = -ai * scale;
+		T pow_r = br;
+		T pow_i = bi;
+		for (size_t k = 0; k < order; ++k) {
+		  sum_rs[k] += pow_r;
+		  sum_is[k] += pow_i;
+		  const T r = pow_r * br - pow_i * bi;
+		  pow_i = pow_r * bi + pow_i * br;
+		  pow_r = r;
+		}
+	      }
+	    }
+	  }
+	  // L_k * cell size^k = -sum b^(k+1) / cell size.
+	  for (size_t k = 0; k < order; ++k) {
+	    local[k] -= Complex<T>(sum_rs[k] * inverse_level_cell_size,
+				   sum_is[k] * inverse_level_cell_size);
+	  }
+	}
+      }
+      parent_locals = std::move(locals);
+    }
+    locals_ = std::move(parent_locals);
+
+    // The zeros to sum directly, for each cell of the finest level.
+    cells_.resize(grid_size_ * grid_size_);
+    std::vector<std::vector<uint32_t>> cell_zeros(cells_.size());
+    for (size_t i = 0; i < n; ++i) {
+      cell_zeros[zero_ys[i] * grid_size_ + zero_xs[i]].push_back(i);
+    }
+    for (size_t y = 0; y < grid_size_; ++y) {
+      for (size_t x = 0; x < grid_size_; ++x) {
+	Cell& cell = cells_[y * grid_size_ + x];
+	cell.center = Complex<T>(grid_r_min_ + (T(x) + T(0.5)) * cell_size_,
+				 grid_i_min_ + (T(y) + T(0.5)) * cell_size_);
+	cell.first_near = near_rs_.size();
+	for (size_t ny = (y > 0 ? y - 1 : 0); ny < std::min(y + 2, grid_size_); ++ny) {
+	  for (size_t nx = (x > 0 ? x - 1 : 0); nx < std::min(x + 2, grid_size_); ++nx) {
+	    for (uint32_t i : cell_zeros[ny * grid_size_ + nx]) {
+	      near_rs_.push_back(zeros[i].r);
+	      near_is_.push_back(zeros[i].i);
+	      near_index_.push_back(i);
+	    }
+	  }
+	}
+	cell.near_count = near_rs_.size() - cell.first_near;
+      }
+    }
+  }
+
+  // The grid, if any: grid_size_ x grid_size_ cells, starting from
+  // (grid_r_min_, grid_i_min_).
+  size_t grid_size_ = 0;
+  size_t grid_order_ = 0;
+  T cell_size_;
+  T inverse_cell_size_;
+  T grid_r_min_;
+  T grid_i_min_;
+  std::vector<Cell> cells_;
+  // Cell c's Taylor coefficients, scaled by cell size^k, are
+  // locals_[c * grid_order_...].
+  std::vector<Complex<T>> locals_;
+  std::vector<T> near_rs_;
+  std::vector<T> near_is_;
+  std::vector<uint32_t> near_index_;
+
+  size_t tree_order_;
+  T inverse_sqr_theta_;
+  std::vector<Node> nodes_;
+  std::vector<Complex<T>> moments_;
+  // Sorted so that each node's zeros are contiguous.
+  std::vector<Complex<T>> zeros_;
+  // zeros_[i] is the original_index_[i]th zero that the tree was built from.
+  std::vector<uint32_t> original_index_;
+  T min_zero_spacing_;
+};
+
+// Building a ZeroTree is slow-ish (see BuildGrid), and the zeros only change
+// when they're edited, so the few most recently used for each T are kept for
+// reuse. More than one, so that sessions drawing different polynomials (or a
+// save job of an older one) don't keep evicting each other's.
+constexpr size_t kZeroTreeCacheSize = 4; // TUNE.
+
+template <typename T>
+std::shared_ptr<const ZeroTree<T>> GetZeroTree(const std::vector<Complex<T>>& zeros) {
+  using Entry = std::pair<std::vector<Complex<T>>, std::shared_ptr<const ZeroTree<T>>>;
+  static std::mutex mutex;
+  // Most recently used first.
+  static std::list<Entry> cache;
+  std::lock_guard<std::mutex> lock(mutex);
+  for (auto it = cache.begin(); it != cache.end(); ++it) {
+    if (it->first == zeros) {
+      cache.splice(cache.begin(), cache, it);
+      return it->second;
+    }
+  }
+  cache.emplace_front(zeros, std::make_shared<const ZeroTree<T>>(zeros));
+  if (cache.size() > kZeroTreeCacheSize) {
+    cache.pop_back();
+  }
+  return cache.front().second;
+}
+
+#endif // _CROW_FRACTAL_SERVER_ZERO_TREE_
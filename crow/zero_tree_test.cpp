@@ -0,0 +1,127 @@
+#include <iostream>
+#include <cstdlib>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "zero_tree.h"
+
+// ZeroTree's series are meant to be as accurate as T. Errors are measured
+// relative to the sum of the terms' magnitudes, since that's what rounding in
+// direct summation is relative to too.
+constexpr double kMaxRelativeError = 1e-13; // TUNE.
+
+// p'(z) / p(z) = sum 1 / (z - zero), summed directly in long double.
+ComplexD DirectLogDerivative(const std::vector<ComplexD>& zeros, const ComplexD& z,
+			     double* scale) {
+  long double r = 0.0, i = 0.0, magnitudes = 0.0;
+  for (const ComplexD& zero : zeros) {
+    const long double dr = static_cast<long double>(z.r) - zero.r;
+    const long double di = static_cast<long double>(z.i) - zero.i;
+    const long double sqr_magnitude = dr * dr + di * di;
+    r += dr / sqr_magnitude;
+    i -= di / sqr_magnitude;
+    magnitudes += 1.0L / std::sqrt(sqr_magnitude);
+  }
+  *scale = static_cast<double>(magnitudes);
+  return ComplexD(static_cast<double>(r), static_cast<double>(i));
+}
+
+// The index of the zero closest to z, checking every zero.
+size_t DirectClosestZero(const std::vector<ComplexD>& zeros, const ComplexD& z) {
+  size_t closest = 0;
+  for (size_t i = 1; i < zeros.size(); ++i) {
+    if ((z - zeros[i]).sqr_magnitude() < (z - zeros[closest]).sqr_magnitude()) {
+      closest = i;
+    }
+  }
+  return closest;
+}
+
+// Evaluates the tree for the zeros at points all over (and beyond) them, and
+// right next to each of them, and checks it against direct summation. Returns
+// whether it's within the tolerance everywhere.
+bool CheckTree(const std::string& name, const std::vector<ComplexD>& zeros) {
+  const ZeroTree<double> tree(zeros);
+  std::vector<ComplexD> points;
+  for (int y = -40; y <= 40; ++y) {
+    for (int x = -40; x <= 40; ++x) {
+      points.push_back(ComplexD(0.05 * x + 0.0123, 0.05 * y - 0.0071));
+    }
+  }
+  const double spacing = tree.MinZeroSpacing();
+  for (const ComplexD& zero : zeros) {
+    points.push_back(zero + ComplexD(0.3 * spacing, -0.1 * spacing));
+  }
+
+  double max_error = 0.0;
+  double max_tree_only_error = 0.0;
+  size_t wrong_closest = 0;
+  for (const ComplexD& z : points) {
+    double scale;
+    const ComplexD direct = DirectLogDerivative(zeros, z, &scale);
+    max_error = std::max(max_error, (tree.LogDerivative(z) - direct).magnitude() / scale);
+    max_tree_only_error = std::max(max_tree_only_error,
+				   (tree.TreeLogDerivative(z) - direct).magnitude() / scale);
+    wrong_closest += (tree.ClosestZero(z) != DirectClosestZero(zeros, z));
+  }
+  const bool ok = max_error <= kMaxRelativeError && max_tree_only_error <= kMaxRelativeError &&
+    wrong_closest == 0;
+  std::cout << name << ": " << zeros.size() << " zeros, " << tree.node_count() << " nodes, "
+	    << tree.cell_count() << " cells, max relative error: " << max_error
+	    << " (tree only: " << max_tree_only_error << "), wrong closest zeros: "
+	    << wrong_closest << (ok ? "" : " -- FAILED") << std::endl;
+  return ok;
+}
+
+// Checks that GetZeroTree() hands back the same tree for a zero set it has
+// seen recently, even after building trees for others in between.
+bool CheckCache(const std::vector<std::vector<ComplexD>>& zero_sets) {
+  std::vector<std::shared_ptr<const ZeroTree<double>>> trees;
+  for (const std::vector<ComplexD>& zeros : zero_sets) {
+    trees.push_back(GetZeroTree(zeros));
+  }
+  bool ok = true;
+  for (size_t i = 0; i < zero_sets.size(); ++i) {
+    ok &= (GetZeroTree(zero_sets[i]) == trees[i]);
+  }
+  std::cout << "cache: " << zero_sets.size() << " zero sets"
+	    << (ok ? " reused" : " -- FAILED, rebuilt") << std::endl;
+  return ok;
+}
+
+int main() {
+  std::mt19937 random(1);
+  std::uniform_real_distribution<double> uniform(-1.0, 1.0);
+  auto random_zeros = [&](size_t count) {
+    std::vector<ComplexD> zeros;
+    for (size_t i = 0; i < count; ++i) {
+      zeros.push_back(ComplexD(uniform(random), uniform(random)));
+    }
+    return zeros;
+  };
+
+  // Tight clusters, far apart, so that whole subtrees get summed as series.
+  std::vector<ComplexD> clustered;
+  for (int c = 0; c < 20; ++c) {
+    const ComplexD center(uniform(random), uniform(random));
+    for (int i = 0; i < 25; ++i) {
+      clustered.push_back(center + ComplexD(0.01 * uniform(random), 0.01 * uniform(random)));
+    }
+  }
+
+  const std::vector<ComplexD> few = random_zeros(kZeroTreeMinZeros);
+  const std::vector<ComplexD> many = random_zeros(2000);
+
+  bool ok = true;
+  ok &= CheckTree("few", few);
+  ok &= CheckTree("many", many);
+  ok &= CheckTree("clustered", clustered);
+  std::vector<std::vector<ComplexD>> zero_sets = {few, many, clustered};
+  while (zero_sets.size() < kZeroTreeCacheSize) {
+    zero_sets.push_back(random_zeros(kZeroTreeMinZeros));
+  }
+  ok &= CheckCache(zero_sets);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}